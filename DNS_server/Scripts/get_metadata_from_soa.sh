@@ -19,8 +19,14 @@ case $field in
     minimum_ttl)
         grep -E '^[[:space:]]*[0-9]+[[:space:]]*;[[:space:]]*Minimum TTL' "$file_path" | awk '{print $1}'
         ;;
+    mname)
+        grep -E 'IN[[:space:]]+SOA' "$file_path" | awk '{print $4}'
+        ;;
+    rname)
+        grep -E 'IN[[:space:]]+SOA' "$file_path" | awk '{print $5}'
+        ;;
     *)
-        echo "Invalid field. Choose: serial, refresh, retry, expire, minimum_ttl"
+        echo "Invalid field. Choose: serial, refresh, retry, expire, minimum_ttl, mname, rname"
         exit 1
         ;;
 esac
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bloom.h"
+#include "dns_name.h"
+
+#define BLOOM_CACHE_LINE 64
+
+struct BloomFilter* createBloomFilter(size_t expected_names)
+{
+    struct BloomFilter* filter = (struct BloomFilter*)malloc(sizeof(struct BloomFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    size_t bits = (expected_names ? expected_names : 1) * BLOOM_BITS_PER_NAME;
+    size_t nr_blocks = 1;
+    while (nr_blocks * BLOOM_BLOCK_WORDS * 64 < bits) {
+        nr_blocks <<= 1;
+    }
+
+    size_t size = nr_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    filter->blocks = (uint64_t*)aligned_alloc(BLOOM_CACHE_LINE, size);
+    if (filter->blocks == NULL) {
+        free(filter);
+        return NULL;
+    }
+    memset(filter->blocks, 0, size);
+    filter->nr_blocks = nr_blocks;
+    filter->nr_names = 0;
+
+    return filter;
+}
+
+void destroyBloomFilter(struct BloomFilter* filter)
+{
+    if (filter) {
+        free(filter->blocks);
+        free(filter);
+    }
+}
+
+uint64_t bloomHash(const uint8_t* name, size_t len)
+{
+    return dns_name_hash_bytes(name, len, 0);
+}
+
+// the block comes from the high half of the hash, the probes from 9-bit slices of a second mix
+static uint64_t* bloomBlock(const struct BloomFilter* filter, uint64_t hash)
+{
+    return filter->blocks + ((hash >> 32) & (filter->nr_blocks - 1)) * BLOOM_BLOCK_WORDS;
+}
+
+void bloomAdd(struct BloomFilter* filter, uint64_t hash)
+{
+    uint64_t* block = bloomBlock(filter, hash);
+    uint64_t probes = hash * 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < BLOOM_NR_PROBES; i++) {
+        unsigned bit = (probes >> (i * 9)) & 511;
+        block[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    filter->nr_names++;
+}
+
+bool bloomMayContain(const struct BloomFilter* filter, uint64_t hash)
+{
+    const uint64_t* block = bloomBlock(filter, hash);
+    uint64_t probes = hash * 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < BLOOM_NR_PROBES; i++) {
+        unsigned bit = (probes >> (i * 9)) & 511;
+        if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// blocked bloom filter: every name sets BLOOM_NR_PROBES bits inside one 512-bit block, so a check
+// touches a single cache line. "no" is definite, "yes" is a maybe (under 0.1% false positives at
+// BLOOM_BITS_PER_NAME bits per name).
+#define BLOOM_BITS_PER_NAME 16
+#define BLOOM_NR_PROBES 7
+#define BLOOM_BLOCK_WORDS 8 // 64-bit words per block
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct BloomFilter{
+    uint64_t* blocks; // nr_blocks * BLOOM_BLOCK_WORDS words, cache line aligned
+    size_t nr_blocks; // power of two
+    size_t nr_names;
+}BloomFilter;
+
+struct BloomFilter* createBloomFilter(size_t expected_names);
+void destroyBloomFilter(struct BloomFilter* filter);
+// hash of a name in lowercased wire format (see dns_name.h)
+uint64_t bloomHash(const uint8_t* name, size_t len);
+void bloomAdd(struct BloomFilter* filter, uint64_t hash);
+bool bloomMayContain(const struct BloomFilter* filter, uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
 #include "cache.h"
+#include "logger.h"
+#include "dns_packet.h"
+#include "dns_name.h"
 
 struct CacheEntry* createCacheEntry()
 {
@@ -9,6 +14,9 @@ struct CacheEntry* createCacheEntry()
     cache_entry->domain_name = NULL;
     cache_entry->next = NULL;
     cache_entry->record_value = NULL;
+    cache_entry->records = NULL;
+    cache_entry->records_len = 0;
+    cache_entry->nr_records = 0;
     cache_entry->timestamp = 0;
     cache_entry->ttl = 0;
 
@@ -22,13 +30,9 @@ struct DNSCache* initializeDNSCache()
     return cache;
 } 
 
+// names that differ only in case are the same name, and hash like they do on the packet paths (dns_name.h)
 unsigned int hash_function(const char* domain_name) {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *domain_name++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
-    }
-    return hash % MAX_CACHE;
+    return dns_name_hash_dotted(domain_name) % MAX_CACHE;
 }
 
 struct DNSCache* addCacheEntry(struct DNSCache* cache, struct CacheEntry* cache_entry) {
@@ -37,8 +41,8 @@ struct DNSCache* addCacheEntry(struct DNSCache* cache, struct CacheEntry* cache_
 
     // Check if domain already exists
     while (head) {
-        if (strcmp(head->domain_name, cache_entry->domain_name) == 0) {
-            printf("Entry already exists in cache!\n");
+        if (strcasecmp(head->domain_name, cache_entry->domain_name) == 0) {
+            LOG_DEBUG("Entry already exists in cache!\n");
             return cache;
         }
         head = head->next;
@@ -46,18 +50,22 @@ struct DNSCache* addCacheEntry(struct DNSCache* cache, struct CacheEntry* cache_
 
     // Set timestamp and TTL for the new entry
     cache_entry->timestamp = time(NULL); // Current time
-    cache_entry->ttl = TTL_VALUE_CACHE;  // Set default or custom TTL
+    if (cache_entry->ttl == 0) {
+        cache_entry->ttl = TTL_VALUE_CACHE;  // default, unless the records brought their own
+    }
 
     // Add new entry to the front of the list
     cache_entry->next = cache->buckets[hash_index];
     cache->buckets[hash_index] = cache_entry;
-    printf("Entry inserted successfully: %s -> %s\n", cache_entry->domain_name, cache_entry->record_value);
+    LOG_DEBUG("Entry inserted successfully: %s -> %s\n", cache_entry->domain_name, cache_entry->record_value);
 
     return cache;
 }
 
 char* lookupDNSCache(struct DNSCache* cache, char* domain_name) {
-    printDNSCache(cache);
+    if (LOG_ON(LOG_LEVEL_DEBUG)) {
+        printDNSCache(cache);
+    }
     // Clean up expired entries first
     cache = DNSCacheCleanUp(cache);
 
@@ -65,22 +73,22 @@ char* lookupDNSCache(struct DNSCache* cache, char* domain_name) {
     CacheEntry* entry = cache->buckets[hash_index];
 
     while (entry != NULL) {
-        if (strcmp(entry->domain_name, domain_name) == 0) {
+        if (strcasecmp(entry->domain_name, domain_name) == 0) {
             // Refresh timestamp
             entry->timestamp = time(NULL);
-            printf("Cache hit: %s -> %s\n", entry->domain_name, entry->record_value);
+            LOG_DEBUG("Cache hit: %s -> %s\n", entry->domain_name, entry->record_value);
             return entry->record_value;
         }
         entry = entry->next;
     }
 
-    printf("Cache miss for domain: %s\n", domain_name);
+    LOG_DEBUG("Cache miss for domain: %s\n", domain_name);
     return NULL; // Not found
 }
 
 struct DNSCache* DNSCacheCleanUp(struct DNSCache* cache)
 {
-    printf("Cache cleaner\n");
+    LOG_DEBUG("Cache cleaner\n");
     time_t now = time(NULL);
 
     for (int i = 0; i < MAX_CACHE; i++) {
@@ -94,7 +102,7 @@ struct DNSCache* DNSCacheCleanUp(struct DNSCache* cache)
         else{entry = NULL;}
         while (entry != NULL) {
             if (now - entry->timestamp >= entry->ttl) {
-                printf("Removing expired entry: %s\n", entry->domain_name);
+                LOG_DEBUG("Removing expired entry: %s\n", entry->domain_name);
 
                 // Remove the expired entry
                 if (previous == NULL) {
@@ -108,6 +116,7 @@ struct DNSCache* DNSCacheCleanUp(struct DNSCache* cache)
 
                 free(temp->domain_name);
                 free(temp->record_value);
+                free(temp->records);
                 free(temp);
             } else {
                 previous = entry;
@@ -127,9 +136,10 @@ void printDNSCache(struct DNSCache* cache) {
             time_t time_left = entry->ttl - (now - entry->timestamp);
 
             if (time_left > 0) {
-                printf("Domain: %s, Record: %s, TTL Remaining: %ld seconds\n",
+                printf("Domain: %s, Record: %s (%u records), TTL Remaining: %ld seconds\n",
                        entry->domain_name,
                        entry->record_value,
+                       entry->nr_records,
                        time_left);
             }
 
@@ -151,10 +161,58 @@ struct CacheEntry* dns_createNewEntry(const char* domain_name,
     cache_entry->record_value = (char*)malloc((strlen(ip_address) + 1) * sizeof(char));
     strcpy(cache_entry->record_value, ip_address);
 
+    cache_entry->records = NULL;
+    cache_entry->records_len = 0;
+    cache_entry->nr_records = 0;
+
     // These will be set when the entry is added to the cache list
     cache_entry->next = NULL;
     cache_entry->timestamp = 0;
     cache_entry->ttl = 0;
 
     return cache_entry;
-}
\ No newline at end of file
+}
+
+// create a cache entry from a whole upstream response
+struct CacheEntry* dns_createRecordSetEntry(const char* domain_name,
+                                           const struct dns_packet* response)
+{
+    // the text protocol still answers with one address: the first A record, wherever it sits in
+    // a cname chain
+    const struct dns_answer* address = NULL;
+    size_t records_len = 0;
+    uint32_t min_ttl = UINT32_MAX;
+    for (int i = 0; i < response->nr_answers; i++) {
+        const struct dns_answer* rr = &response->answers[i];
+        if (!address && rr->type == DNS_TYPE_A && rr->rdlength == 4) {
+            address = rr;
+        }
+        records_len += strlen(rr->name) + 2 + 10 + rr->rdlength;
+        if (rr->ttl < min_ttl) {
+            min_ttl = rr->ttl;
+        }
+    }
+    if (!address) {
+        return NULL;
+    }
+
+    char ip_address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, address->rdata, ip_address, sizeof(ip_address));
+    struct CacheEntry* cache_entry = dns_createNewEntry(domain_name, ip_address);
+
+    // every record goes into one block, in the order the upstream sent them
+    cache_entry->records = (uint8_t*)malloc(records_len);
+    if (cache_entry->records) {
+        size_t offset = 0;
+        for (int i = 0; i < response->nr_answers; i++) {
+            offset += dns_write_rr(cache_entry->records + offset, records_len - offset, &response->answers[i]);
+        }
+        cache_entry->records_len = offset;
+        cache_entry->nr_records = response->nr_answers;
+    }
+
+    // a ttl of 0 means "don't keep it", which is as close as an entry gets to that
+    cache_entry->ttl = min_ttl > 0 ? min_ttl : 1;
+
+    return cache_entry;
+}
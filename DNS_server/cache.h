@@ -2,6 +2,8 @@
 #define CACHE_H
 
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define MAX_CACHE 100
 #define TTL_VALUE_CACHE 50
@@ -9,6 +11,11 @@
 typedef struct CacheEntry{
     char* domain_name;
     char* record_value; // the ip address of the domain_name
+    // whole answer section of an upstream reply (rrsets, cname chains) in wire format, names
+    // uncompressed; NULL for entries that came from the zone trie
+    uint8_t* records;
+    size_t records_len;
+    uint16_t nr_records;
     time_t ttl;
     time_t timestamp;
     struct CacheEntry* next;
@@ -29,4 +36,9 @@ void printDNSCache(struct DNSCache* cache);
 // create new cache entry filled with relevant data
 struct CacheEntry* dns_createNewEntry(const char* domain_name, const char* ip_address);
 
+// create a cache entry holding every answer record of a parsed upstream response;
+// its ttl is the smallest one among the records. returns NULL if the response has no A record
+struct dns_packet;
+struct CacheEntry* dns_createRecordSetEntry(const char* domain_name, const struct dns_packet* response);
+
 #endif
\ No newline at end of file
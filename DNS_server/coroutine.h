@@ -0,0 +1,39 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// stackless coroutines: a void function written top to bottom that can give up its thread in the
+// middle (CO_AWAIT) and is called again later, from any thread, to carry on where it stopped.
+// the place to carry on from is kept in a Coroutine next to the rest of the request's state, so a
+// waiting request costs that struct and no thread or stack. because there is no stack, locals do
+// not survive an await: whatever is needed after one has to live in the request. built on a switch
+// over __LINE__ (like protothreads): no two awaits on one line, and no switch of its own around one.
+
+typedef struct {
+    int line;     // where the next call carries on; 0 = from the start
+    int failed;   // set by CO_AWAIT when its start expression failed
+} Coroutine;
+
+#define CO_INIT(co) ((co)->line = 0, (co)->failed = 0)
+
+#define CO_BEGIN(co) switch ((co)->line) { case 0:
+
+// suspend until the coroutine is called again. start arranges that call (queues it on a pool, sends
+// a query whose completion makes it, ...) and returns 0, or non-zero if it could not, in which case
+// the coroutine simply carries on with failed set. the resume point is stored before start runs:
+// the call it arranges may come from another thread before this one has returned, so nothing after
+// a successful start may touch the coroutine or its request
+#define CO_AWAIT(co, start)                         \
+    do {                                            \
+        (co)->line = __LINE__;                      \
+        (co)->failed = 0;                           \
+        if ((start) == 0) {                         \
+            return;                                 \
+        }                                           \
+        (co)->failed = 1;                           \
+        __attribute__((fallthrough));               \
+        case __LINE__:;                             \
+    } while (0)
+
+#define CO_END(co) } (co)->line = -1
+
+#endif
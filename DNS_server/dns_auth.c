@@ -0,0 +1,238 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "dns_auth.h"
+#include "dns_name.h"
+#include "dns_writer.h"
+
+#define AUTH_MAX_RECORDS 8                           /* per section */
+#define AUTH_RDATA_MAX (2 * DNS_MAX_NAME_WIRE + 20)  /* SOA: two names and five numbers */
+
+// a response put together on the stack; the records' rdata lives in it too, so nothing is allocated
+struct auth_response {
+    struct dns_packet packet;
+    struct dns_answer answers[AUTH_MAX_RECORDS];
+    struct dns_answer authority[AUTH_MAX_RECORDS];
+    struct dns_answer additional[AUTH_MAX_RECORDS];
+    uint8_t rdata[3 * AUTH_MAX_RECORDS][AUTH_RDATA_MAX];
+    int nr_rdata;
+};
+
+static void auth_init(struct auth_response* r, const struct dns_msg_view* query, char* qname) {
+    memset(&r->packet, 0, sizeof(r->packet));
+    r->nr_rdata = 0;
+
+    r->packet.header = query->header;
+    r->packet.header.qr = QR_RESPONSE;
+    r->packet.header.aa = AA_AUTHORITY;
+    r->packet.header.tc = 0;
+    r->packet.header.ra = 1;
+    r->packet.header.z = 0;
+    r->packet.header.ad = 0;
+    r->packet.header.rcode = DNS_RCODE_NOERROR;
+    r->packet.question.qname = qname;
+    r->packet.question.qtype = query->qtype;
+    r->packet.question.qclass = query->qclass;
+    r->packet.answers = r->answers;
+    r->packet.authority = r->authority;
+    r->packet.additional = r->additional;
+    r->packet.edns = query->edns;
+}
+
+// appends a record to a section; rdlength < 0 (rdata that couldn't be built) adds nothing
+static int auth_add(struct auth_response* r, int section, const char* name, uint16_t type, uint32_t ttl,
+                    const uint8_t* rdata, int rdlength) {
+    struct dns_answer* records[] = { r->answers, r->authority, r->additional };
+    uint16_t* counts[] = { &r->packet.nr_answers, &r->packet.nr_authority, &r->packet.nr_additional };
+
+    if (rdlength < 0 || *counts[section] >= AUTH_MAX_RECORDS) {
+        return -1;
+    }
+    struct dns_answer* rr = &records[section][(*counts[section])++];
+    rr->name = (char*)name;
+    rr->type = type;
+    rr->class = DNS_CLASS_IN;
+    rr->ttl = ttl;
+    rr->rdlength = (uint16_t)rdlength;
+    rr->rdata = (char*)r->rdata[r->nr_rdata++];
+    memcpy(rr->rdata, rdata, rdlength);
+    return 0;
+}
+
+// writes a dotted name into rdata; the names come from our zone files, only their length is checked
+static int auth_put_name(uint8_t* rdata, const char* name) {
+    if (strlen(name) > DNS_MAX_NAME_WIRE - 2) {
+        return -1;
+    }
+    return dns_encode_name(rdata, name);
+}
+
+static void auth_put_u32(uint8_t* rdata, uint32_t value) {
+    value = htonl(value);
+    memcpy(rdata, &value, sizeof(value));
+}
+
+// zone files are read through shell scripts, so type and value strings may end in '\n'
+static uint16_t auth_record_type(const char* type) {
+    size_t len = strcspn(type, " \n");
+    if (len == 1 && (type[0] == 'A' || type[0] == 'a')) {
+        return DNS_TYPE_A;
+    }
+    return 0;
+}
+
+static int auth_put_address(uint8_t* rdata, const char* value) {
+    char address[INET_ADDRSTRLEN];
+    size_t len = strcspn(value, " \n");
+    if (len >= sizeof(address)) {
+        return -1;
+    }
+    memcpy(address, value, len);
+    address[len] = '\0';
+    return inet_pton(AF_INET, address, rdata) == 1 ? 4 : -1;
+}
+
+// the records of a trie node that answer qtype; returns how many were added
+static int auth_add_node(struct auth_response* r, int section, const char* owner,
+                         const struct TrieNode* node, uint16_t qtype) {
+    int added = 0;
+
+    for (int i = 0; i < node->nr_records; i++) {
+        const struct DNSRecord* record = &node->records[i];
+        uint16_t type = auth_record_type(record->type);
+        if (type == 0 || record->value == NULL || (qtype != type && qtype != DNS_TYPE_ANY)) {
+            continue;
+        }
+        uint8_t rdata[4];
+        if (auth_add(r, section, owner, type, record->ttl, rdata, auth_put_address(rdata, record->value)) == 0) {
+            added++;
+        }
+    }
+    return added;
+}
+
+static void auth_add_soa(struct auth_response* r, int section, const char* zone, const struct TrieNode* origin) {
+    const struct SOAMetadata* soa = origin->soa;
+    uint8_t rdata[AUTH_RDATA_MAX];
+
+    int mname = auth_put_name(rdata, soa->primary_ns);
+    int rname = mname < 0 ? -1 : auth_put_name(rdata + mname, soa->admin_mail);
+    if (rname < 0) {
+        return;
+    }
+    size_t offset = mname + rname;
+    auth_put_u32(rdata + offset, (uint32_t)soa->serial_number);
+    auth_put_u32(rdata + offset + 4, (uint32_t)soa->refresh_time);
+    auth_put_u32(rdata + offset + 8, (uint32_t)soa->retry_time);
+    auth_put_u32(rdata + offset + 12, (uint32_t)soa->expire_time);
+    auth_put_u32(rdata + offset + 16, (uint32_t)soa->minimum_ttl);
+
+    // rfc 2308: a negative answer is cached for as long as the ttl of its SOA, which is the smaller of
+    // the zone's ttl and the SOA's minimum; asked for directly, the SOA carries the zone's ttl
+    int ttl = soa->ttl;
+    if (section == DNS_SECTION_AUTHORITY && soa->minimum_ttl < ttl) {
+        ttl = soa->minimum_ttl;
+    }
+    auth_add(r, section, zone, DNS_TYPE_SOA, (uint32_t)ttl, rdata, offset + 20);
+}
+
+static void auth_add_ns(struct auth_response* r, int section, const char* zone, const struct TrieNode* origin) {
+    const char* servers[] = { origin->ns->domain1, origin->ns->domain2 };
+
+    for (int i = 0; i < 2; i++) {
+        if (servers[i] == NULL || servers[i][0] == '\0') {
+            continue;
+        }
+        uint8_t rdata[DNS_MAX_NAME_WIRE];
+        auth_add(r, section, zone, DNS_TYPE_NS, origin->soa->ttl, rdata, auth_put_name(rdata, servers[i]));
+    }
+}
+
+// addresses of the zone's name servers that live in one of our zones
+static void auth_add_glue(struct auth_response* r, struct TrieNode* root, const struct TrieNode* origin) {
+    const char* servers[] = { origin->ns->domain1, origin->ns->domain2 };
+
+    for (int i = 0; i < 2; i++) {
+        uint8_t name[DNS_NAME_MAX];
+        struct dns_name_info info;
+        int nr_matched;
+
+        if (servers[i] == NULL || dns_name_canon_dotted(servers[i], name, &info) == DNS_NAME_ELABEL) {
+            continue;
+        }
+        struct TrieNode* node = lookupWireName(root, name, info.labels, info.nr_labels, &nr_matched);
+        if (nr_matched == info.nr_labels && node != root) {
+            auth_add_node(r, DNS_SECTION_ADDITIONAL, servers[i], node, DNS_TYPE_A);
+        }
+    }
+}
+
+int dns_auth_answer(struct TrieNode* root,
+                    const struct dns_msg_view* query,
+                    uint8_t* answer,
+                    size_t size)
+{
+    struct ZoneLookup found;
+
+    if (root == NULL || query->header.qdcount != 1 || query->qclass != DNS_CLASS_IN) {
+        return 0;
+    }
+    found.apex = lookupQuestionZone(root, query, &found.node, &found.nr_matched, &found.zone_labels);
+    return dns_auth_answer_found(root, query, &found, answer, size);
+}
+
+int dns_auth_answer_found(struct TrieNode* root,
+                          const struct dns_msg_view* query,
+                          const struct ZoneLookup* found,
+                          uint8_t* answer,
+                          size_t size)
+{
+    struct TrieNode* apex = found->apex;
+    struct TrieNode* node = found->node;
+    int nr_matched = found->nr_matched;
+    int zone_labels = found->zone_labels;
+
+    if (root == NULL || apex == NULL || query->header.qdcount != 1 || query->qclass != DNS_CLASS_IN) {
+        return 0;
+    }
+
+    char qname[DNS_MAX_NAME_WIRE + 1];
+    if (dns_view_name_str(query, &query->qname, qname, sizeof(qname)) < 0) {
+        return 0;
+    }
+    // a label starts at the same offset in the dotted name as its length byte in the wire name
+    const char* zone = qname + query->qname_labels[query->qname.nr_labels - zone_labels];
+    const struct TrieNode* origin = apex->childrens[0];
+    int exists = nr_matched == query->qname.nr_labels;
+    int ns_answered = 0;
+
+    struct auth_response response;
+    auth_init(&response, query, qname);
+
+    if (exists && node == apex) {
+        // the apex only has the SOA and the NS records
+        if (query->qtype == DNS_TYPE_SOA || query->qtype == DNS_TYPE_ANY) {
+            auth_add_soa(&response, DNS_SECTION_ANSWER, zone, origin);
+        }
+        if (query->qtype == DNS_TYPE_NS || query->qtype == DNS_TYPE_ANY) {
+            auth_add_ns(&response, DNS_SECTION_ANSWER, zone, origin);
+            ns_answered = 1;
+        }
+    } else if (exists) {
+        auth_add_node(&response, DNS_SECTION_ANSWER, qname, node, query->qtype);
+    }
+
+    if (response.packet.nr_answers > 0) {
+        if (!ns_answered) {
+            auth_add_ns(&response, DNS_SECTION_AUTHORITY, zone, origin);
+        }
+        auth_add_glue(&response, root, origin);
+    } else {
+        // NODATA when the name is there but not the type, NXDOMAIN when the name isn't;
+        // the SOA lets resolvers cache either
+        response.packet.header.rcode = exists ? DNS_RCODE_NOERROR : DNS_RCODE_NXDOMAIN;
+        auth_add_soa(&response, DNS_SECTION_AUTHORITY, zone, origin);
+    }
+
+    return dns_encode_answer(&response.packet, answer, size);
+}
@@ -0,0 +1,28 @@
+#ifndef __DNS_AUTH_H__
+#define __DNS_AUTH_H__
+
+#include "dns_server.h"
+#include "trie.h"
+
+/* authoritative responder */
+// answers questions about names inside the zones loaded into the trie, straight from the trie:
+// AA set, the zone's NS records as authority with their addresses as glue, and NXDOMAIN/NODATA
+// with the zone's SOA when the name or type isn't there. it never looks at a cache or goes
+// upstream, so these answers cost the same whatever state the caches are in.
+
+/* encode the answer to query into answer (size bytes, DNS_EDNS_MAX_SIZE is always enough) if it
+   falls inside one of the zones under root. returns its length, 0 if the name is outside all of
+   them and has to be resolved elsewhere, -1 if the answer could not be encoded */
+int dns_auth_answer(struct TrieNode *root,
+                    const struct dns_msg_view *query,
+                    uint8_t *answer,
+                    size_t size);
+
+/* same, for a question already looked up with lookupQuestionZone() or lookupQuestionZoneBatch() */
+int dns_auth_answer_found(struct TrieNode *root,
+                          const struct dns_msg_view *query,
+                          const struct ZoneLookup *found,
+                          uint8_t *answer,
+                          size_t size);
+
+#endif
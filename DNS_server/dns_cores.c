@@ -0,0 +1,208 @@
+#define _GNU_SOURCE  // sched_getaffinity, CPU_ISSET
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dns_cores.h"
+#include "thread.h"
+#include "logger.h"
+
+// runs on the core's own listener thread, between batches
+static void core_poll(void* arg) {
+    struct dns_core* core = (struct dns_core*)arg;
+
+    // the only shared word a core reads per batch, and nobody writes it unless there is a message
+    while (atomic_load_explicit(&core->nr_pending, memory_order_acquire) > 0) {
+        struct dns_core_msg msg;
+
+        pthread_mutex_lock(&core->mailbox_lock);
+        msg = core->mailbox[core->head];
+        core->head = (core->head + 1) % DNS_CORE_MAILBOX;
+        core->nr_queued--;
+        atomic_fetch_sub(&core->nr_pending, 1);
+        pthread_mutex_unlock(&core->mailbox_lock);
+
+        switch (msg.type) {
+        case DNS_CORE_FLUSH:
+            dns_pcache_flush(&core->cache);
+            break;
+        case DNS_CORE_INVALIDATE:
+            dns_pcache_invalidate(&core->cache, msg.name, msg.name_len);
+            break;
+        case DNS_CORE_STORE:
+            dns_pcache_insert(&core->cache, msg.entry);
+            break;
+        default:
+            fprintf(stderr, "Unknown message %d for core %d\n", msg.type, core->cpu);
+            break;
+        }
+    }
+}
+
+static int core_post(struct dns_core* core, const struct dns_core_msg* msg) {
+    pthread_mutex_lock(&core->mailbox_lock);
+    if (core->nr_queued == DNS_CORE_MAILBOX) {
+        pthread_mutex_unlock(&core->mailbox_lock);
+        return -1;
+    }
+    core->mailbox[(core->head + core->nr_queued) % DNS_CORE_MAILBOX] = *msg;
+    core->nr_queued++;
+    atomic_fetch_add_explicit(&core->nr_pending, 1, memory_order_release);
+    pthread_mutex_unlock(&core->mailbox_lock);
+    return 0;
+}
+
+// the relay's store hook: the answer of a miss, on the forwarder's thread, goes to the core that owns
+// the shard. with the mailbox full it is not kept, which costs one more miss later
+static void core_store(struct dns_pcache_entry* entry, void* arg) {
+    struct dns_core* core = (struct dns_core*)arg;
+    struct dns_core_msg msg;
+
+    msg.type = DNS_CORE_STORE;
+    msg.name_len = 0;
+    msg.entry = entry;
+    if (core_post(core, &msg) != 0) {
+        free(entry);
+    }
+}
+
+// the first nr cpus of our affinity mask; returns how many there are
+static int cores_pick_cpus(int* cpus, int nr) {
+    cpu_set_t set;
+    int found = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        for (found = 0; found < nr; found++) {
+            cpus[found] = found;
+        }
+        return found;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && found < nr; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[found++] = cpu;
+        }
+    }
+    return found;
+}
+
+int dns_cores_start(struct dns_cores* cores, uint16_t port, struct dns_forwarder* forwarder,
+                    struct TrieNode* zones, int steer) {
+    int cpus[DNS_MAX_LISTENERS];
+    int nr_cores = availableCpus();
+    if (nr_cores > DNS_MAX_LISTENERS) {
+        nr_cores = DNS_MAX_LISTENERS;
+    }
+    nr_cores = cores_pick_cpus(cpus, nr_cores);
+
+    memset(cores, 0, sizeof(struct dns_cores));
+    dns_server_ctx_init(&cores->server);
+    cores->cores = calloc(nr_cores, sizeof(struct dns_core));
+    if (!cores->cores) {
+        dns_server_ctx_destroy(&cores->server);
+        return -1;
+    }
+
+    for (int i = 0; i < nr_cores; i++) {
+        struct dns_core* core = &cores->cores[i];
+        core->cpu = cpus[i];
+        dns_pcache_init_unlocked(&core->cache);
+        core->relay.forwarder = forwarder;
+        core->relay.cache = &core->cache;
+        core->relay.zones = zones;
+        core->relay.store = core_store;
+        core->relay.store_data = core;
+        atomic_init(&core->nr_pending, 0);
+        pthread_mutex_init(&core->mailbox_lock, NULL);
+        cores->nr_cores++;
+
+        // listener i is socket i of the reuseport group, which is what steering counts on
+        core->listener = dns_server_add_core_listener(&cores->server, port, core->cpu, dns_relay_query_batch,
+                                                      &core->relay, core_poll, core);
+        if (!core->listener) {
+            fprintf(stderr, "Failed to start the listener for cpu %d\n", core->cpu);
+            dns_cores_destroy(cores);
+            return -1;
+        }
+        dns_endpoint_set_cache(core->listener, &core->cache);
+    }
+
+    if (steer) {
+        cores->steered = dns_server_steer_by_qname(&cores->server) == 0;
+    }
+    LOG_INFO("Serving udp port %d from %d pinned cores%s.\n", port, cores->nr_cores,
+           cores->steered ? ", steered by qname" : "");
+    return 0;
+}
+
+int dns_cores_owner(const struct dns_cores* cores, const char* name) {
+    uint8_t lower[DNS_NAME_MAX];
+    struct dns_name_info info;
+
+    if (!cores->steered) {
+        return -1;
+    }
+    // a bad character still gives the name the client would have sent
+    int ret = dns_name_canon_dotted(name, lower, &info);
+    if (ret != DNS_NAME_OK && ret != DNS_NAME_ECHAR) {
+        return -1;
+    }
+    return dns_steer_qname(lower, info.len, cores->nr_cores);
+}
+
+int dns_cores_post(struct dns_cores* cores, int core, const struct dns_core_msg* msg) {
+    return core_post(&cores->cores[core], msg);
+}
+
+int dns_cores_invalidate(struct dns_cores* cores, const char* name) {
+    struct dns_core_msg msg;
+    struct dns_name_info info;
+    int owner = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    if (name) {
+        int ret = dns_name_canon_dotted(name, msg.name, &info);
+        if (ret != DNS_NAME_OK && ret != DNS_NAME_ECHAR) {
+            return -1;
+        }
+        msg.type = DNS_CORE_INVALIDATE;
+        msg.name_len = info.len;
+        owner = cores->steered ? dns_steer_qname(msg.name, msg.name_len, cores->nr_cores) : -1;
+    } else {
+        msg.type = DNS_CORE_FLUSH;
+    }
+
+    if (owner >= 0) {
+        return dns_cores_post(cores, owner, &msg);
+    }
+    int ret = 0;
+    for (int i = 0; i < cores->nr_cores; i++) {
+        if (dns_cores_post(cores, i, &msg) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void dns_cores_stop(struct dns_cores* cores) {
+    dns_server_stop(&cores->server);
+}
+
+void dns_cores_destroy(struct dns_cores* cores) {
+    dns_server_ctx_destroy(&cores->server);
+    for (int i = 0; i < cores->nr_cores; i++) {
+        struct dns_core* core = &cores->cores[i];
+        // answers posted after the core's last batch
+        for (int m = 0; m < core->nr_queued; m++) {
+            const struct dns_core_msg* msg = &core->mailbox[(core->head + m) % DNS_CORE_MAILBOX];
+            if (msg->type == DNS_CORE_STORE) {
+                free(msg->entry);
+            }
+        }
+        dns_pcache_destroy(&core->cache);
+        pthread_mutex_destroy(&core->mailbox_lock);
+    }
+    free(cores->cores);
+    cores->cores = NULL;
+    cores->nr_cores = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __DNS_CORES_H__
+#define __DNS_CORES_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "dns_server.h"
+#include "dns_relay.h"
+#include "dns_pcache.h"
+#include "dns_name.h"
+
+/* thread-per-core serving */
+// one udp listener per cpu, pinned to it, each with its own SO_REUSEPORT socket on the shared port,
+// its own receive buffers, packet cache shard and relay. a core's shard is only ever touched by the
+// core itself, so it takes no lock: the kernel spreads the datagrams over the sockets, and with
+// steering by a hash of the qname (see dns_server_steer_by_qname), so that every name is cached on
+// one core only. the zones are read-only and the forwarder behind the relays is still shared: misses
+// are the slow path anyway. their answers come back on the forwarder's thread, which prepares the
+// cache entry and posts it to the core the query came in on. other threads talk to a core only
+// through its mailbox, which the core empties between receive batches (so within DNS_LISTEN_POLL_MS
+// when it is idle).
+
+#define DNS_CORE_MAILBOX 256            /* messages waiting for one core; answers of misses go through it too */
+
+/* message types */
+#define DNS_CORE_FLUSH 1                /* drop the whole cache shard */
+#define DNS_CORE_INVALIDATE 2           /* drop the cached answers for one name */
+#define DNS_CORE_STORE 3                /* insert a prepared answer into the shard */
+
+struct dns_core_msg {
+    int type;
+    uint8_t name[DNS_NAME_MAX];         /* DNS_CORE_INVALIDATE: lowercased wire form */
+    size_t name_len;
+    struct dns_pcache_entry *entry;     /* DNS_CORE_STORE: the core owns it once it is posted */
+};
+
+struct dns_core {
+    int cpu;
+    struct dns_endpoint *listener;
+    struct dns_pcache cache;            /* this core's shard, unlocked */
+    struct dns_relay relay;             /* stores into the shard above, or posts to the mailbox */
+    // senders take the lock; the core only when nr_pending says there is something
+    struct dns_core_msg mailbox[DNS_CORE_MAILBOX];
+    int head;                           /* next message the core takes */
+    int nr_queued;
+    atomic_int nr_pending;
+    pthread_mutex_t mailbox_lock;
+};
+
+struct dns_cores {
+    struct dns_server_ctx server;
+    struct dns_core *cores;
+    int nr_cores;
+    int steered;                        /* queries reach cores by qname */
+};
+
+/* serve port from a pinned listener on each cpu this process may use (see availableCpus, at most
+   DNS_MAX_LISTENERS). misses go through forwarder, names in zones (may be NULL) are answered
+   locally. with steer, queries are spread by qname instead of by client address; if the kernel
+   refuses the program, they are served unsteered. returns 0, or -1 with nothing left running */
+int dns_cores_start(struct dns_cores *cores, uint16_t port, struct dns_forwarder *forwarder,
+                    struct TrieNode *zones, int steer);
+
+/* the core whose shard caches name (dotted), -1 if every core may have it (not steered) */
+int dns_cores_owner(const struct dns_cores *cores, const char *name);
+
+/* queue msg for one core; -1 if its mailbox is full */
+int dns_cores_post(struct dns_cores *cores, int core, const struct dns_core_msg *msg);
+
+/* drop name (dotted) from the shard of the core that has it, or from every shard if not steered;
+   NULL flushes every shard. returns -1 if a message could not be queued */
+int dns_cores_invalidate(struct dns_cores *cores, const char *name);
+
+/* stop and join every core's listener */
+void dns_cores_stop(struct dns_cores *cores);
+
+/* free the shards and whatever is left in the mailboxes; only once the forwarder is gone too, since
+   the relays post its late answers */
+void dns_cores_destroy(struct dns_cores *cores);
+
+#endif
@@ -0,0 +1,697 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "dns_packet.h"
+#include "dns_view.h"
+#include "dns_forwarder.h"
+
+// monotonic clock in milliseconds, used for all deadlines
+static uint64_t fwd_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// xorshift32; rand() is shared process-wide and not safe to call from several workers
+static uint16_t fwd_next_id(struct dns_forwarder* fwd) {
+    uint32_t x = fwd->id_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    fwd->id_state = x;
+    return (uint16_t)x;
+}
+
+// find a leg by its key: (id, question, upstream). caller holds the lock.
+static struct dns_fwd_leg* fwd_find_leg(struct dns_forwarder* fwd, const struct dns_msg_view* reply,
+                                        const struct sockaddr_in* from) {
+    uint16_t id = reply->header.id;
+    struct dns_fwd_leg* leg = fwd->buckets[id % DNS_FWD_BUCKETS];
+
+    while (leg) {
+        const struct sockaddr_in* up = &fwd->upstreams->upstreams[leg->upstream].addr;
+        if (leg->id == id &&
+            up->sin_addr.s_addr == from->sin_addr.s_addr &&
+            up->sin_port == from->sin_port &&
+            reply->qtype == leg->owner->qtype && reply->qclass == DNS_CLASS_IN &&
+            dns_view_name_equals(reply, &reply->qname, leg->owner->qname)) {
+            return leg;
+        }
+        leg = leg->next;
+    }
+
+    return NULL;
+}
+
+// remove one leg from the hash table. caller holds the lock.
+static void fwd_unlink_leg(struct dns_forwarder* fwd, struct dns_fwd_leg* leg) {
+    struct dns_fwd_leg** link = &fwd->buckets[leg->id % DNS_FWD_BUCKETS];
+
+    while (*link) {
+        if (*link == leg) {
+            *link = leg->next;
+            break;
+        }
+        link = &(*link)->next;
+    }
+    leg->active = 0;
+    leg->next = NULL;
+    leg->owner->nr_active--;
+}
+
+// send one more copy of q to an upstream. caller holds the lock.
+// sendto() on a non-blocking udp socket never waits, so doing it under the lock is fine.
+static int fwd_send_leg(struct dns_forwarder* fwd, struct dns_inflight* q, int upstream, uint64_t now) {
+    struct dns_fwd_leg* leg = NULL;
+    for (int i = 0; i < DNS_FWD_MAX_LEGS; i++) {
+        if (!q->legs[i].active) {
+            leg = &q->legs[i];
+            break;
+        }
+    }
+    if (!leg) {
+        return -1;
+    }
+
+    uint8_t buffer[512];
+    leg->id = fwd_next_id(fwd);
+    int length = dns_build_query(buffer, sizeof(buffer), leg->id, q->qname, q->qtype, DNS_EDNS_MAX_SIZE);
+    if (length < 0) {
+        return -1;
+    }
+
+    leg->upstream = upstream;
+    leg->sock_index = fwd->next_socket;
+    fwd->next_socket = (fwd->next_socket + 1) % fwd->nr_sockets;
+    leg->sent_ms = now;
+    leg->deadline_ms = now + dns_upstream_rto(fwd->upstreams, upstream);
+    if (leg->deadline_ms > q->deadline_ms) {
+        leg->deadline_ms = q->deadline_ms;
+    }
+
+    const struct sockaddr_in* addr = &fwd->upstreams->upstreams[upstream].addr;
+    ssize_t sent = sendto(fwd->sockets[leg->sock_index], buffer, length, 0,
+                          (const struct sockaddr*)addr, sizeof(struct sockaddr_in));
+    if (sent < 0) {
+        perror("Failed to send query upstream");
+        dns_upstream_report_failure(fwd->upstreams, upstream, now);
+        return -1;
+    }
+
+    leg->owner = q;
+    leg->active = 1;
+    leg->next = fwd->buckets[leg->id % DNS_FWD_BUCKETS];
+    fwd->buckets[leg->id % DNS_FWD_BUCKETS] = leg;
+    q->nr_active++;
+    q->tried_mask |= 1u << upstream;
+
+    return 0;
+}
+
+// drop q and every copy still in flight; it goes back to the free list. caller holds the lock.
+static void fwd_finish(struct dns_forwarder* fwd, struct dns_inflight* q) {
+    for (int i = 0; i < DNS_FWD_MAX_LEGS; i++) {
+        if (q->legs[i].active) {
+            fwd_unlink_leg(fwd, &q->legs[i]);
+        }
+    }
+
+    if (q->tcp_fd >= 0) {
+        epoll_ctl(fwd->epoll_fd, EPOLL_CTL_DEL, q->tcp_fd, NULL);
+        close(q->tcp_fd);
+        q->tcp_fd = -1;
+    }
+    free(q->tcp_buf);
+    q->tcp_buf = NULL;
+
+    if (q->prev) {
+        q->prev->next = q->next;
+    } else {
+        fwd->active = q->next;
+    }
+    if (q->next) {
+        q->next->prev = q->prev;
+    }
+    fwd->nr_inflight--;
+
+    q->done = NULL;
+    q->user_data = NULL;
+    q->prev = NULL;
+    q->next = fwd->free_list;
+    fwd->free_list = q;
+}
+
+// the udp answer was truncated: ask the same upstream again over tcp. caller holds the lock.
+// the connection is driven by the i/o loop like the udp sockets, so nothing blocks here either
+static int fwd_start_tcp(struct dns_forwarder* fwd, struct dns_inflight* q, int upstream) {
+    for (int i = 0; i < DNS_FWD_MAX_LEGS; i++) {
+        if (q->legs[i].active) {
+            fwd_unlink_leg(fwd, &q->legs[i]);
+        }
+    }
+    q->hedge_at_ms = 0;
+
+    q->tcp_buf = malloc(2 + DNS_TCP_MAX_SIZE);
+    if (!q->tcp_buf) {
+        return -1;
+    }
+    q->tcp_id = fwd_next_id(fwd);
+    q->tcp_upstream = upstream;
+    q->tcp_sent_ms = fwd_now_ms();
+    int length = dns_build_query(q->tcp_buf + 2, DNS_TCP_MAX_SIZE, q->tcp_id, q->qname, q->qtype, 0);
+    if (length < 0) {
+        return -1;
+    }
+    q->tcp_buf[0] = (uint8_t)(length >> 8);
+    q->tcp_buf[1] = (uint8_t)length;
+    q->tcp_len = 0;
+    q->tcp_need = 2 + length;
+    q->tcp_state = DNS_FWD_TCP_WRITING;
+
+    q->tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (q->tcp_fd < 0) {
+        perror("Failed to create upstream tcp socket");
+        return -1;
+    }
+
+    const struct sockaddr_in* addr = &fwd->upstreams->upstreams[upstream].addr;
+    if (connect(q->tcp_fd, (const struct sockaddr*)addr, sizeof(struct sockaddr_in)) < 0 &&
+        errno != EINPROGRESS) {
+        perror("Failed to connect to upstream over tcp");
+        return -1;
+    }
+
+    // writable once connected
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.fd = q->tcp_fd;
+    if (epoll_ctl(fwd->epoll_fd, EPOLL_CTL_ADD, q->tcp_fd, &ev) < 0) {
+        perror("Failed to watch upstream tcp socket");
+        return -1;
+    }
+
+    return 0;
+}
+
+// progress on a tcp retry. returns the finished query (detached from the table, with the
+// answer left in tcp_buf) or NULL if more i/o is needed. caller holds the lock.
+static struct dns_inflight* fwd_tcp_progress(struct dns_forwarder* fwd, struct dns_inflight* q, int* status) {
+    *status = DNS_FWD_OK;
+
+    if (q->tcp_state == DNS_FWD_TCP_WRITING) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(q->tcp_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+            *status = DNS_FWD_ERROR;
+            return q;
+        }
+
+        ssize_t written = write(q->tcp_fd, q->tcp_buf + q->tcp_len, q->tcp_need - q->tcp_len);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) return NULL;
+            *status = DNS_FWD_ERROR;
+            return q;
+        }
+        q->tcp_len += written;
+        if (q->tcp_len < q->tcp_need) {
+            return NULL;
+        }
+
+        // query sent: switch to reading the 2-byte length prefix
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = q->tcp_fd;
+        epoll_ctl(fwd->epoll_fd, EPOLL_CTL_MOD, q->tcp_fd, &ev);
+        q->tcp_state = DNS_FWD_TCP_READING;
+        q->tcp_len = 0;
+        q->tcp_need = 2;
+        return NULL;
+    }
+
+    while (q->tcp_len < q->tcp_need) {
+        ssize_t received = read(q->tcp_fd, q->tcp_buf + q->tcp_len, q->tcp_need - q->tcp_len);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return NULL;
+            *status = DNS_FWD_ERROR;
+            return q;
+        }
+        if (received == 0) {
+            *status = DNS_FWD_ERROR;  // upstream closed early
+            return q;
+        }
+        q->tcp_len += received;
+
+        if (q->tcp_len == 2 && q->tcp_need == 2) {
+            size_t length = (q->tcp_buf[0] << 8) | q->tcp_buf[1];
+            if (length < sizeof(struct dns_header)) {
+                *status = DNS_FWD_ERROR;
+                return q;
+            }
+            q->tcp_need = 2 + length;
+        }
+    }
+
+    return q;
+}
+
+// whether a whole tcp answer is the one q asked for: the same checks a udp reply passes through
+// fwd_find_leg(), the upstream being fixed by the connection
+static int fwd_tcp_matches(const struct dns_inflight* q, const uint8_t* answer, size_t len) {
+    struct dns_msg_view reply;
+    return dns_view_parse(&reply, answer, len, NULL, 0) == DNS_VIEW_OK &&
+           reply.header.qr == QR_RESPONSE && reply.header.qdcount == 1 &&
+           reply.header.id == q->tcp_id && reply.qtype == q->qtype && reply.qclass == DNS_CLASS_IN &&
+           dns_view_name_equals(&reply, &reply.qname, q->qname);
+}
+
+static void fwd_handle_tcp(struct dns_forwarder* fwd, int fd) {
+    dns_forward_done_fn done = NULL;
+    void* user_data = NULL;
+    uint8_t* answer = NULL;
+    size_t answer_len = 0;
+    int status = DNS_FWD_OK;
+
+    pthread_mutex_lock(&fwd->lock);
+    struct dns_inflight* q = fwd->active;
+    while (q && q->tcp_fd != fd) {
+        q = q->next;
+    }
+    if (q && fwd_tcp_progress(fwd, q, &status)) {
+        done = q->done;
+        user_data = q->user_data;
+        if (status == DNS_FWD_OK && !fwd_tcp_matches(q, q->tcp_buf + 2, q->tcp_need - 2)) {
+            status = DNS_FWD_ERROR;
+        }
+        uint64_t now = fwd_now_ms();
+        if (status == DNS_FWD_OK) {
+            dns_upstream_report_success(fwd->upstreams, q->tcp_upstream, (uint32_t)(now - q->tcp_sent_ms));
+            // keep the answer alive past fwd_finish()
+            answer = q->tcp_buf;
+            answer_len = q->tcp_need - 2;
+            q->tcp_buf = NULL;
+        } else {
+            dns_upstream_report_failure(fwd->upstreams, q->tcp_upstream, now);
+        }
+        fwd_finish(fwd, q);
+    }
+    pthread_mutex_unlock(&fwd->lock);
+
+    if (done) {
+        done(status, answer ? answer + 2 : NULL, answer_len, user_data);
+    }
+    free(answer);
+}
+
+// drain every datagram waiting on one upstream socket
+static void fwd_read_socket(struct dns_forwarder* fwd, int sockfd) {
+    uint8_t buffer[DNS_EDNS_MAX_SIZE];
+    struct sockaddr_in from;
+    struct dns_msg_view reply;
+
+    while (1) {
+        socklen_t from_len = sizeof(from);
+        ssize_t received = recvfrom(sockfd, buffer, sizeof(buffer), 0,
+                                    (struct sockaddr*)&from, &from_len);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Forwarder recvfrom() failed");
+            }
+            return;
+        }
+
+        // one bounds-checked pass over the whole reply; malformed answers are dropped here,
+        // before anyone downstream looks at them
+        if (dns_view_parse(&reply, buffer, received, NULL, 0) != DNS_VIEW_OK ||
+            reply.header.qr != QR_RESPONSE || reply.header.qdcount != 1) {
+            continue;
+        }
+
+        dns_forward_done_fn done = NULL;
+        void* user_data = NULL;
+
+        pthread_mutex_lock(&fwd->lock);
+        struct dns_fwd_leg* leg = fwd_find_leg(fwd, &reply, &from);
+        if (leg) {
+            // every leg has its own id, so the sample is unambiguous (karn's problem does not apply)
+            uint64_t now = fwd_now_ms();
+            dns_upstream_report_success(fwd->upstreams, leg->upstream, (uint32_t)(now - leg->sent_ms));
+            for (int i = 0; i < DNS_FWD_MAX_LEGS; i++) {
+                struct dns_fwd_leg* other = &leg->owner->legs[i];
+                if (other != leg && other->active) {
+                    dns_upstream_report_slow(fwd->upstreams, other->upstream, (uint32_t)(now - other->sent_ms));
+                }
+            }
+
+            struct dns_inflight* q = leg->owner;
+            if (reply.header.tc) {
+                // too big even for our edns buffer: the answer is completed later over tcp
+                if (fwd_start_tcp(fwd, q, leg->upstream) == 0) {
+                    pthread_mutex_unlock(&fwd->lock);
+                    continue;
+                }
+                done = q->done;
+                user_data = q->user_data;
+                fwd_finish(fwd, q);
+                pthread_mutex_unlock(&fwd->lock);
+                done(DNS_FWD_ERROR, NULL, 0, user_data);
+                continue;
+            }
+            done = leg->owner->done;
+            user_data = leg->owner->user_data;
+            // the first answer wins; a hedged twin that answers later finds no match
+            fwd_finish(fwd, leg->owner);
+        }
+        pthread_mutex_unlock(&fwd->lock);
+
+        // late duplicates and spoofed replies simply find no match
+        if (done) {
+            done(DNS_FWD_OK, buffer, (size_t)received, user_data);
+        }
+    }
+}
+
+// timer tick: expire copies past their rto, fail over, send hedges and fail expired queries
+static void fwd_expire(struct dns_forwarder* fwd) {
+    dns_forward_done_fn done[DNS_FWD_MAX_INFLIGHT];
+    void* user_data[DNS_FWD_MAX_INFLIGHT];
+    int status[DNS_FWD_MAX_INFLIGHT];
+    int nr_done = 0;
+    uint64_t now = fwd_now_ms();
+
+    pthread_mutex_lock(&fwd->lock);
+    struct dns_inflight* q = fwd->active;
+    while (q) {
+        struct dns_inflight* next = q->next;
+
+        // copies that ran out of time count against their upstream
+        for (int i = 0; i < DNS_FWD_MAX_LEGS; i++) {
+            struct dns_fwd_leg* leg = &q->legs[i];
+            if (leg->active && leg->deadline_ms <= now) {
+                dns_upstream_report_failure(fwd->upstreams, leg->upstream, now);
+                fwd_unlink_leg(fwd, leg);
+            }
+        }
+
+        int result = DNS_FWD_OK;
+        if (q->deadline_ms <= now) {
+            result = DNS_FWD_TIMEOUT;
+            if (q->tcp_fd >= 0) {
+                dns_upstream_report_failure(fwd->upstreams, q->tcp_upstream, now);
+            }
+        } else if (q->tcp_fd >= 0) {
+            // tcp retry in progress; only the overall deadline applies
+        } else if (q->nr_active == 0) {
+            // failover: next best upstream that has not seen the query yet, or the best one again
+            int upstream = dns_upstream_select(fwd->upstreams, q->tried_mask, now);
+            if (upstream < 0) {
+                upstream = dns_upstream_select(fwd->upstreams, 0, now);
+            }
+            if (upstream < 0 || fwd_send_leg(fwd, q, upstream, now) < 0) {
+                result = DNS_FWD_ERROR;
+            }
+        } else if (q->hedge_at_ms != 0 && q->hedge_at_ms <= now) {
+            // the primary is slower than its p95: race a second upstream against it
+            q->hedge_at_ms = 0;
+            int upstream = dns_upstream_select(fwd->upstreams, q->tried_mask, now);
+            if (upstream >= 0) {
+                fwd_send_leg(fwd, q, upstream, now);
+            }
+        }
+
+        if (result != DNS_FWD_OK) {
+            done[nr_done] = q->done;
+            user_data[nr_done] = q->user_data;
+            status[nr_done] = result;
+            nr_done++;
+            fwd_finish(fwd, q);
+        }
+        q = next;
+    }
+    pthread_mutex_unlock(&fwd->lock);
+
+    // callbacks run without the lock so they may submit follow-up queries
+    for (int i = 0; i < nr_done; i++) {
+        done[i](status[i], NULL, 0, user_data[i]);
+    }
+}
+
+static int fwd_is_udp_socket(const struct dns_forwarder* fwd, int fd) {
+    for (int i = 0; i < fwd->nr_sockets; i++) {
+        if (fwd->sockets[i] == fd) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// i/o thread: the only place that ever waits on the network
+static void* fwd_io_loop(void* arg) {
+    struct dns_forwarder* fwd = (struct dns_forwarder*)arg;
+    struct epoll_event events[DNS_FWD_MAX_EVENTS];
+
+    while (fwd->running) {
+        int ready = epoll_wait(fwd->epoll_fd, events, DNS_FWD_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Forwarder epoll_wait() failed");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == fwd->timer_fd) {
+                uint64_t ticks;
+                if (read(fwd->timer_fd, &ticks, sizeof(ticks)) > 0) {
+                    fwd_expire(fwd);
+                }
+            } else if (fd == fwd->wake_fd) {
+                // destroy() asked us to stop; running is already 0
+                uint64_t value;
+                if (read(fwd->wake_fd, &value, sizeof(value)) < 0) {
+                    continue;
+                }
+            } else if (fwd_is_udp_socket(fwd, fd)) {
+                fwd_read_socket(fwd, fd);
+            } else {
+                fwd_handle_tcp(fwd, fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int fwd_epoll_add(struct dns_forwarder* fwd, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(fwd->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// close whatever create() managed to open
+static void fwd_close_fds(struct dns_forwarder* fwd) {
+    for (int i = 0; i < fwd->nr_sockets; i++) {
+        close(fwd->sockets[i]);
+    }
+    if (fwd->timer_fd >= 0) close(fwd->timer_fd);
+    if (fwd->wake_fd >= 0) close(fwd->wake_fd);
+    if (fwd->epoll_fd >= 0) close(fwd->epoll_fd);
+}
+
+struct dns_forwarder* dns_forwarder_create(int nr_sockets, struct dns_upstream_pool* upstreams) {
+    if (nr_sockets < 1) nr_sockets = 1;
+    if (nr_sockets > DNS_FWD_MAX_SOCKETS) nr_sockets = DNS_FWD_MAX_SOCKETS;
+    if (!upstreams || upstreams->nr_upstreams == 0) {
+        fprintf(stderr, "Forwarder needs at least one upstream server\n");
+        return NULL;
+    }
+
+    struct dns_forwarder* fwd = malloc(sizeof(struct dns_forwarder));
+    if (!fwd) {
+        fprintf(stderr, "Failed to allocate memory for forwarder\n");
+        return NULL;
+    }
+    memset(fwd, 0, sizeof(struct dns_forwarder));
+    fwd->epoll_fd = -1;
+    fwd->timer_fd = -1;
+    fwd->wake_fd = -1;
+    fwd->upstreams = upstreams;
+
+    pthread_mutex_init(&fwd->lock, NULL);
+    for (int i = DNS_FWD_MAX_INFLIGHT - 1; i >= 0; i--) {
+        fwd->slots[i].next = fwd->free_list;
+        fwd->free_list = &fwd->slots[i];
+    }
+    fwd->id_state = (uint32_t)time(NULL) ^ (uint32_t)getpid() ^ 0x9e3779b9u;
+    if (fwd->id_state == 0) fwd->id_state = 1;
+
+    fwd->epoll_fd = epoll_create1(0);
+    if (fwd->epoll_fd < 0) {
+        perror("Failed to create forwarder epoll instance");
+        goto fail;
+    }
+
+    // upstream sockets: bound once to an ephemeral port and reused for every query
+    for (int i = 0; i < nr_sockets; i++) {
+        int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (sockfd < 0) {
+            perror("Failed to create upstream socket");
+            goto fail;
+        }
+        fwd->sockets[fwd->nr_sockets++] = sockfd;
+
+        struct sockaddr_in local_addr;
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sin_family = AF_INET;
+        local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        local_addr.sin_port = htons(0);
+        if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+            perror("Failed to bind upstream socket");
+            goto fail;
+        }
+        if (fwd_epoll_add(fwd, sockfd) < 0) {
+            perror("Failed to watch upstream socket");
+            goto fail;
+        }
+    }
+
+    // timeout sweep
+    fwd->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (fwd->timer_fd < 0) {
+        perror("Failed to create forwarder timer");
+        goto fail;
+    }
+    struct itimerspec tick;
+    memset(&tick, 0, sizeof(tick));
+    tick.it_interval.tv_nsec = DNS_FWD_TICK_MS * 1000000L;
+    tick.it_value.tv_nsec = DNS_FWD_TICK_MS * 1000000L;
+    if (timerfd_settime(fwd->timer_fd, 0, &tick, NULL) < 0 || fwd_epoll_add(fwd, fwd->timer_fd) < 0) {
+        perror("Failed to arm forwarder timer");
+        goto fail;
+    }
+
+    fwd->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (fwd->wake_fd < 0 || fwd_epoll_add(fwd, fwd->wake_fd) < 0) {
+        perror("Failed to create forwarder wakeup descriptor");
+        goto fail;
+    }
+
+    fwd->running = 1;
+    if (pthread_create(&fwd->io_thread, NULL, fwd_io_loop, fwd) != 0) {
+        perror("Failed to create forwarder i/o thread");
+        goto fail;
+    }
+
+    return fwd;
+
+fail:
+    fwd_close_fds(fwd);
+    pthread_mutex_destroy(&fwd->lock);
+    free(fwd);
+    return NULL;
+}
+
+int dns_forwarder_submit(struct dns_forwarder* fwd,
+                         const char* qname,
+                         uint16_t qtype,
+                         int timeout_ms,
+                         dns_forward_done_fn done,
+                         void* user_data)
+{
+    if (!fwd || !qname || !done || strlen(qname) >= DNS_FWD_MAX_NAME) {
+        return -1;
+    }
+
+    if (timeout_ms <= 0) {
+        timeout_ms = DNS_FWD_TIMEOUT_MS;
+    }
+
+    uint64_t now = fwd_now_ms();
+    int upstream = dns_upstream_select(fwd->upstreams, 0, now);
+    if (upstream < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fwd->lock);
+
+    struct dns_inflight* q = fwd->free_list;
+    if (!q) {
+        pthread_mutex_unlock(&fwd->lock);
+        fprintf(stderr, "Forwarder in-flight table is full\n");
+        return -1;
+    }
+    fwd->free_list = q->next;
+
+    strcpy(q->qname, qname);
+    q->qtype = qtype;
+    q->deadline_ms = now + (uint64_t)timeout_ms;
+    q->tried_mask = 0;
+    q->nr_active = 0;
+    q->tcp_fd = -1;
+    q->tcp_buf = NULL;
+    q->done = done;
+    q->user_data = user_data;
+
+    int hedge_delay = dns_upstream_hedge_delay(fwd->upstreams, upstream);
+    q->hedge_at_ms = hedge_delay > 0 ? now + hedge_delay : 0;
+
+    // linked before sending so a fast reply always finds its entry
+    q->prev = NULL;
+    q->next = fwd->active;
+    if (fwd->active) {
+        fwd->active->prev = q;
+    }
+    fwd->active = q;
+    fwd->nr_inflight++;
+
+    if (fwd_send_leg(fwd, q, upstream, now) < 0) {
+        // nothing was sent, so done will never run: the caller keeps ownership of user_data
+        fwd_finish(fwd, q);
+        pthread_mutex_unlock(&fwd->lock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&fwd->lock);
+    return 0;
+}
+
+void dns_forwarder_destroy(struct dns_forwarder* fwd) {
+    if (!fwd) {
+        return;
+    }
+
+    fwd->running = 0;
+    uint64_t one = 1;
+    if (write(fwd->wake_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to wake forwarder i/o thread");
+    }
+    pthread_join(fwd->io_thread, NULL);
+
+    // nothing will answer the remaining queries any more
+    while (fwd->active) {
+        struct dns_inflight* q = fwd->active;
+        dns_forward_done_fn done = q->done;
+        void* user_data = q->user_data;
+        fwd_finish(fwd, q);
+        done(DNS_FWD_ERROR, NULL, 0, user_data);
+    }
+
+    fwd_close_fds(fwd);
+    pthread_mutex_destroy(&fwd->lock);
+    free(fwd);
+}
@@ -0,0 +1,115 @@
+#ifndef __DNS_FORWARDER_H__
+#define __DNS_FORWARDER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "dns_upstream.h"
+
+/* asynchronous forwarding engine */
+// workers hand a query to the forwarder and return right away. a single i/o thread owns a few
+// long-lived upstream udp sockets, matches replies against the in-flight table and expires
+// queries that were not answered in time. the completion callback is what resumes the request.
+// which upstream gets a query, how long each attempt may take and when a hedged duplicate is
+// sent are decided by the upstream pool (dns_upstream.h).
+
+#define DNS_FWD_MAX_SOCKETS 4       /* long-lived upstream sockets */
+#define DNS_FWD_MAX_INFLIGHT 1024   /* queries waiting for an upstream reply */
+#define DNS_FWD_BUCKETS 256         /* in-flight hash buckets (keyed by query id) */
+#define DNS_FWD_TIMEOUT_MS 5000     /* overall deadline of a forwarded query */
+#define DNS_FWD_TICK_MS 10          /* timer resolution for timeouts and hedging */
+#define DNS_FWD_MAX_LEGS 2          /* copies of one query in flight (primary + hedge/failover) */
+#define DNS_FWD_MAX_NAME 256
+#define DNS_FWD_MAX_EVENTS 64
+
+/* tcp retry states (after a truncated udp answer) */
+#define DNS_FWD_TCP_WRITING 1       /* connecting, then sending the length-prefixed query */
+#define DNS_FWD_TCP_READING 2       /* reading the length prefix, then the answer */
+
+/* completion status */
+#define DNS_FWD_OK 0
+#define DNS_FWD_TIMEOUT -1
+#define DNS_FWD_ERROR -2
+
+// called from the forwarder's i/o thread, exactly once per submitted query.
+// reply/len are only valid for the duration of the call (NULL/0 unless status is DNS_FWD_OK).
+typedef void (*dns_forward_done_fn) (int status,
+                                    const uint8_t *reply,
+                                    size_t len,
+                                    void *user_data);
+
+struct dns_inflight;
+
+// one copy of a query sent to one upstream. replies are matched on (id, qname, upstream).
+struct dns_fwd_leg {
+    uint16_t id;                        /* id used on the wire */
+    int upstream;                       /* index in the upstream pool */
+    int sock_index;                     /* which upstream socket sent it */
+    uint64_t sent_ms;                   /* for the rtt sample */
+    uint64_t deadline_ms;               /* retransmit timeout of this copy */
+    int active;
+    struct dns_inflight *owner;
+    struct dns_fwd_leg *next;           /* hash chain */
+};
+
+struct dns_inflight {
+    char qname[DNS_FWD_MAX_NAME];       /* question name, dotted */
+    uint16_t qtype;
+    uint64_t deadline_ms;               /* overall expiry (monotonic) */
+    uint64_t hedge_at_ms;               /* when to send a hedged copy, 0 = never */
+    uint32_t tried_mask;                /* upstreams that already got this query */
+    struct dns_fwd_leg legs[DNS_FWD_MAX_LEGS];
+    int nr_active;
+    int tcp_fd;                         /* >= 0 while retrying over tcp after TC */
+    int tcp_state;
+    uint16_t tcp_id;                    /* id of the tcp query; the answer must match it */
+    int tcp_upstream;                   /* the upstream asked over tcp, for its stats */
+    uint64_t tcp_sent_ms;               /* for the rtt sample */
+    uint8_t *tcp_buf;                   /* length-prefixed query, then the answer */
+    size_t tcp_len;                     /* bytes transferred so far */
+    size_t tcp_need;                    /* bytes expected in the current state */
+    dns_forward_done_fn done;
+    void *user_data;
+    struct dns_inflight *next;          /* active list / free list */
+    struct dns_inflight *prev;
+};
+
+struct dns_forwarder {
+    int sockets[DNS_FWD_MAX_SOCKETS];
+    int nr_sockets;
+    int next_socket;                    /* round robin over sockets */
+    int epoll_fd;
+    int timer_fd;                       /* periodic tick driving timeouts */
+    int wake_fd;                        /* eventfd used to stop the i/o thread */
+    pthread_t io_thread;
+    volatile int running;
+
+    struct dns_upstream_pool *upstreams;
+
+    pthread_mutex_t lock;               /* guards everything below */
+    struct dns_inflight slots[DNS_FWD_MAX_INFLIGHT];
+    struct dns_inflight *free_list;
+    struct dns_inflight *active;        /* queries waiting for an answer */
+    struct dns_fwd_leg *buckets[DNS_FWD_BUCKETS];
+    int nr_inflight;
+    uint32_t id_state;                  /* xorshift state for query ids */
+};
+
+/* create the engine with nr_sockets upstream sockets and start its i/o thread.
+   the pool must outlive the forwarder */
+struct dns_forwarder* dns_forwarder_create(int nr_sockets, struct dns_upstream_pool *upstreams);
+
+/* send a query upstream without blocking; done is called later from the i/o thread.
+   timeout_ms bounds the whole query including failovers (<= 0 means DNS_FWD_TIMEOUT_MS).
+   returns 0 if the query is in flight, -1 if it could not be sent (done is not called) */
+int dns_forwarder_submit(struct dns_forwarder *fwd,
+                         const char *qname,
+                         uint16_t qtype,
+                         int timeout_ms,
+                         dns_forward_done_fn done,
+                         void *user_data);
+
+/* stop the i/o thread, fail every pending query with DNS_FWD_ERROR and free the engine */
+void dns_forwarder_destroy(struct dns_forwarder *fwd);
+
+#endif
@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "dns_name.h"
+#include "dns_packet.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAME_X86 1
+#endif
+
+#define NAME_PAD 288                 /* DNS_NAME_MAX rounded up to whole 32-byte blocks */
+
+// lowercases buf in place and sets bit i of bad for every byte i that is not a name character.
+// buf is NAME_PAD bytes, zero past len, and 32-byte aligned
+typedef void (*name_blocks_fn)(uint8_t *buf, size_t len, uint64_t *bad);
+
+static void name_blocks_scalar(uint8_t* buf, size_t len, uint64_t* bad) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+            buf[i] = c;
+        }
+        int ok = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '*';
+        if (!ok) {
+            bad[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+}
+
+#ifdef __SSE2__
+// signed compares are fine: bytes >= 0x80 come out negative and fall outside every range
+static void name_blocks_sse2(uint8_t* buf, size_t len, uint64_t* bad) {
+    const __m128i upper_lo = _mm_set1_epi8('A' - 1);
+    const __m128i upper_hi = _mm_set1_epi8('Z' + 1);
+    const __m128i lower_lo = _mm_set1_epi8('a' - 1);
+    const __m128i lower_hi = _mm_set1_epi8('z' + 1);
+    const __m128i digit_lo = _mm_set1_epi8('0' - 1);
+    const __m128i digit_hi = _mm_set1_epi8('9' + 1);
+    const __m128i case_bit = _mm_set1_epi8('a' - 'A');
+
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i v = _mm_load_si128((const __m128i*)(buf + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_lo), _mm_cmplt_epi8(v, upper_hi));
+        v = _mm_add_epi8(v, _mm_and_si128(upper, case_bit));
+        _mm_store_si128((__m128i*)(buf + i), v);
+
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lower_lo), _mm_cmplt_epi8(v, lower_hi));
+        ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(v, digit_lo), _mm_cmplt_epi8(v, digit_hi)));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+
+        uint64_t mask = ~(uint32_t)_mm_movemask_epi8(ok) & 0xFFFF;
+        bad[i >> 6] |= mask << (i & 63);
+    }
+}
+#endif
+
+#ifdef NAME_X86
+__attribute__((target("avx2")))
+static void name_blocks_avx2(uint8_t* buf, size_t len, uint64_t* bad) {
+    const __m256i upper_lo = _mm256_set1_epi8('A' - 1);
+    const __m256i upper_hi = _mm256_set1_epi8('Z' + 1);
+    const __m256i lower_lo = _mm256_set1_epi8('a' - 1);
+    const __m256i lower_hi = _mm256_set1_epi8('z' + 1);
+    const __m256i digit_lo = _mm256_set1_epi8('0' - 1);
+    const __m256i digit_hi = _mm256_set1_epi8('9' + 1);
+    const __m256i case_bit = _mm256_set1_epi8('a' - 'A');
+
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i v = _mm256_load_si256((const __m256i*)(buf + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, upper_lo), _mm256_cmpgt_epi8(upper_hi, v));
+        v = _mm256_add_epi8(v, _mm256_and_si256(upper, case_bit));
+        _mm256_store_si256((__m256i*)(buf + i), v);
+
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lower_lo), _mm256_cmpgt_epi8(lower_hi, v));
+        ok = _mm256_or_si256(ok, _mm256_and_si256(_mm256_cmpgt_epi8(v, digit_lo), _mm256_cmpgt_epi8(digit_hi, v)));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+
+        uint64_t mask = ~(uint32_t)_mm256_movemask_epi8(ok);
+        bad[i >> 6] |= mask << (i & 63);
+    }
+}
+#endif
+
+static name_blocks_fn name_blocks = name_blocks_scalar;
+static pthread_once_t name_blocks_once = PTHREAD_ONCE_INIT;
+
+// widest kernel this cpu runs
+static void name_pick_blocks(void) {
+#ifdef NAME_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name_blocks = name_blocks_avx2;
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    name_blocks = name_blocks_sse2;
+#endif
+}
+
+// one word into the hash: both halves of the 128-bit product, folded. a plain 64-bit multiply only
+// carries a difference upwards, so names that differ in a digit or two in several labels (h1.c2 vs
+// h2.c1) could cancel out to the very same hash
+static inline uint64_t name_hash_word(uint64_t hash, uint64_t word) {
+    __uint128_t product = (__uint128_t)(hash ^ word) * 0xFF51AFD7ED558CCDULL;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint64_t dns_name_hash_bytes(const uint8_t* buf, size_t len, uint64_t seed) {
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ seed ^ len;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        hash = name_hash_word(hash, word);
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, buf + i, len - i);
+        hash = name_hash_word(hash, word);
+    }
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 29);
+}
+
+int dns_name_canon(const uint8_t* wire, size_t max, uint8_t* lower, struct dns_name_info* info) {
+    uint64_t length_bytes[NAME_PAD / 64 + 1] = {0};
+    size_t pos = 0;
+
+    // label boundaries form a chain of length bytes, so finding them stays scalar
+    info->nr_labels = 0;
+    while (1) {
+        if (pos >= max || pos >= DNS_NAME_MAX) {
+            return DNS_NAME_ELABEL;
+        }
+        uint8_t label_length = wire[pos];
+        length_bytes[pos >> 6] |= 1ULL << (pos & 63);
+        if (label_length == 0) {
+            break;
+        }
+        if (label_length > 63) {
+            return DNS_NAME_ELABEL;
+        }
+        info->labels[info->nr_labels++] = (uint8_t)pos;
+        pos += label_length + 1;
+    }
+    size_t len = pos + 1;
+    info->len = (uint16_t)len;
+
+    uint8_t buf[NAME_PAD] __attribute__((aligned(32)));
+    memcpy(buf, wire, len);
+    memset(buf + len, 0, NAME_PAD - len);
+
+    // length bytes (0..63) are never upper case letters, so the whole name is lowercased in one go
+    uint64_t bad[NAME_PAD / 64 + 1] = {0};
+    pthread_once(&name_blocks_once, name_pick_blocks);
+    name_blocks(buf, len, bad);
+
+    memcpy(lower, buf, len);
+    info->hash = (uint32_t)dns_name_hash_bytes(buf, len, 0);
+
+    // length bytes and the padding are not characters
+    uint64_t stray = 0;
+    for (size_t i = 0; i * 64 < len; i++) {
+        uint64_t in_name = len - i * 64 >= 64 ? ~0ULL : (1ULL << (len - i * 64)) - 1;
+        stray |= bad[i] & ~length_bytes[i] & in_name;
+    }
+    return stray ? DNS_NAME_ECHAR : DNS_NAME_OK;
+}
+
+int dns_name_canon_dotted(const char* name, uint8_t* lower, struct dns_name_info* info) {
+    uint8_t wire[DNS_NAME_MAX + 2];
+    size_t name_len = strlen(name);
+
+    // 253 characters, or 254 with the trailing dot, make the longest valid wire name
+    if (name_len > DNS_NAME_MAX - 1 || (name_len == DNS_NAME_MAX - 1 && name[name_len - 1] != '.')) {
+        return DNS_NAME_ELABEL;
+    }
+    int wire_len = dns_encode_name(wire, name);
+
+    int result = dns_name_canon(wire, wire_len, lower, info);
+    // an empty label ("a..b") ends the name early
+    if (result != DNS_NAME_ELABEL && info->len != wire_len) {
+        return DNS_NAME_ELABEL;
+    }
+    return result;
+}
+
+uint32_t dns_name_hash_dotted(const char* name) {
+    uint8_t lower[DNS_NAME_MAX];
+    struct dns_name_info info;
+
+    if (dns_name_canon_dotted(name, lower, &info) != DNS_NAME_ELABEL) {
+        return info.hash;
+    }
+
+    // not a valid name, but it still needs a bucket
+    uint32_t hash = 5381;
+    for (; *name; name++) {
+        uint8_t c = (uint8_t)*name;
+        hash = ((hash << 5) + hash) + (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+    return hash;
+}
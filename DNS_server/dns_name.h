@@ -0,0 +1,42 @@
+#ifndef __DNS_NAME_H__
+#define __DNS_NAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* name canonicalization kernel */
+// one pass over an uncompressed wire-format name that checks label lengths, checks characters,
+// lowercases, records where every label starts and hashes the result. the byte work is done 16
+// (sse2) or 32 (avx2, picked at run time) bytes at a time, with a scalar fallback elsewhere.
+// the parser, the caches and the trie all use it, so the same name always gets the same hash,
+// whether it arrived as wire labels or as a dotted string.
+
+#define DNS_NAME_MAX 255             /* wire length, root byte included */
+#define DNS_NAME_MAX_LABELS 128
+
+/* results */
+#define DNS_NAME_OK 0
+#define DNS_NAME_ECHAR -1            /* a byte other than letters, digits, '-', '_' or '*'; output is still filled */
+#define DNS_NAME_ELABEL -2           /* label over 63 bytes, compression pointer or name over 255 bytes */
+
+struct dns_name_info {
+    uint16_t len;                    /* wire length, root byte included */
+    uint8_t nr_labels;               /* not counting the root */
+    uint8_t labels[DNS_NAME_MAX_LABELS]; /* offset of each label's length byte, leftmost first */
+    uint32_t hash;                   /* of the lowercased wire form */
+};
+
+/* canonicalize the name at wire (at most max bytes) into lower, which needs DNS_NAME_MAX bytes */
+int dns_name_canon(const uint8_t *wire, size_t max, uint8_t *lower, struct dns_name_info *info);
+
+/* same for a dotted string ("www.example.com", trailing dot optional) */
+int dns_name_canon_dotted(const char *name, uint8_t *lower, struct dns_name_info *info);
+
+/* hash of a dotted name; equal to dns_name_canon()'s hash of the same name in wire format */
+uint32_t dns_name_hash_dotted(const char *name);
+
+/* the word-at-a-time hash behind the above, for any bytes; the caches, the bloom filters and the
+   perfect hash use it too. seed picks one of a family of hashes (0 for the names' own) */
+uint64_t dns_name_hash_bytes(const uint8_t *buf, size_t len, uint64_t seed);
+
+#endif
@@ -10,6 +10,7 @@
 #include <netinet/in.h>
 
 #include "dns_packet.h"
+#include "dns_view.h"
 
 /* utility Functions */
 
@@ -48,10 +49,18 @@ int dns_read_name(char* dest, const void* data, uint16_t offset, size_t max_len)
                 jumped = 1;
             }
             
+            // pointers must go backwards and only a few times, or a crafted packet loops forever
             uint16_t jump_offset = ((*data_ptr & 0x3F) << 8) | *(data_ptr + 1);
-            data_ptr = (const uint8_t*)data + jump_offset;
+            const uint8_t* target = (const uint8_t*)data + jump_offset;
+            if (target >= data_ptr || ++jump_count > 16) {
+                return -1;
+            }
+            data_ptr = target;
             continue;
         }
+        if (*data_ptr & 0xC0) {
+            return -1;  // reserved label types
+        }
         
         // normal label
         uint8_t label_length = *data_ptr++;
@@ -82,6 +91,163 @@ int dns_read_name(char* dest, const void* data, uint16_t offset, size_t max_len)
     return jumped ? total_offset : total_offset;
 }
 
+// function to encode domain name into DNS wire format (fixing FormErr)
+int dns_encode_name(uint8_t* buffer, const char* domain) {
+    // the root is only the terminating zero
+    if (domain[0] == '\0' || strcmp(domain, ".") == 0) {
+        buffer[0] = 0;
+        return 1;
+    }
+
+    uint8_t* label_length_ptr = buffer++;  // advance buffer after storing length ptr
+    int total_length = 1;                  // start at 1 for first length byte
+    int label_length = 0;
+    
+    while (*domain) {
+        if (*domain == '.' && domain[1] == '\0') {
+            break;                                // trailing dot of a fully qualified name
+        }
+        if (*domain == '.') {
+            *label_length_ptr = label_length;     // write the length of current label
+            label_length_ptr = buffer++;          // set up for next label, increment buffer
+            label_length = 0;                     // reset for next label
+            total_length++;                       // count the length byte
+        } else {
+            *buffer++ = *domain;                  // copy character
+            label_length++;
+            total_length++;
+        }
+        domain++;
+    }
+    
+    // handle last label
+    *label_length_ptr = label_length;
+    *buffer = 0;  // add terminating zero
+    
+    return total_length + 1;  // include terminating zero in total length
+}
+
+// writes one record with an uncompressed owner name; returns its length or -1 if it doesn't fit
+int dns_write_rr(uint8_t* buffer, size_t size, const struct dns_answer* rr) {
+    if (strlen(rr->name) + 2 + 10 + rr->rdlength > size) {
+        return -1;
+    }
+
+    size_t offset = dns_encode_name(buffer, rr->name);
+
+    uint16_t type = htons(rr->type);
+    uint16_t class = htons(rr->class);
+    uint32_t ttl = htonl(rr->ttl);
+    uint16_t rdlength = htons(rr->rdlength);
+
+    memcpy(buffer + offset, &type, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+    memcpy(buffer + offset, &class, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+    memcpy(buffer + offset, &ttl, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    memcpy(buffer + offset, &rdlength, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    memcpy(buffer + offset, rr->rdata, rr->rdlength);
+    offset += rr->rdlength;
+
+    return (int)offset;
+}
+
+// writes an OPT pseudo-record advertising udp_size; returns its length or -1 if it doesn't fit
+int dns_write_opt(uint8_t* buffer, size_t size, uint16_t udp_size, uint8_t do_bit) {
+    if (size < DNS_OPT_RR_SIZE) {
+        return -1;
+    }
+
+    uint16_t type = htons(DNS_TYPE_OPT);
+    uint16_t payload = htons(udp_size);
+    uint16_t flags = htons(do_bit ? 0x8000 : 0);
+
+    buffer[0] = 0;                          // owner: root
+    memcpy(buffer + 1, &type, sizeof(uint16_t));
+    memcpy(buffer + 3, &payload, sizeof(uint16_t));
+    buffer[5] = 0;                          // extended rcode
+    buffer[6] = 0;                          // version 0
+    memcpy(buffer + 7, &flags, sizeof(uint16_t));
+    buffer[9] = 0;                          // rdlength: no options
+    buffer[10] = 0;
+
+    return DNS_OPT_RR_SIZE;
+}
+
+// largest udp response the peer said it can take (512 without edns), capped at what we support;
+// over tcp only the length prefix limits it
+uint16_t dns_edns_payload_limit(const struct dns_edns* edns) {
+    if (edns && edns->tcp) {
+        return DNS_TCP_MAX_SIZE;
+    }
+    if (!edns || !edns->present || edns->udp_size < DNS_UDP_MIN_SIZE) {
+        return DNS_UDP_MIN_SIZE;
+    }
+    return edns->udp_size > DNS_EDNS_MAX_SIZE ? DNS_EDNS_MAX_SIZE : edns->udp_size;
+}
+
+// serializes a single-question query into buffer; returns the wire length or -1.
+// edns_size != 0 adds an OPT record so the upstream may answer with up to edns_size bytes over udp
+int dns_build_query(uint8_t* buffer, size_t size, uint16_t id, const char* qname, uint16_t qtype, uint16_t edns_size) {
+    // header + longest name + qtype/qclass + opt
+    if (size < sizeof(struct dns_header) + 256 + 4 + DNS_OPT_RR_SIZE || strlen(qname) > 253) {
+        return -1;
+    }
+
+    struct dns_header header;
+    memset(&header, 0, sizeof(header));
+    header.id = htons(id);
+    header.qr = QR_QUERY;
+    header.opcode = OPCODE_QUERY;
+    header.rd = 1;
+    header.qdcount = htons(1);
+    header.arcount = htons(edns_size ? 1 : 0);
+
+    size_t offset = 0;
+    memcpy(buffer + offset, &header, sizeof(struct dns_header));
+    offset += sizeof(struct dns_header);
+
+    offset += dns_encode_name(buffer + offset, qname);
+
+    uint16_t net_qtype = htons(qtype);
+    uint16_t net_qclass = htons(DNS_CLASS_IN);
+    memcpy(buffer + offset, &net_qtype, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+    memcpy(buffer + offset, &net_qclass, sizeof(uint16_t));
+    offset += sizeof(uint16_t);
+
+    if (edns_size) {
+        offset += dns_write_opt(buffer + offset, size - offset, edns_size, 0);
+    }
+
+    return (int)offset;
+}
+
+// returns the offset just past the name at offset, or -1 if it runs outside the packet
+int dns_skip_name(const void* data, size_t len, size_t offset) {
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    while (offset < len) {
+        uint8_t label_length = bytes[offset];
+        if (label_length == 0) {
+            return (int)(offset + 1);
+        }
+        if ((label_length & 0xC0) == 0xC0) {
+            // a pointer ends the name in place
+            return offset + 2 <= len ? (int)(offset + 2) : -1;
+        }
+        if (label_length & 0xC0) {
+            return -1;  // reserved label types
+        }
+        offset += label_length + 1;
+    }
+
+    return -1;
+}
+
 // creates a query packet to use in forwarding
 struct dns_packet* dns_create_query_packet(const void* in_qname) {
     struct dns_packet* packet = malloc(sizeof(struct dns_packet));
@@ -100,8 +266,9 @@ struct dns_packet* dns_create_query_packet(const void* in_qname) {
     packet->header.rd = 1;
     packet->header.qdcount = 1;
     
-    // question setup
-    packet->question.qname = strdup(in_qname);
+    // question setup; the name is the packet's only storage
+    packet->storage = strdup(in_qname);
+    packet->question.qname = packet->storage;
     if (!packet->question.qname) {
         fprintf(stderr, "Failed to allocate memory for domain name\n");
         free(packet);
@@ -113,20 +280,23 @@ struct dns_packet* dns_create_query_packet(const void* in_qname) {
     return packet;
 }
 
+// frees what a packet points to (not the packet itself, which may live on the stack)
+void dns_packet_release(struct dns_packet* packet) {
+    free(packet->storage);
+    packet->storage = NULL;
+    packet->question.qname = NULL;
+    packet->answers = NULL;
+    packet->authority = NULL;
+    packet->additional = NULL;
+    packet->nr_answers = 0;
+    packet->nr_authority = 0;
+    packet->nr_additional = 0;
+}
+
 // cleanup function for query packet
 void dns_free_packet(struct dns_packet* packet) {
     if (packet) {
-        if (packet->question.qname) {
-            free(packet->question.qname);
-        }
-        if (packet->header.ancount > 0) {
-            if (packet->answer.name) {
-                free(packet->answer.name);
-            }
-            if (packet->answer.rdata) {
-                free(packet->answer.rdata);
-            }
-        }
+        dns_packet_release(packet);
         free(packet);
     }
 }
@@ -147,107 +317,221 @@ int dns_header_parse(struct dns_header* header, const void* data) {
     return 0;
 }
 
-int dns_question_parse(struct dns_question* question, const void* data, size_t* offset) {
-    // read name
-    char name_buffer[256];
-    int name_end = dns_read_name(name_buffer, data, *offset, sizeof(name_buffer));
-    if (name_end < 0) {
-        return -1;
-    }
-    
-    *offset = name_end;
-    
-    // allocate and copy name
-    question->qname = strdup(name_buffer);
-    if (!question->qname) {
-        return -1;
+// the reverse of dns_header_parse: writes header (host order) to data in wire format
+void dns_header_write(void* data, const struct dns_header* header) {
+    struct dns_header net_header = *header;
+
+    net_header.id = htons(net_header.id);
+    net_header.qdcount = htons(net_header.qdcount);
+    net_header.ancount = htons(net_header.ancount);
+    net_header.nscount = htons(net_header.nscount);
+    net_header.arcount = htons(net_header.arcount);
+    memcpy(data, &net_header, sizeof(struct dns_header));
+}
+
+// finds the OPT record in the additional section; offset points just past the question section.
+// returns 0 (edns->present says whether one was found) or -1 if the packet is malformed
+int dns_edns_parse(struct dns_edns* edns, const void* data, size_t len, size_t offset, const struct dns_header* header) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    int nr_records = header->ancount + header->nscount + header->arcount;
+
+    memset(edns, 0, sizeof(struct dns_edns));
+
+    for (int i = 0; i < nr_records; i++) {
+        int name_end = dns_skip_name(data, len, offset);
+        if (name_end < 0 || (size_t)name_end + 10 > len) {
+            return -1;
+        }
+
+        const uint8_t* fixed = bytes + name_end;
+        uint16_t type = (fixed[0] << 8) | fixed[1];
+        uint16_t rdlength = (fixed[8] << 8) | fixed[9];
+        if ((size_t)name_end + 10 + rdlength > len) {
+            return -1;
+        }
+
+        // OPT is only valid in the additional section, with the root as owner
+        if (type == DNS_TYPE_OPT && i >= header->ancount + header->nscount && name_end == (int)offset + 1) {
+            edns->present = 1;
+            edns->udp_size = (fixed[2] << 8) | fixed[3];
+            edns->ext_rcode = fixed[4];
+            edns->version = fixed[5];
+            edns->do_bit = (fixed[6] & 0x80) ? 1 : 0;
+            return 0;
+        }
+
+        offset = name_end + 10 + rdlength;
     }
-    
-    // read type and class
-    const uint8_t* cur_ptr = (const uint8_t*)data + *offset;
-    memcpy(&question->qtype, cur_ptr, sizeof(uint16_t));
-    memcpy(&question->qclass, cur_ptr + sizeof(uint16_t), sizeof(uint16_t));
-    
-    question->qtype = ntohs(question->qtype);
-    question->qclass = ntohs(question->qclass);
-    
-    *offset += 4; // advance past TYPE and CLASS
-    
+
     return 0;
 }
 
-int dns_answer_parse(struct dns_answer* answer, const void* data) {
-    // calculate offset to answer section
-    const uint8_t* cur_ptr = (const uint8_t*)data + sizeof(struct dns_header);
-    
-    // skip question section
-    char name_buffer[256];
-    int offset = dns_read_name(name_buffer, data, sizeof(struct dns_header), sizeof(name_buffer));
-    if (offset < 0) {
-        return -1;
+// copies the rdata of rr to dest (or only measures it when dest is NULL) and returns its length,
+// -1 if it is malformed. names inside the rdata of the types below may point anywhere in the
+// message, so they are expanded; other rdata is opaque and copied as is.
+static int packet_copy_rdata(const struct dns_msg_view* view, const struct dns_rr_view* rr, uint8_t* dest) {
+    size_t pos = rr->rdata;
+    size_t end = rr->rdata + rr->rdlength;
+    size_t prefix = 0;      // fixed bytes before the names
+    size_t suffix = 0;      // fixed bytes after them
+    int nr_names;
+
+    switch (rr->type) {
+        case DNS_TYPE_NS:
+        case DNS_TYPE_CNAME:
+        case DNS_TYPE_PTR:
+            nr_names = 1;
+            break;
+        case DNS_TYPE_MX:
+            prefix = 2;     // preference
+            nr_names = 1;
+            break;
+        case DNS_TYPE_SOA:
+            nr_names = 2;   // mname, rname
+            suffix = 20;    // serial, refresh, retry, expire, minimum
+            break;
+        default:
+            if (dest) {
+                memcpy(dest, view->data + pos, rr->rdlength);
+            }
+            return rr->rdlength;
     }
-    offset += 4; // skip QTYPE and QCLASS
-    
-    // read answer name
-    int name_end = dns_read_name(name_buffer, data, offset, sizeof(name_buffer));
-    if (name_end < 0) {
+
+    size_t out = 0;
+    if (pos + prefix > end) {
         return -1;
     }
-    
-    // allocate and copy name
-    answer->name = strdup(name_buffer);
-    if (!answer->name) {
-        return -1;
+    if (dest) {
+        memcpy(dest, view->data + pos, prefix);
     }
-    
-    // read fixed-length fields
-    cur_ptr = (const uint8_t*)data + name_end;
-    memcpy(&answer->type, cur_ptr, sizeof(uint16_t));
-    memcpy(&answer->class, cur_ptr + sizeof(uint16_t), sizeof(uint16_t));
-    memcpy(&answer->ttl, cur_ptr + 2 * sizeof(uint16_t), sizeof(uint32_t));
-    memcpy(&answer->rdlength, cur_ptr + 2 * sizeof(uint16_t) + sizeof(uint32_t), sizeof(uint16_t));
-    
-    // Convert to host byte order
-    answer->type = ntohs(answer->type);
-    answer->class = ntohs(answer->class);
-    answer->ttl = ntohl(answer->ttl);
-    answer->rdlength = ntohs(answer->rdlength);
-    
-    // Read RDATA
-    cur_ptr += 2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t);
-    answer->rdata = malloc(answer->rdlength + 1);
-    if (!answer->rdata) {
-        free(answer->name);
+    pos += prefix;
+    out += prefix;
+
+    for (int i = 0; i < nr_names; i++) {
+        struct dns_name_view name;
+        if (dns_view_name_at(view, pos, &name) != DNS_VIEW_OK || pos + name.wire_len > end) {
+            return -1;
+        }
+        if (dest) {
+            dns_view_name_wire(view, &name, dest + out, name.name_len);
+        }
+        pos += name.wire_len;
+        out += name.name_len;
+    }
+
+    if (pos + suffix != end) {
         return -1;
     }
-    
-    memcpy(answer->rdata, cur_ptr, answer->rdlength);
-    answer->rdata[answer->rdlength] = '\0';
-    
-    return 0;
+    if (dest) {
+        memcpy(dest + out, view->data + pos, suffix);
+    }
+    out += suffix;
+
+    return (int)out;
 }
 
-int dns_request_parse(struct dns_packet* pkt, const void* data) {
-    size_t offset = 0;
-    
-    // parse header
-    if (dns_header_parse(&pkt->header, data) < 0) {
+// OPT is described by pkt->edns instead of being kept as a record
+static int packet_is_opt(const struct dns_msg_view* view, const struct dns_rr_view* rr, uint32_t index) {
+    return rr->type == DNS_TYPE_OPT && index >= dns_view_additional_start(view);
+}
+
+// bytes of text a dotted name takes: its wire length covers the dots and the terminator, except for
+// the root, whose single byte has to hold "." and the terminator
+static size_t packet_name_size(const struct dns_name_view* name) {
+    return name->name_len < 2 ? 2 : name->name_len;
+}
+
+// parses a whole message: question, every record of the three sections and edns.
+// the view pass validates everything and sizes a single block, a second pass fills it in.
+int dns_request_parse(struct dns_packet* pkt, const void* data, size_t len) {
+    struct dns_msg_view view;
+
+    memset(pkt, 0, sizeof(struct dns_packet));
+
+    if (dns_view_parse(&view, data, len, NULL, 0) != DNS_VIEW_OK || view.header.qdcount != 1) {
         return -1;
     }
-    offset += sizeof(struct dns_header);
-    
-    // parse question
-    if (dns_question_parse(&pkt->question, data, &offset) < 0) {
+    uint32_t nr_records = (uint32_t)view.header.ancount + view.header.nscount + view.header.arcount;
+
+    // first pass: how many records each section keeps and how many bytes their strings need
+    size_t text_size = packet_name_size(&view.qname);
+    uint32_t nr_kept = 0;
+    size_t offset = view.question_end;
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        offset = dns_view_read_rr(&view, offset, &rr);
+        if (packet_is_opt(&view, &rr, i)) {
+            continue;
+        }
+        int rdata_size = packet_copy_rdata(&view, &rr, NULL);
+        if (rdata_size < 0) {
+            return -1;
+        }
+        text_size += packet_name_size(&rr.name) + rdata_size + 1;   // rdata gets a terminator for printing
+        nr_kept++;
+    }
+
+    // record array first so it is suitably aligned, strings after it
+    size_t array_size = nr_kept * sizeof(struct dns_answer);
+    uint8_t* storage = malloc(array_size + text_size);
+    if (!storage) {
         return -1;
     }
-    
-    // parse answer if present
-    if (pkt->header.ancount > 0) {
-        if (dns_answer_parse(&pkt->answer, data) < 0) {
+    struct dns_answer* records = (struct dns_answer*)storage;
+    char* text = (char*)storage + array_size;
+
+    pkt->storage = storage;
+    pkt->header = view.header;
+    pkt->edns = view.edns;
+
+    pkt->question.qname = text;
+    if (dns_view_name_str(&view, &view.qname, text, packet_name_size(&view.qname)) < 0) {
+        dns_packet_release(pkt);
+        return -1;
+    }
+    text += packet_name_size(&view.qname);
+    pkt->question.qtype = view.qtype;
+    pkt->question.qclass = view.qclass;
+
+    // second pass: fill the records in, in packet order
+    uint32_t kept = 0;
+    offset = view.question_end;
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        offset = dns_view_read_rr(&view, offset, &rr);
+        if (packet_is_opt(&view, &rr, i)) {
+            continue;
+        }
+
+        struct dns_answer* record = &records[kept++];
+        record->name = text;
+        if (dns_view_name_str(&view, &rr.name, text, packet_name_size(&rr.name)) < 0) {
+            dns_packet_release(pkt);
             return -1;
         }
+        text += packet_name_size(&rr.name);
+
+        record->type = rr.type;
+        record->class = rr.class;
+        record->ttl = rr.ttl;
+        record->rdata = text;
+        record->rdlength = (uint16_t)packet_copy_rdata(&view, &rr, (uint8_t*)text);
+        text[record->rdlength] = '\0';
+        text += record->rdlength + 1;
+
+        if (i < dns_view_authority_start(&view)) {
+            pkt->nr_answers++;
+        } else if (i < dns_view_additional_start(&view)) {
+            pkt->nr_authority++;
+        } else {
+            pkt->nr_additional++;
+        }
     }
-    
+
+    pkt->answers = records;
+    pkt->authority = records + pkt->nr_answers;
+    pkt->additional = pkt->authority + pkt->nr_authority;
+
     return 0;
 }
 
@@ -263,8 +547,24 @@ void dns_print_packet(const struct dns_packet* packet) {
     dns_print_question(&packet->question);
     printf("\n");
     
-    if (packet->header.ancount > 0) {
-        dns_print_answer(&packet->answer);
+    for (int i = 0; i < packet->nr_answers; i++) {
+        dns_print_answer(&packet->answers[i]);
+        printf("\n");
+    }
+    if (packet->nr_authority > 0) {
+        printf("Authority:\n");
+        printf("----------\n");
+        for (int i = 0; i < packet->nr_authority; i++) {
+            dns_print_answer(&packet->authority[i]);
+        }
+        printf("\n");
+    }
+    if (packet->nr_additional > 0) {
+        printf("Additional:\n");
+        printf("-----------\n");
+        for (int i = 0; i < packet->nr_additional; i++) {
+            dns_print_answer(&packet->additional[i]);
+        }
         printf("\n");
     }
 }
@@ -303,5 +603,11 @@ void dns_print_answer(const struct dns_answer* answer) {
     printf("CLASS: %d\n", answer->class);
     printf("TTL: %d\n", answer->ttl);
     printf("RDLENGTH: %d\n", answer->rdlength);
-    printf("RDATA: %s\n", answer->rdata);
+    if (answer->type == DNS_TYPE_A && answer->rdlength == 4) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, answer->rdata, ip, sizeof(ip));
+        printf("RDATA: %s\n", ip);
+    } else {
+        printf("RDATA: (%d bytes)\n", answer->rdlength);
+    }
 }
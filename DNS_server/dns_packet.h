@@ -15,6 +15,14 @@
 #define AA_NONAUTHORITY 0	/* used when message is sent from anything that is NOT the authoritative server */
 #define AA_AUTHORITY 1 		/* used when message is sent from the authoritative server */
 
+/* response codes */
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_FORMERR 1	/* the query could not be interpreted */
+#define DNS_RCODE_SERVFAIL 2	/* the server could not get an answer */
+#define DNS_RCODE_NXDOMAIN 3	/* the name does not exist */
+#define DNS_RCODE_NOTIMP 4		/* kind of query not supported */
+#define DNS_RCODE_REFUSED 5
+
 /* record types */
 #define DNS_TYPE_A 1      	/* host address */
 #define DNS_TYPE_NS 2     	/* authoritative name server */
@@ -23,9 +31,17 @@
 #define DNS_TYPE_PTR 12   	/* domain name pointer */
 #define DNS_TYPE_MX 15    	/* mail exchange */
 #define DNS_TYPE_TXT 16   	/* text strings */
+#define DNS_TYPE_OPT 41   	/* edns0 pseudo-record (rfc 6891) */
+#define DNS_TYPE_ANY 255  	/* qtype only: every record of the name */
 
 #define DNS_CLASS_IN 1    /* dns internet class */
 
+/* message sizes */
+#define DNS_UDP_MIN_SIZE 512	/* classic udp limit, used when the peer has no edns */
+#define DNS_EDNS_MAX_SIZE 4096	/* largest udp payload we advertise and accept */
+#define DNS_TCP_MAX_SIZE 65535	/* tcp messages carry a 16-bit length prefix */
+#define DNS_OPT_RR_SIZE 11		/* root name + type + class + ttl + rdlength */
+
 struct dns_header {
     uint16_t id;      /* query id */
     #if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -64,6 +80,8 @@ struct dns_question
 	uint16_t qclass;
 };
 
+/* a resource record of any section. name is dotted; rdata is in wire format, with names inside
+   it (NS, CNAME, PTR, MX, SOA) decompressed so the record can be copied into another message */
 struct dns_answer
 {
 	char *name;
@@ -74,21 +92,38 @@ struct dns_answer
 	char *rdata;
 };
 
+/* edns0 data carried by the OPT record in the additional section */
+struct dns_edns
+{
+	uint8_t present;	/* 1 if the message had an OPT record */
+	uint8_t version;
+	uint8_t do_bit;		/* dnssec ok */
+	uint8_t ext_rcode;	/* upper 8 bits of the 12-bit rcode */
+	uint16_t udp_size;	/* requestor's udp payload size */
+	uint8_t tcp;		/* not from the message: it came over tcp, so the answer may be up to DNS_TCP_MAX_SIZE */
+};
+
+/* a whole message. everything the pointers below refer to lives in one block (storage),
+   so a parsed packet costs one allocation and is released with dns_packet_release() */
 struct dns_packet
 {
 	struct dns_header header;
 	struct dns_question question;
-	struct dns_answer answer;
-//	struct dns_authority authority;
-//	struct dns_additional additional;
+	struct dns_answer *answers;		/* nr_answers records */
+	struct dns_answer *authority;	/* nr_authority records */
+	struct dns_answer *additional;	/* nr_additional records, OPT excluded (see edns) */
+	uint16_t nr_answers;
+	uint16_t nr_authority;
+	uint16_t nr_additional;
+	struct dns_edns edns;
+	void *storage;
 };
 
 /* functions */
 /* parsing */
-int dns_request_parse(struct dns_packet *pkt, const void *data);
+int dns_request_parse(struct dns_packet *pkt, const void *data, size_t len);
 int dns_header_parse(struct dns_header *header, const void *data);
-int dns_question_parse(struct dns_question *question, const void *data, size_t* offset);
-int dns_answer_parse(struct dns_answer *answer, const void *data);
+int dns_edns_parse(struct dns_edns *edns, const void *data, size_t len, size_t offset, const struct dns_header *header);
 
 /* printing (debug) */
 void dns_print_packet(const struct dns_packet *packet);
@@ -99,7 +134,15 @@ void dns_print_answer(const struct dns_answer *answer);
 /* utility */
 size_t util_measure_name(const void *data, uint16_t offset);
 int dns_read_name(char *dest, const void *data, uint16_t offset, size_t max_len);
+int dns_encode_name(uint8_t *buffer, const char *domain);
+int dns_build_query(uint8_t *buffer, size_t size, uint16_t id, const char *qname, uint16_t qtype, uint16_t edns_size);
+int dns_write_rr(uint8_t *buffer, size_t size, const struct dns_answer *rr);
+void dns_header_write(void *data, const struct dns_header *header);
+int dns_write_opt(uint8_t *buffer, size_t size, uint16_t udp_size, uint8_t do_bit);
+uint16_t dns_edns_payload_limit(const struct dns_edns *edns);
+int dns_skip_name(const void *data, size_t len, size_t offset);
 struct dns_packet* dns_create_query_packet(const void* in_qname);
 void dns_free_packet(struct dns_packet* packet);
+void dns_packet_release(struct dns_packet *packet);
 
 #endif
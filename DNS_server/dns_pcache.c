@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_pcache.h"
+
+void dns_pcache_init(struct dns_pcache* pc) {
+    memset(pc->buckets, 0, sizeof(pc->buckets));
+    pc->nr_entries = 0;
+    pc->unlocked = 0;
+    pthread_mutex_init(&pc->lock, NULL);
+}
+
+void dns_pcache_init_unlocked(struct dns_pcache* pc) {
+    dns_pcache_init(pc);
+    pc->unlocked = 1;
+}
+
+void dns_pcache_destroy(struct dns_pcache* pc) {
+    for (int i = 0; i < DNS_PCACHE_BUCKETS; i++) {
+        struct dns_pcache_entry* entry = pc->buckets[i];
+        while (entry) {
+            struct dns_pcache_entry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        pc->buckets[i] = NULL;
+    }
+    pc->nr_entries = 0;
+    pthread_mutex_destroy(&pc->lock);
+}
+
+// a cache only its owner thread touches (dns_pcache_init_unlocked) takes no lock
+static inline void pcache_lock(struct dns_pcache* pc) {
+    if (!pc->unlocked) {
+        pthread_mutex_lock(&pc->lock);
+    }
+}
+
+static inline void pcache_unlock(struct dns_pcache* pc) {
+    if (!pc->unlocked) {
+        pthread_mutex_unlock(&pc->lock);
+    }
+}
+
+static uint32_t pcache_hash(const uint8_t* key, size_t len) {
+    return (uint32_t)dns_name_hash_bytes(key, len, 0);
+}
+
+int dns_pcache_key(const uint8_t* query, size_t len, uint8_t* key, uint32_t* hash) {
+    struct dns_header header;
+
+    if (len < sizeof(struct dns_header)) {
+        return -1;
+    }
+    dns_header_parse(&header, query);
+    // one question and at most the OPT record; anything else goes the long way
+    if (header.qr != QR_QUERY || header.opcode != OPCODE_QUERY || header.qdcount != 1 ||
+        header.ancount != 0 || header.nscount != 0 || header.arcount > 1) {
+        return -1;
+    }
+
+    // the question is copied as it is, so it must not contain a compression pointer
+    size_t offset = sizeof(struct dns_header);
+    size_t name_end = offset;
+    while (1) {
+        if (name_end >= len || name_end - offset >= DNS_MAX_NAME_WIRE) {
+            return -1;
+        }
+        uint8_t label_length = query[name_end];
+        if (label_length > DNS_MAX_LABEL) {
+            return -1;
+        }
+        name_end += label_length + 1;
+        if (label_length == 0) {
+            break;
+        }
+    }
+    size_t question_end = name_end + 4;
+    if (name_end - offset > DNS_MAX_NAME_WIRE || question_end > len) {
+        return -1;
+    }
+
+    struct dns_edns edns;
+    if (dns_edns_parse(&edns, query, len, question_end, &header) < 0 || (header.arcount == 1 && !edns.present)) {
+        return -1;
+    }
+
+    uint16_t flags = ((query[2] << 8) | query[3]) & DNS_PCACHE_FLAGS_MASK;
+    size_t key_len = 0;
+    key[key_len++] = flags >> 8;
+    key[key_len++] = flags & 0xFF;
+    memcpy(key + key_len, query + offset, question_end - offset);
+    key_len += question_end - offset;
+    // options (cookies and the like) don't change our answers, so only these take part
+    key[key_len++] = edns.present;
+    key[key_len++] = edns.do_bit;
+    key[key_len++] = edns.udp_size >> 8;
+    key[key_len++] = edns.udp_size & 0xFF;
+
+    *hash = pcache_hash(key, key_len);
+    return (int)key_len;
+}
+
+// drops expired entries of one bucket; caller holds the lock
+static void pcache_purge_bucket(struct dns_pcache* pc, int bucket, time_t now) {
+    struct dns_pcache_entry** link = &pc->buckets[bucket];
+    while (*link) {
+        struct dns_pcache_entry* entry = *link;
+        if (entry->expires <= now) {
+            *link = entry->next;
+            free(entry);
+            pc->nr_entries--;
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+// counts the ttls of a copy of entry's reply down by the time it has been kept
+static void pcache_age_ttls(const struct dns_pcache_entry* entry, uint8_t* dest, time_t now) {
+    uint32_t age = (uint32_t)(now - entry->stored);
+    if (age == 0) {
+        return;
+    }
+    for (uint16_t i = 0; i < entry->nr_ttls; i++) {
+        uint8_t* field = dest + entry->ttl_offsets[i];
+        uint32_t ttl = ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+        ttl = ttl > age ? ttl - age : 0;
+        field[0] = ttl >> 24;
+        field[1] = ttl >> 16;
+        field[2] = ttl >> 8;
+        field[3] = ttl;
+    }
+}
+
+// copies the reply for key out of its bucket; caller holds the lock
+static int pcache_find(struct dns_pcache* pc, const uint8_t* key, size_t key_len, uint32_t hash,
+                       uint8_t* dest, size_t size, time_t now) {
+    int bucket = hash % DNS_PCACHE_BUCKETS;
+
+    pcache_purge_bucket(pc, bucket, now);
+    for (struct dns_pcache_entry* entry = pc->buckets[bucket]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            if (entry->len > size) {
+                return -1;
+            }
+            memcpy(dest, entry->packet, entry->len);
+            pcache_age_ttls(entry, dest, now);
+            return entry->len;
+        }
+    }
+    return -1;
+}
+
+int dns_pcache_lookup(struct dns_pcache* pc, const uint8_t* key, size_t key_len, uint32_t hash,
+                      uint8_t* dest, size_t size) {
+    pcache_lock(pc);
+    int len = pcache_find(pc, key, key_len, hash, dest, size, time(NULL));
+    pcache_unlock(pc);
+
+    return len;
+}
+
+void dns_pcache_lookup_batch(struct dns_pcache* pc, struct dns_pcache_query* queries, size_t n) {
+    time_t now = time(NULL);
+
+    pcache_lock(pc);
+    for (size_t i = 0; i < n; i++) {
+        __builtin_prefetch(&pc->buckets[queries[i].hash % DNS_PCACHE_BUCKETS]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const struct dns_pcache_entry* head = pc->buckets[queries[i].hash % DNS_PCACHE_BUCKETS];
+        if (head) {
+            __builtin_prefetch(head);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct dns_pcache_query* query = &queries[i];
+        query->len = pcache_find(pc, query->key, query->key_len, query->hash, query->dest, query->size, now);
+    }
+    pcache_unlock(pc);
+}
+
+// where the ttl of every record of reply is, OPT excluded; returns how many, -1 if a record is broken.
+// with offsets NULL they are only counted
+static int pcache_ttl_offsets(const struct dns_msg_view* reply, uint16_t* offsets) {
+    uint32_t nr_records = (uint32_t)reply->header.ancount + reply->header.nscount + reply->header.arcount;
+    size_t offset = reply->question_end;
+    int nr_ttls = 0;
+
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        int next = dns_view_read_rr(reply, offset, &rr);
+        if (next < 0) {
+            return -1;
+        }
+        offset = next;
+
+        if (rr.type == DNS_TYPE_OPT) {
+            continue;
+        }
+        if (offsets) {
+            offsets[nr_ttls] = rr.rdata - 6; // ttl and rdlength come right before the rdata
+        }
+        nr_ttls++;
+    }
+    return nr_ttls;
+}
+
+// the entry dns_pcache_store() makes of a reply that is parsed already (NULL: its ttls are replayed as
+// they are); NULL if it isn't kept
+static struct dns_pcache_entry* pcache_build(const uint8_t* key, size_t key_len, uint32_t hash,
+                                             const uint8_t* packet, size_t len, uint32_t ttl,
+                                             const struct dns_msg_view* view) {
+    if (ttl == 0 || key_len > DNS_PCACHE_KEY_MAX || len > UINT16_MAX) {
+        return NULL;
+    }
+    if (ttl > DNS_PCACHE_MAX_TTL) {
+        ttl = DNS_PCACHE_MAX_TTL;
+    }
+    int nr_ttls = view ? pcache_ttl_offsets(view, NULL) : 0;
+    if (nr_ttls < 0) {
+        return NULL;
+    }
+
+    // the ttl offsets go after the packet, on a 2 byte boundary
+    size_t packet_room = (len + 1) & ~(size_t)1;
+    struct dns_pcache_entry* fresh = malloc(sizeof(struct dns_pcache_entry) + packet_room + nr_ttls * sizeof(uint16_t));
+    if (!fresh) {
+        return NULL;
+    }
+    memcpy(fresh->key, key, key_len);
+    fresh->key_len = (uint16_t)key_len;
+    fresh->hash = hash;
+    fresh->stored = time(NULL);
+    fresh->expires = fresh->stored + ttl;
+    fresh->len = (uint16_t)len;
+    memcpy(fresh->packet, packet, len);
+    fresh->nr_ttls = (uint16_t)nr_ttls;
+    fresh->ttl_offsets = (uint16_t*)(fresh->packet + packet_room);
+    if (view) {
+        pcache_ttl_offsets(view, fresh->ttl_offsets);
+    }
+    fresh->next = NULL;
+    return fresh;
+}
+
+void dns_pcache_insert(struct dns_pcache* pc, struct dns_pcache_entry* fresh) {
+    int bucket = fresh->hash % DNS_PCACHE_BUCKETS;
+
+    pcache_lock(pc);
+    pcache_purge_bucket(pc, bucket, time(NULL));
+
+    struct dns_pcache_entry** link = &pc->buckets[bucket];
+    while (*link) {
+        struct dns_pcache_entry* entry = *link;
+        if (entry->hash == fresh->hash && entry->key_len == fresh->key_len &&
+            memcmp(entry->key, fresh->key, fresh->key_len) == 0) {
+            *link = entry->next;
+            free(entry);
+            pc->nr_entries--;
+            break;
+        }
+        link = &entry->next;
+    }
+
+    if (pc->nr_entries >= DNS_PCACHE_MAX) {
+        // full of live entries; the new one is simply not kept
+        pcache_unlock(pc);
+        free(fresh);
+        return;
+    }
+    fresh->next = pc->buckets[bucket];
+    pc->buckets[bucket] = fresh;
+    pc->nr_entries++;
+    pcache_unlock(pc);
+}
+
+// built outside the lock, linked in under it
+static void pcache_insert(struct dns_pcache* pc, const uint8_t* key, size_t key_len, uint32_t hash,
+                          const uint8_t* packet, size_t len, uint32_t ttl, const struct dns_msg_view* view) {
+    struct dns_pcache_entry* fresh = pcache_build(key, key_len, hash, packet, len, ttl, view);
+    if (fresh) {
+        dns_pcache_insert(pc, fresh);
+    }
+}
+
+void dns_pcache_store(struct dns_pcache* pc, const uint8_t* key, size_t key_len, uint32_t hash,
+                      const uint8_t* packet, size_t len, uint32_t ttl) {
+    struct dns_msg_view view;
+    int parsed = dns_view_parse(&view, packet, len, NULL, 0) == DNS_VIEW_OK;
+    pcache_insert(pc, key, key_len, hash, packet, len, ttl, parsed ? &view : NULL);
+}
+
+void dns_pcache_flush(struct dns_pcache* pc) {
+    pcache_lock(pc);
+    for (int i = 0; i < DNS_PCACHE_BUCKETS; i++) {
+        struct dns_pcache_entry* entry = pc->buckets[i];
+        while (entry) {
+            struct dns_pcache_entry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        pc->buckets[i] = NULL;
+    }
+    pc->nr_entries = 0;
+    pcache_unlock(pc);
+}
+
+// whether the question of key is for name (lowercased wire); the key keeps the client's spelling.
+// length bytes are below 'A', so lowercasing them changes nothing
+static int pcache_key_is_name(const struct dns_pcache_entry* entry, const uint8_t* name, size_t len) {
+    if (entry->key_len < 2 + len) {
+        return 0;
+    }
+    const uint8_t* qname = entry->key + 2;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = qname[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c != name[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int dns_pcache_invalidate(struct dns_pcache* pc, const uint8_t* name, size_t len) {
+    int nr_dropped = 0;
+
+    // entries are hashed on the whole key, so every bucket has to be looked at
+    pcache_lock(pc);
+    for (int i = 0; i < DNS_PCACHE_BUCKETS; i++) {
+        struct dns_pcache_entry** link = &pc->buckets[i];
+        while (*link) {
+            struct dns_pcache_entry* entry = *link;
+            if (pcache_key_is_name(entry, name, len)) {
+                *link = entry->next;
+                free(entry);
+                pc->nr_entries--;
+                nr_dropped++;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    pcache_unlock(pc);
+    return nr_dropped;
+}
+
+struct dns_pcache_entry* dns_pcache_prepare_answer(const uint8_t* key, size_t key_len, uint32_t hash,
+                                                   const uint8_t* answer, size_t len) {
+    struct dns_msg_view view;
+    if (dns_view_parse(&view, answer, len, NULL, 0) != DNS_VIEW_OK || view.header.tc ||
+        (view.header.rcode != DNS_RCODE_NOERROR && view.header.rcode != DNS_RCODE_NXDOMAIN)) {
+        return NULL;
+    }
+
+    int64_t ttl = dns_pcache_reply_ttl(&view);
+    return ttl > 0 ? pcache_build(key, key_len, hash, answer, len, (uint32_t)ttl, &view) : NULL;
+}
+
+void dns_pcache_store_answer(struct dns_pcache* pc, const uint8_t* key, size_t key_len, uint32_t hash,
+                             const uint8_t* answer, size_t len) {
+    struct dns_pcache_entry* fresh = dns_pcache_prepare_answer(key, key_len, hash, answer, len);
+    if (fresh) {
+        dns_pcache_insert(pc, fresh);
+    }
+}
+
+int64_t dns_pcache_reply_ttl(const struct dns_msg_view* reply) {
+    uint32_t nr_records = (uint32_t)reply->header.ancount + reply->header.nscount + reply->header.arcount;
+    int64_t ttl = -1;
+    size_t offset = reply->question_end;
+
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        int next = dns_view_read_rr(reply, offset, &rr);
+        if (next < 0) {
+            return -1;
+        }
+        offset = next;
+
+        if (rr.type == DNS_TYPE_OPT) {
+            continue;
+        }
+        if (ttl < 0 || rr.ttl < ttl) {
+            ttl = rr.ttl;
+        }
+    }
+
+    return ttl;
+}
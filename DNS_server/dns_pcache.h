@@ -0,0 +1,103 @@
+#ifndef __DNS_PCACHE_H__
+#define __DNS_PCACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "dns_view.h"
+
+/* packet cache */
+// finished answers, exactly as they were sent to a client, keyed on the raw bytes of the query:
+// the question section as the client spelled it, the flags that change an answer (opcode, RD, AD,
+// CD) and the client's edns (present, DO, udp size). clients asking byte-identical questions get
+// byte-identical answers, so a hit is a lookup, one copy and the id patched in, before the query
+// is even parsed. an entry lives as long as the smallest ttl in the answer; each record's ttl is
+// counted down by the time the answer has been kept, as an upstream resolver's would be.
+
+#define DNS_PCACHE_BUCKETS 1024
+#define DNS_PCACHE_MAX 4096                       /* entries */
+#define DNS_PCACHE_KEY_MAX (2 + DNS_MAX_NAME_WIRE + 4 + 4) /* flags + question + edns */
+#define DNS_PCACHE_MAX_TTL 86400                  /* cap, so a bogus ttl can't pin an entry */
+#define DNS_PCACHE_FLAGS_MASK 0x7930              /* opcode, RD, AD and CD of the header's flag word */
+
+struct dns_pcache_entry {
+    uint8_t key[DNS_PCACHE_KEY_MAX];
+    uint16_t key_len;
+    uint32_t hash;
+    time_t stored;
+    time_t expires;
+    uint16_t len;
+    uint16_t nr_ttls;
+    uint16_t *ttl_offsets;                        /* of every record's ttl in packet (OPT excluded), after it */
+    struct dns_pcache_entry *next;
+    uint8_t packet[];                             /* allocated together with the entry */
+};
+
+struct dns_pcache {
+    struct dns_pcache_entry *buckets[DNS_PCACHE_BUCKETS];
+    int nr_entries;
+    pthread_mutex_t lock;
+    int unlocked;                                 /* see dns_pcache_init_unlocked */
+};
+
+void dns_pcache_init(struct dns_pcache *pc);
+
+/* the same, for a cache that only ever one thread uses (a core's shard, see dns_cores.h): it takes no
+   lock, so every other thread has to hand its answers to that one (dns_pcache_prepare_answer) */
+void dns_pcache_init_unlocked(struct dns_pcache *pc);
+void dns_pcache_destroy(struct dns_pcache *pc);
+
+/* build the key of a raw query into key (DNS_PCACHE_KEY_MAX bytes) and its hash; returns the key
+   length, or -1 for queries that are not cached (not a plain one-question query, compressed qname) */
+int dns_pcache_key(const uint8_t *query, size_t len, uint8_t *key, uint32_t *hash);
+
+/* copy the cached reply for key into dest, its ttls aged; returns its length, -1 on a miss or if dest
+   is too small */
+int dns_pcache_lookup(struct dns_pcache *pc, const uint8_t *key, size_t key_len, uint32_t hash,
+                      uint8_t *dest, size_t size);
+
+/* one lookup of dns_pcache_lookup_batch: the key in, the reply copied to dest and its length out */
+struct dns_pcache_query {
+    const uint8_t *key;
+    size_t key_len;
+    uint32_t hash;
+    uint8_t *dest;
+    size_t size;
+    int len;                                      /* set like dns_pcache_lookup returns it */
+};
+
+/* dns_pcache_lookup for n queries under one lock: every bucket, then every chain head, is prefetched
+   for the whole batch before any of them is read */
+void dns_pcache_lookup_batch(struct dns_pcache *pc, struct dns_pcache_query *queries, size_t n);
+
+/* store a reply for ttl seconds, replacing an older one for the same key; its records' ttls are counted
+   down on lookup if it parses */
+void dns_pcache_store(struct dns_pcache *pc, const uint8_t *key, size_t key_len, uint32_t hash,
+                      const uint8_t *packet, size_t len, uint32_t ttl);
+
+/* store an answer for as long as its smallest ttl; truncated answers, errors other than NXDOMAIN
+   and answers without any record to take a ttl from are not kept */
+void dns_pcache_store_answer(struct dns_pcache *pc, const uint8_t *key, size_t key_len, uint32_t hash,
+                             const uint8_t *answer, size_t len);
+
+/* the entry dns_pcache_store_answer would keep, built without touching any cache, so any thread can
+   make it for the one thread that may insert it; NULL if the answer isn't kept. it is one allocation:
+   free() it if it never gets inserted */
+struct dns_pcache_entry *dns_pcache_prepare_answer(const uint8_t *key, size_t key_len, uint32_t hash,
+                                                   const uint8_t *answer, size_t len);
+
+/* link a prepared entry in, replacing an older one for the same key; the cache owns it after this */
+void dns_pcache_insert(struct dns_pcache *pc, struct dns_pcache_entry *entry);
+
+/* drop every entry */
+void dns_pcache_flush(struct dns_pcache *pc);
+
+/* drop every answer to a question for name (lowercased wire form, root byte included), whatever its
+   type, flags or spelling; returns how many were dropped */
+int dns_pcache_invalidate(struct dns_pcache *pc, const uint8_t *name, size_t len);
+
+/* smallest ttl among the records of a parsed reply (OPT excluded), -1 if it has none */
+int64_t dns_pcache_reply_ttl(const struct dns_msg_view *reply);
+
+#endif
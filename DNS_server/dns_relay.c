@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dns_relay.h"
+
+// what is needed to answer a client once the upstream replied (or to answer it from the cache)
+struct relay_request {
+    struct dns_relay *relay;
+    struct dns_endpoint *listener;
+    struct sockaddr_in client;
+    struct dns_header header;           /* the client's query header */
+    struct dns_edns edns;               /* the client's edns, decides the size limit */
+    char qname[DNS_FWD_MAX_NAME];
+    uint16_t qtype;
+    uint16_t qclass;
+    uint8_t key[DNS_PCACHE_KEY_MAX];    /* packet cache key of the query */
+    int key_len;
+    uint32_t key_hash;
+};
+
+static int relay_fill(struct relay_request* req, struct dns_relay* relay, struct dns_endpoint* ep,
+                      const struct dns_msg_view* query, const struct sockaddr_in* sender) {
+    if (dns_view_name_str(query, &query->qname, req->qname, sizeof(req->qname)) < 0) {
+        return -1;
+    }
+    req->relay = relay;
+    req->listener = ep;
+    req->client = *sender;
+    req->header = query->header;
+    req->edns = query->edns;
+    req->qtype = query->qtype;
+    req->qclass = query->qclass;
+    // answers over tcp can be bigger than a udp client may get, so they are not kept for replay
+    req->key_len = relay->cache && !query->edns.tcp ? dns_pcache_key(query->data, query->len, req->key, &req->key_hash) : -1;
+    return 0;
+}
+
+// keep an answer that went out; dns_pcache decides whether it is worth keeping
+static void relay_store(const struct relay_request* req, const uint8_t* answer, size_t len) {
+    if (req->relay->cache && req->key_len > 0) {
+        dns_pcache_store_answer(req->relay->cache, req->key, req->key_len, req->key_hash, answer, len);
+    }
+}
+
+// the same for an upstream's answer, on the forwarder's thread: a cache of the listener's thread alone
+// gets the entry through relay->store and inserts it there
+static void relay_store_forwarded(const struct relay_request* req, const uint8_t* answer, size_t len) {
+    const struct dns_relay* relay = req->relay;
+
+    if (!relay->store) {
+        relay_store(req, answer, len);
+        return;
+    }
+    if (relay->cache && req->key_len > 0) {
+        struct dns_pcache_entry* entry = dns_pcache_prepare_answer(req->key, req->key_len, req->key_hash, answer, len);
+        if (entry) {
+            relay->store(entry, relay->store_data);
+        }
+    }
+}
+
+// answer with just the question and an error code
+static void relay_send_rcode(const struct relay_request* req, int rcode) {
+    struct dns_packet answer;
+    memset(&answer, 0, sizeof(answer));
+
+    answer.header = req->header;
+    answer.header.qr = QR_RESPONSE;
+    answer.header.aa = AA_NONAUTHORITY;
+    answer.header.ra = 1;
+    answer.header.rcode = rcode;
+    answer.question.qname = (char*)req->qname;
+    answer.question.qtype = req->qtype;
+    answer.question.qclass = req->qclass;
+    answer.edns = req->edns;
+
+    dns_send_answer(req->listener, &answer, &req->client);
+}
+
+// offset of the last record of a parsed message, 0 if it has none
+static size_t relay_last_record(const struct dns_msg_view* msg) {
+    uint32_t nr_records = (uint32_t)msg->header.ancount + msg->header.nscount + msg->header.arcount;
+    size_t offset = msg->question_end;
+    size_t last = 0;
+
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        last = offset;
+        offset = dns_view_read_rr(msg, offset, &rr);
+    }
+    return last;
+}
+
+// relay a reply as it is, with the client's id put back
+static void relay_send(const struct relay_request* req, const struct dns_msg_view* reply) {
+    struct dns_header header = reply->header;
+    size_t len = reply->len;
+    header.id = req->header.id;
+
+    // clients that didn't use edns must not get an OPT record. upstreams put it last, so it is cut off
+    if (!req->edns.present && reply->edns.present && header.arcount > 0) {
+        size_t last = relay_last_record(reply);
+        struct dns_rr_view rr;
+        if (last > 0 && dns_view_read_rr(reply, last, &rr) >= 0 && rr.type == DNS_TYPE_OPT) {
+            len = last;
+            header.arcount--;
+        }
+    }
+
+    uint8_t answer[DNS_EDNS_MAX_SIZE];
+    if (len <= dns_edns_payload_limit(&req->edns)) {
+        dns_send_raw(req->listener, &header, reply->data, len, &req->client);
+        // the cache wants the answer in one piece; only misses pay for this copy
+        if (req->relay->cache && req->key_len > 0) {
+            dns_header_write(answer, &header);
+            memcpy(answer + sizeof(struct dns_header), reply->data + sizeof(struct dns_header), len - sizeof(struct dns_header));
+            relay_store_forwarded(req, answer, len);
+        }
+        return;
+    }
+
+    // too big for this client: the slow path re-encodes it, leaving out additional records or
+    // setting TC when even the answer doesn't fit
+    struct dns_packet packet;
+    if (dns_request_parse(&packet, reply->data, reply->len) < 0) {
+        relay_send_rcode(req, DNS_RCODE_SERVFAIL);
+        return;
+    }
+    packet.header.id = req->header.id;
+    packet.edns = req->edns;
+    int answer_len = dns_encode_answer(&packet, answer, sizeof(answer));
+    dns_packet_release(&packet);
+    if (answer_len > 0) {
+        dns_send_message(req->listener, answer, answer_len, &req->client);
+        relay_store_forwarded(req, answer, answer_len);
+    }
+}
+
+// forwarder completion; runs on its i/o thread
+static void relay_done(int status, const uint8_t* reply, size_t len, void* user_data) {
+    struct relay_request* req = (struct relay_request*)user_data;
+    struct dns_msg_view view;
+
+    if (status == DNS_FWD_OK && dns_view_parse(&view, reply, len, NULL, 0) == DNS_VIEW_OK) {
+        relay_send(req, &view);
+    } else {
+        relay_send_rcode(req, DNS_RCODE_SERVFAIL);
+    }
+
+    dns_endpoint_release(req->listener);
+    free(req);
+}
+
+// one query; found is its zone lookup when the caller already did it (NULL: look it up here)
+static void relay_query(struct dns_relay* relay, struct dns_endpoint* ep, const struct dns_msg_view* query,
+                        const struct sockaddr_in* sender, const struct ZoneLookup* found)
+{
+    struct relay_request local;
+
+    // only questions; responses are dropped so two relays can't bounce packets between them
+    if (query->header.qr != QR_QUERY) {
+        return;
+    }
+    if (query->header.qdcount != 1) {
+        dns_send_format_error(ep, &query->header, sender);
+        return;
+    }
+    if (relay_fill(&local, relay, ep, query, sender) < 0) {
+        return;
+    }
+    if (query->header.opcode != OPCODE_QUERY) {
+        relay_send_rcode(&local, DNS_RCODE_NOTIMP);
+        return;
+    }
+    if (query->qclass != DNS_CLASS_IN) {
+        relay_send_rcode(&local, DNS_RCODE_REFUSED);
+        return;
+    }
+    if (relay->zones) {
+        uint8_t answer[DNS_EDNS_MAX_SIZE];
+        int len = found ? dns_auth_answer_found(relay->zones, query, found, answer, sizeof(answer))
+                        : dns_auth_answer(relay->zones, query, answer, sizeof(answer));
+        if (len > 0) {
+            dns_send_message(ep, answer, len, sender);
+            relay_store(&local, answer, len);
+            return;
+        }
+        if (len < 0) {
+            relay_send_rcode(&local, DNS_RCODE_SERVFAIL);
+            return;
+        }
+    }
+
+    struct relay_request* req = malloc(sizeof(struct relay_request));
+    if (!req) {
+        relay_send_rcode(&local, DNS_RCODE_SERVFAIL);
+        return;
+    }
+    *req = local;
+    // the answer goes out later, from the forwarder's thread; a tcp connection has to last until then
+    dns_endpoint_hold(ep);
+
+    if (dns_forwarder_submit(relay->forwarder, req->qname, req->qtype, 0, relay_done, req) != 0) {
+        relay_send_rcode(req, DNS_RCODE_SERVFAIL);
+        dns_endpoint_release(ep);
+        free(req);
+    }
+}
+
+void dns_relay_query(struct dns_endpoint* ep,
+                     const struct dns_msg_view* query,
+                     const struct sockaddr_in* sender,
+                     void* user_data)
+{
+    relay_query((struct dns_relay*)user_data, ep, query, sender, NULL);
+}
+
+void dns_relay_query_batch(struct dns_endpoint* ep,
+                           const struct dns_msg_view* queries,
+                           const struct sockaddr_in* senders,
+                           int nr_queries,
+                           void* user_data)
+{
+    struct dns_relay* relay = (struct dns_relay*)user_data;
+    struct ZoneLookup found[DNS_RECV_BATCH];
+
+    if (!relay->zones || nr_queries > DNS_RECV_BATCH) {
+        for (int i = 0; i < nr_queries; i++) {
+            relay_query(relay, ep, &queries[i], &senders[i], NULL);
+        }
+        return;
+    }
+
+    // every question of the batch is looked up in our zones together, then answered in order
+    lookupQuestionZoneBatch(relay->zones, queries, nr_queries, found);
+    for (int i = 0; i < nr_queries; i++) {
+        relay_query(relay, ep, &queries[i], &senders[i], &found[i]);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __DNS_RELAY_H__
+#define __DNS_RELAY_H__
+
+#include "dns_server.h"
+#include "dns_forwarder.h"
+#include "dns_pcache.h"
+#include "dns_auth.h"
+
+/* pass-through forwarding */
+// queries (over udp, or over tcp from dns_server_add_tcp_listener) are sent upstream through the
+// forwarder and the reply is relayed without being parsed into a dns_packet: its bytes go back to
+// the client with only the header rewritten (the client's id; arcount when the OPT record is dropped
+// for clients without edns). names inside our own zones never go upstream: dns_auth answers them
+// first. every udp answer sent is also kept in the packet cache, which the listener replays for
+// repeated questions before they reach the relay (dns_endpoint_set_cache).
+
+/* takes an answer of a miss, prepared on the forwarder's thread (dns_pcache_prepare_answer), to the
+   thread that owns the cache; it owns entry from then on */
+typedef void (*dns_relay_store_fn) (struct dns_pcache_entry *entry, void *store_data);
+
+struct dns_relay {
+    struct dns_forwarder *forwarder;
+    struct dns_pcache *cache;           /* optional, NULL = don't cache; give it to the listener too */
+    struct TrieNode *zones;             /* optional, answered authoritatively (see dns_auth.h) */
+    dns_relay_store_fn store;           /* optional, for a cache only the listener's thread may write */
+    void *store_data;
+};
+
+/* view listener callback (see dns_server_add_view_listener); user_data is a struct dns_relay */
+void dns_relay_query(struct dns_endpoint *ep,
+                     const struct dns_msg_view *query,
+                     const struct sockaddr_in *sender,
+                     void *user_data);
+
+/* batch listener callback (see dns_server_add_batch_listener): the zone lookups of the whole batch
+   are done together with lookupQuestionZoneBatch(), the rest is dns_relay_query for each */
+void dns_relay_query_batch(struct dns_endpoint *ep,
+                           const struct dns_msg_view *queries,
+                           const struct sockaddr_in *senders,
+                           int nr_queries,
+                           void *user_data);
+
+#endif
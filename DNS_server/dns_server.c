@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg, pthread_setaffinity_np
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,46 +7,44 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <time.h>
+#include <linux/filter.h>
 
 #include "dns_packet.h"
 #include "dns_server.h"
+#include "dns_writer.h"
+#include "logger.h"
 
-// global socket descriptor
-static int g_sockfd = -1;
-
-// flag for listen loop control
-static volatile int g_keep_running = 1;
-
-// graceful shutdown signal handler
-void handle_signal(int signum) {
-    g_keep_running = 0;
-}
-
-// persistent socket init
-int dns_init_socket(uint16_t port) {
-    if (g_sockfd != -1) {
-        // socket already initialized!
-        return 0;
-    }
+static int dns_endpoint_bind(struct dns_endpoint* ep, uint16_t port, int reuseport) {
+    memset(ep, 0, sizeof(struct dns_endpoint));
+    ep->sockfd = -1;
+    ep->cpu = -1;
 
     // create udp socket
-    g_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (g_sockfd < 0) {
+    ep->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ep->sockfd < 0) {
         perror("Failed to create socket");
         return -1;
     }
 
     // set socket options for reusing address
     int reuse = 1;
-    if (setsockopt(g_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+    if (setsockopt(ep->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
         perror("Failed to set SO_REUSEADDR");
-        close(g_sockfd);
-        g_sockfd = -1;
+        dns_endpoint_close(ep);
+        return -1;
+    }
+    if (reuseport && setsockopt(ep->sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("Failed to set SO_REUSEPORT");
+        dns_endpoint_close(ep);
         return -1;
     }
 
@@ -56,57 +55,40 @@ int dns_init_socket(uint16_t port) {
     bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     bind_addr.sin_port = htons(port);
 
-    if (bind(g_sockfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0) {
+    if (bind(ep->sockfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0) {
         perror("Failed to bind socket");
-        close(g_sockfd);
-        g_sockfd = -1;
+        dns_endpoint_close(ep);
         return -1;
     }
 
-    // setup signal handler for graceful shutdown
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
+    // remember the port that was actually bound
+    socklen_t len = sizeof(bind_addr);
+    if (getsockname(ep->sockfd, (struct sockaddr*)&bind_addr, &len) == 0) {
+        ep->port = ntohs(bind_addr.sin_port);
+    }
 
     return 0;
 }
 
-// clean up socket resources
-void dns_cleanup_socket(void) {
-    if (g_sockfd != -1) {
-        close(g_sockfd);
-        g_sockfd = -1;
-    }
+// open a udp socket bound to port (0 lets the os pick one, e.g. for the local end of a forward)
+int dns_endpoint_open(struct dns_endpoint* ep, uint16_t port) {
+    return dns_endpoint_bind(ep, port, 0);
 }
 
-// function to encode domain name into DNS wire format (fixing FormErr)
-static int dns_encode_name(uint8_t* buffer, const char* domain) {
-    uint8_t* label_length_ptr = buffer++;  // advance buffer after storing length ptr
-    int total_length = 1;                  // start at 1 for first length byte
-    int label_length = 0;
-    
-    while (*domain) {
-        if (*domain == '.') {
-            *label_length_ptr = label_length;     // write the length of current label
-            label_length_ptr = buffer++;          // set up for next label, increment buffer
-            label_length = 0;                     // reset for next label
-            total_length++;                       // count the length byte
-        } else {
-            *buffer++ = *domain;                  // copy character
-            label_length++;
-            total_length++;
-        }
-        domain++;
+int dns_endpoint_open_reuseport(struct dns_endpoint* ep, uint16_t port) {
+    return dns_endpoint_bind(ep, port, 1);
+}
+
+// clean up socket resources
+void dns_endpoint_close(struct dns_endpoint* ep) {
+    if (ep->sockfd != -1) {
+        close(ep->sockfd);
+        ep->sockfd = -1;
     }
-    
-    // handle last label
-    *label_length_ptr = label_length;
-    *buffer = 0;  // add terminating zero
-    
-    return total_length + 1;  // include terminating zero in total length
 }
 
-int dns_send_packet(const struct dns_packet* pkt, const char* server_ip, uint16_t port) {
-    if (g_sockfd == -1) {
+int dns_send_packet(const struct dns_endpoint* ep, const struct dns_packet* pkt, const char* server_ip, uint16_t port) {
+    if (ep->sockfd == -1) {
         fprintf(stderr, "Socket not initialized\n");
         return -1;
     }
@@ -119,122 +101,174 @@ int dns_send_packet(const struct dns_packet* pkt, const char* server_ip, uint16_
         return -1;
     }
 
-    // serialize packet
-    uint8_t buffer[512];  // standard dns udp size
-    size_t offset = 0;
-
-    // convert header to network byte order
-    struct dns_header header = pkt->header;
-    header.id = htons(header.id);
-    header.qdcount = htons(header.qdcount);
-    header.ancount = htons(header.ancount);
-    header.nscount = htons(header.nscount);
-    header.arcount = htons(header.arcount);
-
-    // copy header
-    memcpy(buffer + offset, &header, sizeof(struct dns_header));
-    offset += sizeof(struct dns_header);
-
-    // encode qname in dns wire format
-    int name_length = dns_encode_name(buffer + offset, pkt->question.qname);
-    if (name_length < 0) {
+    // serialize packet; the OPT record we append advertises edns0 so the answer may exceed
+    // 512 bytes without a tcp retry
+    uint8_t buffer[DNS_EDNS_MAX_SIZE];
+    struct dns_writer writer;
+    dns_writer_init(&writer, buffer, sizeof(buffer), &pkt->header);
+    dns_writer_reserve(&writer, DNS_OPT_RR_SIZE);
+    if (dns_writer_question(&writer, pkt->question.qname, pkt->question.qtype, pkt->question.qclass) < 0) {
         fprintf(stderr, "Failed to encode domain name\n");
         return -1;
     }
-    offset += name_length;
+    dns_writer_opt(&writer, DNS_EDNS_MAX_SIZE, 0);
+    size_t offset = dns_writer_finish(&writer);
 
-    // add QTYPE and QCLASS in network byte order
-    uint16_t qtype = htons(pkt->question.qtype);
-    uint16_t qclass = htons(pkt->question.qclass);
-    
-    memcpy(buffer + offset, &qtype, sizeof(uint16_t));
-    offset += sizeof(uint16_t);
-    memcpy(buffer + offset, &qclass, sizeof(uint16_t));
-    offset += sizeof(uint16_t);
-
-    printf("Sending DNS query to %s:%d (packet size: %zu bytes)\n", 
+    LOG_DEBUG("Sending DNS query to %s:%d (packet size: %zu bytes)\n", 
            server_ip, port, offset);
 
-    ssize_t sent = sendto(g_sockfd, buffer, offset, 0,
+    ssize_t sent = sendto(ep->sockfd, buffer, offset, 0,
                          (struct sockaddr*)&server_addr, sizeof(server_addr));
     
     if (sent < 0) {
         perror("Failed to send DNS query");
     } else {
-        printf("Successfully sent %zd bytes\n", sent);
+        LOG_DEBUG("Successfully sent %zd bytes\n", sent);
     }
     
     return sent;
 }
 
-// send answer packet to a client
-int dns_send_answer(const struct dns_packet* answer_pkt, const struct sockaddr_in* client_addr) {
-    if (g_sockfd == -1) {
-        fprintf(stderr, "Socket not initialized\n");
+// encode an answer packet for a client
+// the answer is limited to the udp payload size the client advertised (512 without edns) and names
+// are compressed while it is written. if the answer or authority section still does not fit, only
+// the question goes out with TC set, telling the client to retry over tcp. additional records are
+// optional and are simply left out.
+int dns_encode_answer(const struct dns_packet* answer_pkt, uint8_t* buffer, size_t size) {
+    size_t limit = dns_edns_payload_limit(&answer_pkt->edns);
+    if (limit > size) {
+        limit = size;
+    }
+    struct dns_writer writer;
+    dns_writer_init(&writer, buffer, limit, &answer_pkt->header);
+    // ensure packet is marked as a response
+    writer.header.qr = QR_RESPONSE;
+    if (answer_pkt->edns.present) {
+        dns_writer_reserve(&writer, DNS_OPT_RR_SIZE);
+    }
+
+    // serialize question section (should match the query)
+    if (dns_writer_question(&writer, answer_pkt->question.qname,
+                            answer_pkt->question.qtype, answer_pkt->question.qclass) < 0) {
+        fprintf(stderr, "Question does not fit in a %zu byte answer\n", limit);
         return -1;
     }
 
-    // buffer for serialized packet
-    uint8_t buffer[512];  // standard dns udp size
-    size_t offset = 0;
+    // serialize answer, authority and additional sections
+    int truncated = 0;
+    for (int i = 0; i < answer_pkt->nr_answers && !truncated; i++) {
+        truncated = dns_writer_rr(&writer, DNS_SECTION_ANSWER, &answer_pkt->answers[i]) < 0;
+    }
+    for (int i = 0; i < answer_pkt->nr_authority && !truncated; i++) {
+        truncated = dns_writer_rr(&writer, DNS_SECTION_AUTHORITY, &answer_pkt->authority[i]) < 0;
+    }
+    if (truncated) {
+        // does not fit: send what we have and let the client come back over tcp
+        dns_writer_truncate(&writer);
+    } else {
+        for (int i = 0; i < answer_pkt->nr_additional; i++) {
+            if (dns_writer_rr(&writer, DNS_SECTION_ADDITIONAL, &answer_pkt->additional[i]) < 0) {
+                break;
+            }
+        }
+    }
 
-    // serialize header
-    struct dns_header header = answer_pkt->header;
-    // ensure packet is marked as a response
-    header.qr = QR_RESPONSE;
-    
-    // convert header fields to network byte order
-    header.id = htons(header.id);
-    header.qdcount = htons(header.qdcount);
-    header.ancount = htons(header.ancount);
-    header.nscount = htons(header.nscount);
-    header.arcount = htons(header.arcount);
+    // echo edns0 back to clients that used it, advertising our own limit
+    if (answer_pkt->edns.present) {
+        dns_writer_opt(&writer, DNS_EDNS_MAX_SIZE, answer_pkt->edns.do_bit);
+    }
+    return (int)dns_writer_finish(&writer);
+}
 
-    memcpy(buffer + offset, &header, sizeof(struct dns_header));
-    offset += sizeof(struct dns_header);
+/* tcp */
+
+// one accepted tcp connection. the endpoint comes first, so the one the callbacks get leads back here
+struct dns_tcp_conn {
+    struct dns_endpoint ep;
+    struct dns_endpoint *listener;
+    struct sockaddr_in client;
+    atomic_int refs;                 /* the connection's thread and every answer still owed on it */
+    pthread_mutex_t send_lock;       /* answers come from several threads, one message at a time */
+};
+
+// write one message to a tcp connection, length prefix first; with header, it replaces the message's
+// own like dns_send_raw does
+static int dns_tcp_send(const struct dns_endpoint* ep, const struct dns_header* header, const uint8_t* data, size_t len) {
+    struct dns_tcp_conn* conn = (struct dns_tcp_conn*)ep;
+    if (len > DNS_TCP_MAX_SIZE || len < sizeof(struct dns_header)) {
+        return -1;
+    }
 
-    // serialize question section (should match the query)
-    size_t qname_len = strlen(answer_pkt->question.qname) + 1;
-    memcpy(buffer + offset, answer_pkt->question.qname, qname_len);
-    offset += qname_len;
+    uint8_t prefix[2] = { len >> 8, len & 0xFF };
+    struct dns_header net_header;
+    struct iovec iov[3];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    iov[msg.msg_iovlen].iov_base = prefix;
+    iov[msg.msg_iovlen++].iov_len = sizeof(prefix);
+    if (header) {
+        dns_header_write(&net_header, header);
+        iov[msg.msg_iovlen].iov_base = &net_header;
+        iov[msg.msg_iovlen++].iov_len = sizeof(struct dns_header);
+        iov[msg.msg_iovlen].iov_base = (void*)(data + sizeof(struct dns_header));
+        iov[msg.msg_iovlen++].iov_len = len - sizeof(struct dns_header);
+    } else {
+        iov[msg.msg_iovlen].iov_base = (void*)data;
+        iov[msg.msg_iovlen++].iov_len = len;
+    }
 
-    uint16_t qtype = htons(answer_pkt->question.qtype);
-    uint16_t qclass = htons(answer_pkt->question.qclass);
-    
-    memcpy(buffer + offset, &qtype, sizeof(uint16_t));
-    offset += sizeof(uint16_t);
-    memcpy(buffer + offset, &qclass, sizeof(uint16_t));
-    offset += sizeof(uint16_t);
-
-    // serialize answer section (if present)
-    if (answer_pkt->header.ancount > 0) {
-        // answer name
-        size_t name_len = strlen(answer_pkt->answer.name) + 1;
-        memcpy(buffer + offset, answer_pkt->answer.name, name_len);
-        offset += name_len;
-
-        // answer fixed fields
-        uint16_t type = htons(answer_pkt->answer.type);
-        uint16_t class = htons(answer_pkt->answer.class);
-        uint32_t ttl = htonl(answer_pkt->answer.ttl);
-        uint16_t rdlength = htons(answer_pkt->answer.rdlength);
-
-        memcpy(buffer + offset, &type, sizeof(uint16_t));
-        offset += sizeof(uint16_t);
-        memcpy(buffer + offset, &class, sizeof(uint16_t));
-        offset += sizeof(uint16_t);
-        memcpy(buffer + offset, &ttl, sizeof(uint32_t));
-        offset += sizeof(uint32_t);
-        memcpy(buffer + offset, &rdlength, sizeof(uint16_t));
-        offset += sizeof(uint16_t);
-
-        // answer data
-        memcpy(buffer + offset, answer_pkt->answer.rdata, answer_pkt->answer.rdlength);
-        offset += answer_pkt->answer.rdlength;
-    }
-
-    // send answer packet to client
-    ssize_t sent = sendto(g_sockfd, buffer, offset, 0,
+    int ret = 0;
+    pthread_mutex_lock(&conn->send_lock);
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(ep->sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // half a message leaves the stream unreadable; the client has to reconnect
+            perror("Failed to send DNS answer over tcp");
+            shutdown(ep->sockfd, SHUT_RDWR);
+            ret = -1;
+            break;
+        }
+        // skip what went out
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov[0].iov_len) {
+            sent -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (uint8_t*)msg.msg_iov[0].iov_base + sent;
+            msg.msg_iov[0].iov_len -= sent;
+        }
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    return ret;
+}
+
+// send answer packet to a client
+int dns_send_answer(const struct dns_endpoint* ep, const struct dns_packet* answer_pkt, const struct sockaddr_in* client_addr) {
+    // buffer for serialized packet
+    uint8_t buffer[DNS_EDNS_MAX_SIZE];
+    int len = dns_encode_answer(answer_pkt, buffer, sizeof(buffer));
+    if (len < 0) {
+        return -1;
+    }
+    return dns_send_message(ep, buffer, len, client_addr);
+}
+
+// send a message that is already complete, e.g. an answer encoded earlier
+int dns_send_message(const struct dns_endpoint* ep, const uint8_t* data, size_t len, const struct sockaddr_in* client_addr) {
+    if (ep->sockfd == -1) {
+        fprintf(stderr, "Socket not initialized\n");
+        return -1;
+    }
+    if (ep->tcp) {
+        return dns_tcp_send(ep, NULL, data, len);
+    }
+
+    ssize_t sent = sendto(ep->sockfd, data, len, 0,
                          (struct sockaddr*)client_addr, sizeof(struct sockaddr_in));
     
     if (sent < 0) {
@@ -245,89 +279,296 @@ int dns_send_answer(const struct dns_packet* answer_pkt, const struct sockaddr_i
     return 0;
 }
 
-// start listening for packets
-int dns_start_listening(dns_callback_fn callback, void* user_data) {
-    if (g_sockfd == -1) {
+// send a wire-format message with a new header, e.g. an upstream reply with the client's id restored.
+// the header and the body are gathered by sendmsg, so the body is never copied
+int dns_send_raw(const struct dns_endpoint* ep, const struct dns_header* header, const uint8_t* data, size_t len, const struct sockaddr_in* client_addr) {
+    if (ep->sockfd == -1) {
         fprintf(stderr, "Socket not initialized\n");
         return -1;
     }
+    if (len < sizeof(struct dns_header)) {
+        return -1;
+    }
+    if (ep->tcp) {
+        return dns_tcp_send(ep, header, data, len);
+    }
+
+    struct dns_header net_header;
+    dns_header_write(&net_header, header);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &net_header;
+    iov[0].iov_len = sizeof(struct dns_header);
+    iov[1].iov_base = (void*)(data + sizeof(struct dns_header));
+    iov[1].iov_len = len - sizeof(struct dns_header);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)client_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(ep->sockfd, &msg, 0) < 0) {
+        perror("Failed to send DNS answer");
+        return -1;
+    }
 
-    // get the bound port number for debugging
-    struct sockaddr_in bound_addr;
-    socklen_t bound_len = sizeof(bound_addr);
-    if (getsockname(g_sockfd, (struct sockaddr*)&bound_addr, &bound_len) == 0) {
-        printf("DNS server listening on port %d...\n", ntohs(bound_addr.sin_port));
+    return 0;
+}
+
+int dns_send_format_error(const struct dns_endpoint* ep, const struct dns_header* query, const struct sockaddr_in* client_addr) {
+    struct dns_header header = *query;
+    uint8_t message[sizeof(struct dns_header)];
+
+    // answering a response could start two servers bouncing packets between them
+    if (query->qr != QR_QUERY) {
+        return -1;
     }
+    header.qr = QR_RESPONSE;
+    header.aa = AA_NONAUTHORITY;
+    header.tc = 0;
+    header.ra = 1;
+    header.z = 0;
+    header.ad = 0;
+    header.rcode = DNS_RCODE_FORMERR;
+    header.qdcount = 0;
+    header.ancount = 0;
+    header.nscount = 0;
+    header.arcount = 0;
+    dns_header_write(message, &header);
+    return dns_send_message(ep, message, sizeof(message), client_addr);
+}
 
-    uint8_t buffer[512];  // standard DNS UDP size
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    struct dns_packet received_packet;
-    char client_ip[INET_ADDRSTR_LEN];
+// what one recvmmsg fills: DNS_RECV_BATCH datagrams and their senders
+struct dns_recv_batch {
+    uint8_t buffers[DNS_RECV_BATCH][DNS_EDNS_MAX_SIZE];
+    struct sockaddr_in senders[DNS_RECV_BATCH];
+    struct iovec iov[DNS_RECV_BATCH];
+    struct mmsghdr msgs[DNS_RECV_BATCH];
+    size_t lens[DNS_RECV_BATCH];        /* 0 once a datagram is dealt with */
+};
+
+static void dns_recv_batch_init(struct dns_recv_batch* batch) {
+    memset(batch->msgs, 0, sizeof(batch->msgs));
+    for (int i = 0; i < DNS_RECV_BATCH; i++) {
+        batch->iov[i].iov_base = batch->buffers[i];
+        batch->iov[i].iov_len = DNS_EDNS_MAX_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->senders[i];
+    }
+}
 
-    while (g_keep_running) {
-        // clear the buffer before receiving new data
-        memset(buffer, 0, sizeof(buffer));
-        
-        // receive incoming packet
-        ssize_t received = recvfrom(g_sockfd, buffer, sizeof(buffer), 0,
-                                  (struct sockaddr*)&client_addr, &client_len);
+// answers the queries of a batch from the endpoint's packet cache if identical ones (id aside) were
+// answered before. a stored answer only needs the client's id, so nothing is parsed; it is copied
+// over the query it answers and all of them go out with one sendmmsg. answered datagrams get len 0
+static void dns_replay_answers(const struct dns_endpoint* ep, struct dns_recv_batch* batch, int count) {
+    uint8_t keys[DNS_RECV_BATCH][DNS_PCACHE_KEY_MAX];
+    struct dns_pcache_query queries[DNS_RECV_BATCH];
+    uint16_t ids[DNS_RECV_BATCH];
+    int slots[DNS_RECV_BATCH];
+    int nr_queries = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (batch->lens[i] == 0) {
+            continue;
+        }
+        struct dns_pcache_query* query = &queries[nr_queries];
+        int key_len = dns_pcache_key(batch->buffers[i], batch->lens[i], keys[nr_queries], &query->hash);
+        if (key_len < 0) {
+            continue;
+        }
+        query->key = keys[nr_queries];
+        query->key_len = key_len;
+        query->dest = batch->buffers[i];
+        query->size = DNS_EDNS_MAX_SIZE;
+        memcpy(&ids[nr_queries], batch->buffers[i], sizeof(uint16_t));
+        slots[nr_queries++] = i;
+    }
+    if (nr_queries == 0) {
+        return;
+    }
+    dns_pcache_lookup_batch(ep->cache, queries, nr_queries);
 
-        if (received < 0) {
-            if (errno == EINTR) {
-                // interrupted by signal, check if we should continue running
-                continue;
-            }
-            perror("Error receiving DNS query");
+    struct mmsghdr answers[DNS_RECV_BATCH];
+    struct iovec iov[DNS_RECV_BATCH];
+    int nr_answers = 0;
+    for (int q = 0; q < nr_queries; q++) {
+        if (queries[q].len < (int)sizeof(struct dns_header)) {
             continue;
         }
+        int i = slots[q];
+        memcpy(batch->buffers[i], &ids[q], sizeof(uint16_t));
+        batch->lens[i] = 0;
+
+        iov[nr_answers].iov_base = batch->buffers[i];
+        iov[nr_answers].iov_len = queries[q].len;
+        memset(&answers[nr_answers], 0, sizeof(struct mmsghdr));
+        answers[nr_answers].msg_hdr.msg_name = &batch->senders[i];
+        answers[nr_answers].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        answers[nr_answers].msg_hdr.msg_iov = &iov[nr_answers];
+        answers[nr_answers].msg_hdr.msg_iovlen = 1;
+        nr_answers++;
+    }
 
-        // convert client address to string for debugging
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTR_LEN);
-        printf("\nReceived %zd bytes from %s:%d\n", 
-               received, client_ip, ntohs(client_addr.sin_port));
+    // sendmmsg may stop early (e.g. on a full socket buffer); what it didn't take is sent one by one
+    int sent = nr_answers > 0 ? sendmmsg(ep->sockfd, answers, nr_answers, 0) : 0;
+    for (int a = sent < 0 ? 0 : sent; a < nr_answers; a++) {
+        dns_send_message(ep, iov[a].iov_base, iov[a].iov_len, answers[a].msg_hdr.msg_name);
+    }
+}
 
-        // ensure enough data to constitute a DNS header was recv'd
-        if (received < (ssize_t)sizeof(struct dns_header)) {
-            fprintf(stderr, "Received packet too small for DNS header\n");
+// hands the datagrams of a batch left after the replay to the endpoint's view callbacks
+static void dns_dispatch_views(struct dns_endpoint* ep, struct dns_recv_batch* batch, int count) {
+    struct dns_msg_view queries[DNS_RECV_BATCH];
+    struct sockaddr_in senders[DNS_RECV_BATCH];
+    int nr_queries = 0;
+
+    // view listeners get the datagrams as-is: one validating pass, no copies, no allocations
+    for (int i = 0; i < count; i++) {
+        if (batch->lens[i] == 0) {
+            continue;
+        }
+        int parsed = dns_view_parse(&queries[nr_queries], batch->buffers[i], batch->lens[i], NULL, 0);
+        if (parsed == DNS_VIEW_EFORMAT) {
+            // the header was read, so the client can be told instead of left to time out
+            dns_send_format_error(ep, &queries[nr_queries].header, &batch->senders[i]);
             continue;
         }
+        if (parsed != DNS_VIEW_OK) {
+            fprintf(stderr, "Dropping malformed DNS packet\n");
+            continue;
+        }
+        senders[nr_queries++] = batch->senders[i];
+    }
+    if (nr_queries == 0) {
+        return;
+    }
+
+    if (ep->view_batch_callback) {
+        ep->view_batch_callback(ep, queries, senders, nr_queries, ep->user_data);
+        return;
+    }
+    for (int q = 0; q < nr_queries; q++) {
+        ep->view_callback(ep, &queries[q], &senders[q], ep->user_data);
+    }
+}
+
+// parses one datagram into a dns_packet for listeners with a plain callback
+static void dns_dispatch_packet(struct dns_endpoint* ep, const uint8_t* buffer, size_t received,
+                                const struct sockaddr_in* sender, dns_callback_fn callback, void* user_data) {
+    struct sockaddr_in client_addr = *sender;
+    struct dns_packet received_packet;
+    char client_ip[INET_ADDRSTR_LEN];
+
+    // convert client address to string for debugging
+    if (LOG_ON(LOG_LEVEL_DEBUG)) {
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTR_LEN);
+        printf("\nReceived %zu bytes from %s:%d\n",
+               received, client_ip, ntohs(client_addr.sin_port));
+    }
 
-        // init packet structure
-        memset(&received_packet, 0, sizeof(received_packet));
+    // init packet structure
+    memset(&received_packet, 0, sizeof(received_packet));
 
-        // parse recv'd packet
-        if (dns_request_parse(&received_packet, buffer) == 0) {
+    // parse recv'd packet
+    if (dns_request_parse(&received_packet, buffer, received) == 0) {
+        // debug print the parsed packet
+        if (LOG_ON(LOG_LEVEL_DEBUG)) {
             printf("Successfully parsed DNS packet\n");
-            
-            // debug print the parsed packet
             dns_print_packet(&received_packet);
+        }
+
+        // call user callback with parsed query and client address
+        if (callback) {
+            callback(ep, &received_packet, &client_addr, user_data);
+        }
+
+        // clean up parsed packet
+        dns_packet_release(&received_packet);
+    } else {
+        fprintf(stderr, "Failed to parse DNS packet\n");
+    }
+}
+
+// start listening for packets; returns once dns_stop_listening() is called on this endpoint
+int dns_start_listening(struct dns_endpoint* ep, dns_callback_fn callback, void* user_data) {
+    if (ep->sockfd == -1) {
+        fprintf(stderr, "Socket not initialized\n");
+        return -1;
+    }
+
+    // one batch of buffers per listener, allocated once: too big for the stack of every thread
+    struct dns_recv_batch* batch = malloc(sizeof(struct dns_recv_batch));
+    if (!batch) {
+        fprintf(stderr, "Failed to allocate receive buffers\n");
+        return -1;
+    }
+    dns_recv_batch_init(batch);
+
+    LOG_INFO("DNS server listening on port %d...\n", ep->port);
 
-            // call user callback with parsed query and client address
-            if (callback) {
-                callback(&received_packet, &client_addr, user_data);
+    // wake up regularly so a stop request is noticed without a signal
+    struct timeval tv = { .tv_sec = 0, .tv_usec = DNS_LISTEN_POLL_MS * 1000 };
+    setsockopt(ep->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (!ep->ctx) {
+        ep->running = 1;  // standalone endpoint; listeners owned by a context are armed by it
+    }
+
+    while (ep->running) {
+        // receive whatever is queued, up to a batch; only waits (up to the timeout) for the first one
+        for (int i = 0; i < DNS_RECV_BATCH; i++) {
+            batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        int count = recvmmsg(ep->sockfd, batch->msgs, DNS_RECV_BATCH, MSG_WAITFORONE, NULL);
+
+        // whatever the owner wants done on this thread comes before the batch, so a batch never sees
+        // a state older than what was asked for before it arrived
+        if (ep->poll) {
+            ep->poll(ep->poll_data);
+        }
+
+        if (count < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                // interrupted or timed out, check if we should continue running
+                continue;
             }
+            perror("Error receiving DNS query");
+            continue;
+        }
 
-            // clean up parsed packet
-            if (received_packet.question.qname) {
-                free(received_packet.question.qname);
+        for (int i = 0; i < count; i++) {
+            batch->lens[i] = batch->msgs[i].msg_len;
+            // ensure enough data to constitute a DNS header was recv'd
+            if (batch->lens[i] < sizeof(struct dns_header)) {
+                fprintf(stderr, "Received packet too small for DNS header\n");
+                batch->lens[i] = 0;
             }
-            if (received_packet.header.ancount > 0 && received_packet.answer.name) {
-                free(received_packet.answer.name);
-                if (received_packet.answer.rdata) {
-                    free(received_packet.answer.rdata);
-                }
+        }
+
+        // repeated questions are answered before anything else looks at them
+        if (ep->cache) {
+            dns_replay_answers(ep, batch, count);
+        }
+
+        if (ep->view_callback || ep->view_batch_callback) {
+            dns_dispatch_views(ep, batch, count);
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (batch->lens[i] > 0) {
+                dns_dispatch_packet(ep, batch->buffers[i], batch->lens[i], &batch->senders[i], callback, user_data);
             }
-        } else {
-            fprintf(stderr, "Failed to parse DNS packet\n");
         }
     }
 
+    free(batch);
     return 0;
 }
 
 // test callback function
-void example_dns_callback(struct dns_packet* packet, struct sockaddr_in* sender, void* user_data) {
+void example_dns_callback(struct dns_endpoint* ep, struct dns_packet* packet, struct sockaddr_in* sender, void* user_data) {
     char sender_ip[INET_ADDRSTR_LEN];
     inet_ntop(AF_INET, &(sender->sin_addr), sender_ip, INET_ADDRSTR_LEN);
 
@@ -337,35 +578,421 @@ void example_dns_callback(struct dns_packet* packet, struct sockaddr_in* sender,
 }
 
 // stop listening for packets
-void dns_stop_listening(void) {
-    g_keep_running = 0;
+void dns_stop_listening(struct dns_endpoint* ep) {
+    ep->running = 0;
 }
 
-// forwarding function
-int dns_forward_query(const struct dns_packet* query_pkt, 
+/* server context */
+
+void dns_server_ctx_init(struct dns_server_ctx* ctx) {
+    memset(ctx, 0, sizeof(struct dns_server_ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+}
+
+// thread body of one listener
+static void* dns_listener_thread(void* arg) {
+    struct dns_endpoint* ep = (struct dns_endpoint*)arg;
+    if (ep->cpu >= 0) {
+        // pinned before dns_start_listening allocates the receive buffers, so they are local to the cpu
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(ep->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Failed to pin listener on port %d to cpu %d: %s\n", ep->port, ep->cpu, strerror(err));
+        }
+    }
+    dns_start_listening(ep, ep->callback, ep->user_data);
+    return NULL;
+}
+
+// bind a new listener on port and serve it from its own thread. everything the thread reads comes
+// from config and is set before it starts
+static struct dns_endpoint* dns_server_start_listener(struct dns_server_ctx* ctx,
+                                                      uint16_t port,
+                                                      int cpu,
+                                                      const struct dns_endpoint* config)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    if (ctx->nr_listeners == DNS_MAX_LISTENERS) {
+        pthread_mutex_unlock(&ctx->lock);
+        fprintf(stderr, "Too many listeners\n");
+        return NULL;
+    }
+
+    struct dns_endpoint* ep = &ctx->listeners[ctx->nr_listeners];
+    if ((cpu >= 0 ? dns_endpoint_open_reuseport(ep, port) : dns_endpoint_open(ep, port)) < 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+    ep->ctx = ctx;
+    ep->cpu = cpu;
+    ep->callback = config->callback;
+    ep->view_callback = config->view_callback;
+    ep->view_batch_callback = config->view_batch_callback;
+    ep->user_data = config->user_data;
+    ep->poll = config->poll;
+    ep->poll_data = config->poll_data;
+    // set before the thread starts so a stop that comes right away is not lost
+    ep->running = 1;
+
+    if (pthread_create(&ep->thread, NULL, dns_listener_thread, ep) != 0) {
+        perror("Failed to create listener thread");
+        dns_endpoint_close(ep);
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+
+    ctx->nr_listeners++;
+    pthread_mutex_unlock(&ctx->lock);
+    return ep;
+}
+
+struct dns_endpoint* dns_server_add_listener(struct dns_server_ctx* ctx,
+                                             uint16_t port,
+                                             dns_callback_fn callback,
+                                             void* user_data)
+{
+    struct dns_endpoint config = { .callback = callback, .user_data = user_data };
+    return dns_server_start_listener(ctx, port, -1, &config);
+}
+
+struct dns_endpoint* dns_server_add_batch_listener(struct dns_server_ctx* ctx,
+                                                   uint16_t port,
+                                                   dns_view_batch_callback_fn callback,
+                                                   void* user_data)
+{
+    struct dns_endpoint config = { .view_batch_callback = callback, .user_data = user_data };
+    return dns_server_start_listener(ctx, port, -1, &config);
+}
+
+struct dns_endpoint* dns_server_add_view_listener(struct dns_server_ctx* ctx,
+                                                  uint16_t port,
+                                                  dns_view_callback_fn callback,
+                                                  void* user_data)
+{
+    struct dns_endpoint config = { .view_callback = callback, .user_data = user_data };
+    return dns_server_start_listener(ctx, port, -1, &config);
+}
+
+struct dns_endpoint* dns_server_add_core_listener(struct dns_server_ctx* ctx,
+                                                  uint16_t port,
+                                                  int cpu,
+                                                  dns_view_batch_callback_fn callback,
+                                                  void* user_data,
+                                                  void (*poll)(void* poll_data),
+                                                  void* poll_data)
+{
+    struct dns_endpoint config = { .view_batch_callback = callback, .user_data = user_data,
+                                   .poll = poll, .poll_data = poll_data };
+    return dns_server_start_listener(ctx, port, cpu < 0 ? 0 : cpu, &config);
+}
+
+void dns_endpoint_hold(struct dns_endpoint* ep) {
+    if (ep->tcp) {
+        atomic_fetch_add(&((struct dns_tcp_conn*)ep)->refs, 1);
+    }
+}
+
+void dns_endpoint_release(struct dns_endpoint* ep) {
+    struct dns_tcp_conn* conn = (struct dns_tcp_conn*)ep;
+    if (ep->tcp && atomic_fetch_sub(&conn->refs, 1) == 1) {
+        dns_endpoint_close(ep);
+        pthread_mutex_destroy(&conn->send_lock);
+        free(conn);
+    }
+}
+
+// read exactly len bytes of a connection; -1 once the client is gone, idle for DNS_TCP_IDLE_MS or the
+// listener stops
+static int dns_tcp_read(struct dns_tcp_conn* conn, uint8_t* buffer, size_t len) {
+    size_t received = 0;
+    int idle_ms = 0;
+
+    while (received < len) {
+        if (!conn->listener->running) {
+            return -1;
+        }
+        ssize_t n = recv(conn->ep.sockfd, buffer + received, len - received, 0);
+        if (n > 0) {
+            received += n;
+            idle_ms = 0;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            // the receive timeout is DNS_LISTEN_POLL_MS, so a stop is noticed as quickly as on udp
+            idle_ms += DNS_LISTEN_POLL_MS;
+            if (idle_ms >= DNS_TCP_IDLE_MS) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// thread body of one connection: queries one after the other, until the client closes it
+static void* dns_tcp_connection_thread(void* arg) {
+    struct dns_tcp_conn* conn = (struct dns_tcp_conn*)arg;
+    struct dns_endpoint* ep = &conn->ep;
+    uint8_t message[DNS_EDNS_MAX_SIZE];
+    uint8_t prefix[2];
+
+    while (dns_tcp_read(conn, prefix, sizeof(prefix)) == 0) {
+        size_t len = (prefix[0] << 8) | prefix[1];
+        if (len < sizeof(struct dns_header) || len > sizeof(message) || dns_tcp_read(conn, message, len) < 0) {
+            break;
+        }
+        struct dns_msg_view query;
+        int parsed = dns_view_parse(&query, message, len, NULL, 0);
+        if (parsed == DNS_VIEW_EFORMAT) {
+            dns_send_format_error(ep, &query.header, &conn->client);
+            continue;
+        }
+        if (parsed != DNS_VIEW_OK) {
+            fprintf(stderr, "Dropping malformed DNS message over tcp\n");
+            break;
+        }
+        query.edns.tcp = 1;
+        ep->view_callback(ep, &query, &conn->client, ep->user_data);
+    }
+
+    // answers still owed go out through the connection's own reference, after the listener is gone
+    shutdown(ep->sockfd, SHUT_RD);
+    atomic_fetch_sub(&conn->listener->nr_connections, 1);
+    dns_endpoint_release(ep);
+    return NULL;
+}
+
+// serve a freshly accepted connection from a thread of its own; returns -1 (fd left to the caller)
+// if it can't be
+static int dns_tcp_start_connection(struct dns_endpoint* listener, int fd, const struct sockaddr_in* client) {
+    struct dns_tcp_conn* conn = calloc(1, sizeof(struct dns_tcp_conn));
+    if (!conn) {
+        return -1;
+    }
+    conn->ep.sockfd = fd;
+    conn->ep.port = listener->port;
+    conn->ep.cpu = -1;
+    conn->ep.tcp = 1;
+    conn->ep.view_callback = listener->view_callback;
+    conn->ep.user_data = listener->user_data;
+    conn->listener = listener;
+    conn->client = *client;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->send_lock, NULL);
+
+    struct timeval receive = { .tv_sec = 0, .tv_usec = DNS_LISTEN_POLL_MS * 1000 };
+    struct timeval send = { .tv_sec = DNS_TCP_SEND_MS / 1000, .tv_usec = (DNS_TCP_SEND_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receive, sizeof(receive));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send));
+
+    pthread_t thread;
+    atomic_fetch_add(&listener->nr_connections, 1);
+    if (pthread_create(&thread, NULL, dns_tcp_connection_thread, conn) != 0) {
+        atomic_fetch_sub(&listener->nr_connections, 1);
+        pthread_mutex_destroy(&conn->send_lock);
+        free(conn);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// thread body of a tcp listener. it only returns once its connections have noticed the stop, so
+// joining it is enough before the listener goes away
+static void* dns_tcp_listener_thread(void* arg) {
+    struct dns_endpoint* ep = (struct dns_endpoint*)arg;
+    struct pollfd pending = { .fd = ep->sockfd, .events = POLLIN };
+
+    LOG_INFO("DNS server listening for tcp on port %d...\n", ep->port);
+    while (ep->running) {
+        if (poll(&pending, 1, DNS_LISTEN_POLL_MS) <= 0) {
+            continue;
+        }
+        struct sockaddr_in client;
+        socklen_t len = sizeof(client);
+        int fd = accept(ep->sockfd, (struct sockaddr*)&client, &len);
+        if (fd < 0) {
+            continue;
+        }
+        if (atomic_load(&ep->nr_connections) >= DNS_TCP_MAX_CONNECTIONS ||
+            dns_tcp_start_connection(ep, fd, &client) < 0) {
+            close(fd);
+        }
+    }
+
+    while (atomic_load(&ep->nr_connections) > 0) {
+        usleep(DNS_LISTEN_POLL_MS * 100);
+    }
+    return NULL;
+}
+
+struct dns_endpoint* dns_server_add_tcp_listener(struct dns_server_ctx* ctx,
+                                                 uint16_t port,
+                                                 dns_view_callback_fn callback,
+                                                 void* user_data)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    if (ctx->nr_listeners == DNS_MAX_LISTENERS) {
+        pthread_mutex_unlock(&ctx->lock);
+        fprintf(stderr, "Too many listeners\n");
+        return NULL;
+    }
+
+    struct dns_endpoint* ep = &ctx->listeners[ctx->nr_listeners];
+    memset(ep, 0, sizeof(struct dns_endpoint));
+    ep->cpu = -1;
+    ep->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ep->sockfd < 0) {
+        perror("Failed to create tcp socket");
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+
+    int reuse = 1;
+    struct sockaddr_in bind_addr;
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bind_addr.sin_port = htons(port);
+    if (setsockopt(ep->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(ep->sockfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) < 0 ||
+        listen(ep->sockfd, DNS_TCP_MAX_CONNECTIONS) < 0) {
+        perror("Failed to bind tcp socket");
+        dns_endpoint_close(ep);
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+    socklen_t len = sizeof(bind_addr);
+    if (getsockname(ep->sockfd, (struct sockaddr*)&bind_addr, &len) == 0) {
+        ep->port = ntohs(bind_addr.sin_port);
+    }
+
+    ep->ctx = ctx;
+    ep->tcp = 1;
+    ep->view_callback = callback;
+    ep->user_data = user_data;
+    atomic_init(&ep->nr_connections, 0);
+    ep->running = 1;
+
+    if (pthread_create(&ep->thread, NULL, dns_tcp_listener_thread, ep) != 0) {
+        perror("Failed to create tcp listener thread");
+        dns_endpoint_close(ep);
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+
+    ctx->nr_listeners++;
+    pthread_mutex_unlock(&ctx->lock);
+    return ep;
+}
+
+// the reuseport group's program (classic bpf, run on the udp payload): a multiply-by-31 hash of the
+// qname's bytes up to its root label or DNS_STEER_NAME_BYTES, each ored with 0x20 so case doesn't
+// matter, modulo the number of sockets. per byte: A = the byte, X = it folded, M[0] = the hash.
+// loops aren't allowed, so it is unrolled; a jump can skip at most 255 instructions, which is what
+// limits the bytes hashed
+#define DNS_STEER_BYTE_INSNS 8
+
+int dns_server_steer_by_qname(struct dns_server_ctx* ctx) {
+    struct sock_filter code[DNS_STEER_NAME_BYTES * DNS_STEER_BYTE_INSNS + 5];
+    int n = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->nr_listeners == 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_IMM, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+    for (int i = 0; i < DNS_STEER_NAME_BYTES; i++) {
+        // on the root label, skip the rest of this byte and all the bytes after it
+        uint8_t skip = (DNS_STEER_BYTE_INSNS - 2) + (DNS_STEER_NAME_BYTES - 1 - i) * DNS_STEER_BYTE_INSNS;
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, sizeof(struct dns_header) + i);
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, skip, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 0x20);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_MEM, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 31);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_MEM, 0);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, ctx->nr_listeners);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    // set on one socket, it applies to the whole group
+    struct sock_fprog program = { .len = (unsigned short)n, .filter = code };
+    int ret = setsockopt(ctx->listeners[0].sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+    pthread_mutex_unlock(&ctx->lock);
+    if (ret < 0) {
+        perror("Failed to attach the qname steering program");
+        return -1;
+    }
+    return 0;
+}
+
+int dns_steer_qname(const uint8_t* qname, size_t len, int nr_listeners) {
+    uint32_t hash = 0;
+    for (size_t i = 0; i < len && i < DNS_STEER_NAME_BYTES && qname[i] != 0; i++) {
+        hash = hash * 31 + (qname[i] | 0x20);
+    }
+    return nr_listeners > 0 ? (int)(hash % nr_listeners) : 0;
+}
+
+void dns_endpoint_set_cache(struct dns_endpoint* ep, struct dns_pcache* cache) {
+    ep->cache = cache;
+}
+
+// stop every listener, wait for their threads and close their sockets
+void dns_server_stop(struct dns_server_ctx* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    for (int i = 0; i < ctx->nr_listeners; i++) {
+        dns_stop_listening(&ctx->listeners[i]);
+    }
+    for (int i = 0; i < ctx->nr_listeners; i++) {
+        pthread_join(ctx->listeners[i].thread, NULL);
+        dns_endpoint_close(&ctx->listeners[i]);
+    }
+    ctx->nr_listeners = 0;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void dns_server_ctx_destroy(struct dns_server_ctx* ctx) {
+    dns_server_stop(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+// forwarding function; ep is the local end the query is sent from and the answer awaited on
+int dns_forward_query(struct dns_endpoint* ep,
+                     const struct dns_packet* query_pkt, 
                      const char* forward_ip, 
                      uint16_t forward_port,
                      dns_callback_fn callback,
                      void* user_data)
 {
-    if (g_sockfd == -1) {
+    if (ep->sockfd == -1) {
         fprintf(stderr, "Socket not initialized\n");
         return -1;
     }
 
     // forward query to other dns server
-    int result = dns_send_packet(query_pkt, forward_ip, forward_port);
+    int result = dns_send_packet(ep, query_pkt, forward_ip, forward_port);
     if (result < 0) {
         fprintf(stderr, "Failed to send forwarded query\n");
         return -1;
     }
 
     // wait for response
-    return dns_wait_response(query_pkt->header.id, 5, callback, user_data, 0);
+    return dns_wait_response(ep, query_pkt->header.id, 5, callback, user_data, 0);
 }
 
-// wait for a dns response (and do something with the response through callback)
-int dns_wait_response(uint16_t query_id, 
+// wait for a dns response on ep (and do something with the response through callback)
+int dns_wait_response(struct dns_endpoint* ep,
+                     uint16_t query_id, 
                      int timeout_sec,
                      void* callback,
                      void* user_data,
@@ -373,7 +1000,7 @@ int dns_wait_response(uint16_t query_id,
 {
     struct timeval tv;
     fd_set readfds;
-    uint8_t buffer[512];
+    uint8_t buffer[DNS_EDNS_MAX_SIZE];
     struct sockaddr_in sender_addr;
     socklen_t sender_len = sizeof(sender_addr);
     struct dns_packet response_pkt;
@@ -387,10 +1014,10 @@ int dns_wait_response(uint16_t query_id,
 
         // clear fd set and add socket
         FD_ZERO(&readfds);
-        FD_SET(g_sockfd, &readfds);
+        FD_SET(ep->sockfd, &readfds);
 
         // wait for response
-        int ready = select(g_sockfd + 1, &readfds, NULL, NULL, &tv);
+        int ready = select(ep->sockfd + 1, &readfds, NULL, NULL, &tv);
         
         if (ready < 0) {
             if (errno == EINTR) continue;
@@ -403,8 +1030,8 @@ int dns_wait_response(uint16_t query_id,
         }
 
         // recv response
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t received = recvfrom(g_sockfd, buffer, sizeof(buffer), 0,
+        sender_len = sizeof(sender_addr);
+        ssize_t received = recvfrom(ep->sockfd, buffer, sizeof(buffer), 0,
                                   (struct sockaddr*)&sender_addr, &sender_len);
         
         if (received < 0) {
@@ -414,11 +1041,14 @@ int dns_wait_response(uint16_t query_id,
         }
 
         // parse response
-        if (dns_request_parse(&response_pkt, buffer) == 0) {
+        memset(&response_pkt, 0, sizeof(response_pkt));
+        if (dns_request_parse(&response_pkt, buffer, received) == 0) {
             // sender address to string for debugging
-            inet_ntop(AF_INET, &sender_addr.sin_addr, sender_ip, INET_ADDRSTR_LEN);
-            printf("Received response from %s:%d\n", 
-                   sender_ip, ntohs(sender_addr.sin_port));
+            if (LOG_ON(LOG_LEVEL_DEBUG)) {
+                inet_ntop(AF_INET, &sender_addr.sin_addr, sender_ip, INET_ADDRSTR_LEN);
+                printf("Received response from %s:%d\n",
+                       sender_ip, ntohs(sender_addr.sin_port));
+            }
 
             // check if this is the response we wanted
             if (response_pkt.header.id == query_id && response_pkt.header.qr == QR_RESPONSE) {
@@ -426,7 +1056,7 @@ int dns_wait_response(uint16_t query_id,
                 if (callback) {
                     if (callback_type == 0) {  // dns_callback_fn
                     dns_callback_fn server_cb = (dns_callback_fn)callback;
-                    server_cb(&response_pkt, &sender_addr, user_data);
+                    server_cb(ep, &response_pkt, &sender_addr, user_data);
                     } else {  // dns_response_callback_fn
                         dns_response_callback_fn resp_cb = (dns_response_callback_fn)callback;
                         resp_cb(&response_pkt, user_data);
@@ -435,28 +1065,12 @@ int dns_wait_response(uint16_t query_id,
                 // // // // // //
 
                 // clean up
-                if (response_pkt.question.qname) {
-                    free(response_pkt.question.qname);
-                }
-                if (response_pkt.header.ancount > 0 && response_pkt.answer.name) {
-                    free(response_pkt.answer.name);
-                    if (response_pkt.answer.rdata) {
-                        free(response_pkt.answer.rdata);
-                    }
-                }
+                dns_packet_release(&response_pkt);
                 return 0;
             }
 
             // if not response we wanted, clean up
-            if (response_pkt.question.qname) {
-                free(response_pkt.question.qname);
-            }
-            if (response_pkt.header.ancount > 0 && response_pkt.answer.name) {
-                free(response_pkt.answer.name);
-                if (response_pkt.answer.rdata) {
-                    free(response_pkt.answer.rdata);
-                }
-            }
+            dns_packet_release(&response_pkt);
         }
     }
 
@@ -464,21 +1078,28 @@ int dns_wait_response(uint16_t query_id,
 }
 
 // example of callback function for forwarding
-void example_dns_forward_callback(struct dns_packet* packet, 
-                                  struct sockaddr_in* client_addr, 
+// user_data is a malloc'd dns_forward_origin: the listener and client the query came from.
+// the reply is re-encoded from the parsed packet; dns_relay.h relays the upstream bytes instead
+void example_dns_forward_callback(struct dns_endpoint* ep,
+                                  struct dns_packet* packet, 
+                                  struct sockaddr_in* upstream_addr, 
                                   void* user_data)
 {
-    printf("Processing forwarded DNS response:\n");
-    dns_print_packet(packet);
-    
+    if (LOG_ON(LOG_LEVEL_DEBUG)) {
+        printf("Processing forwarded DNS response:\n");
+        dns_print_packet(packet);
+    }
+
     // forward response back to original client
-    if (user_data) {  // user_data client address
-        struct sockaddr_in* original_client = (struct sockaddr_in*)user_data;
-        printf("Forwarding response back to original client %s:%d\n",
-               inet_ntoa(original_client->sin_addr),
-               ntohs(original_client->sin_port));
+    if (user_data) {
+        struct dns_forward_origin* origin = (struct dns_forward_origin*)user_data;
+        LOG_DEBUG("Forwarding response back to original client %s:%d\n",
+               inet_ntoa(origin->client.sin_addr),
+               ntohs(origin->client.sin_port));
         
-        int ret = dns_send_answer(packet, original_client);
+        // answer from the listener the client talked to, not from the forwarding socket
+        packet->header.id = origin->client_id;
+        int ret = dns_send_answer(origin->listener, packet, &origin->client);
         if (ret < 0) {
             perror("Failed to send response to original client");
         }
@@ -494,53 +1115,27 @@ int dns_query_domain(const char* domain_name,
                     dns_response_callback_fn callback,
                     void* user_data)
 {
-    // create UDP socket specifically for this query
-    // this is necessary since the server in mainDNS uses TCP
-    int query_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (query_socket < 0) {
-        perror("Failed to create query socket");
-        return -1;
-    }
-
-    // bind to any available local port
-    struct sockaddr_in local_addr;
-    memset(&local_addr, 0, sizeof(local_addr));
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_addr.s_addr = INADDR_ANY;
-    local_addr.sin_port = htons(0);  // os will choose an available port
-
-    if (bind(query_socket, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-        perror("Failed to bind query socket");
-        close(query_socket);
-        return -1;
-    }
-
-    // get port number that was assigned
-    socklen_t len = sizeof(local_addr);
-    if (getsockname(query_socket, (struct sockaddr*)&local_addr, &len) < 0) {
-        perror("Failed to get socket name");
-        close(query_socket);
+    // each call gets its own udp endpoint on an os-chosen port,
+    // so any number of these can run next to each other and next to the listeners
+    struct dns_endpoint query_ep;
+    if (dns_endpoint_open(&query_ep, 0) < 0) {
         return -1;
     }
 
-    printf("Query socket bound to port %d\n", ntohs(local_addr.sin_port));
-
-    // temp. store this socket in my global socket desc. so rewriting functions isnt necessary
-    g_sockfd = query_socket;
+    LOG_DEBUG("Query socket bound to port %d\n", query_ep.port);
 
     // create dns packet for query
     struct dns_packet* query_pkt = dns_create_query_packet(domain_name);
     if (!query_pkt) {
-        close(query_socket);
-        g_sockfd = -1;
+        dns_endpoint_close(&query_ep);
         return -1;
     }
     
-    printf("Sending DNS query for %s to %s:%d\n", 
+    LOG_DEBUG("Sending DNS query for %s to %s:%d\n", 
            domain_name, dns_server, dns_port);
     
     // send query
-    int send_result = dns_send_packet(query_pkt, dns_server, dns_port);
+    int send_result = dns_send_packet(&query_ep, query_pkt, dns_server, dns_port);
 
     // store id and clean up query packet
     uint16_t query_id = query_pkt->header.id;
@@ -549,18 +1144,16 @@ int dns_query_domain(const char* domain_name,
     // if sending failed...
     if (send_result < 0) {
         fprintf(stderr, "Failed to send DNS query\n");
-        close(query_socket);
-        g_sockfd = -1;
+        dns_endpoint_close(&query_ep);
         return -1;
     }
     
     // wait for response with 5 second timeout
     // this is where the dns response goes, and where the callback function acts
-    int result = dns_wait_response(query_id, 5, (dns_callback_fn)callback, user_data, 1);
+    int result = dns_wait_response(&query_ep, query_id, 5, (void*)callback, user_data, 1);
 
     // clean up
-    close(query_socket);
-    g_sockfd = -1;
+    dns_endpoint_close(&query_ep);
 
     return result;
 }
@@ -569,27 +1162,32 @@ int dns_query_domain(const char* domain_name,
 void handle_dns_response(struct dns_packet* response, void* user_data) {
     char* ip_storage = (char*)user_data;
     
-    printf("DNS Response received:\n");
-    printf("Answer count: %d\n", response->header.ancount);
-    if (response->header.ancount > 0) {
-        printf("Answer type: %d (A record = %d)\n", response->answer.type, DNS_TYPE_A);
+    LOG_DEBUG("DNS Response received:\n");
+    LOG_DEBUG("Answer count: %d\n", response->nr_answers);
+
+    // the A record may come after a CNAME chain, so take the first one in the section
+    const struct dns_answer* answer = NULL;
+    for (int i = 0; i < response->nr_answers && !answer; i++) {
+        if (response->answers[i].type == DNS_TYPE_A && response->answers[i].rdlength == 4) {
+            answer = &response->answers[i];
+        }
     }
-    
-    if (response->header.ancount > 0 && response->answer.type == DNS_TYPE_A) {
+
+    if (answer) {
         struct in_addr addr;
-        memcpy(&addr.s_addr, response->answer.rdata, 4);
+        memcpy(&addr.s_addr, answer->rdata, 4);
         
         // try storing in temp buffer
         char temp_ip[INET_ADDRSTR_LEN];
         inet_ntop(AF_INET, &addr.s_addr, temp_ip, INET_ADDRSTR_LEN);
-        printf("Converted IP: %s\n", temp_ip);
+        LOG_DEBUG("Converted IP: %s\n", temp_ip);
         
         // if ok, copy to provided storage
         strncpy(ip_storage, temp_ip, INET_ADDRSTR_LEN - 1);
         ip_storage[INET_ADDRSTR_LEN - 1] = '\0';  // ensure null termination
         
-        printf("Stored IP in buffer: %s\n", ip_storage);
+        LOG_DEBUG("Stored IP in buffer: %s\n", ip_storage);
     } else {
-        printf("No valid A record found in response\n");
+        LOG_DEBUG("No valid A record found in response\n");
     }
 }
\ No newline at end of file
@@ -2,17 +2,34 @@
 #define __DNS_SERVER_H__
 
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include "dns_packet.h"
+#include "dns_view.h"
+#include "dns_pcache.h"
 
 /* ipv4 address max length */
 #define INET_ADDRSTR_LEN 16
 
+#define DNS_MAX_LISTENERS 64     /* listeners per server context; one per cpu in thread-per-core mode */
+#define DNS_LISTEN_POLL_MS 500    /* how often a listener checks whether it should stop */
+#define DNS_RECV_BATCH 32         /* datagrams a listener takes per recvmmsg */
+#define DNS_STEER_NAME_BYTES 32   /* qname bytes the steering program hashes (see dns_server_steer_by_qname) */
+#define DNS_TCP_MAX_CONNECTIONS 64 /* open connections per tcp listener; more are closed right away */
+#define DNS_TCP_IDLE_MS 10000     /* a tcp client that sends nothing for this long is disconnected */
+#define DNS_TCP_SEND_MS 2000      /* a tcp client that takes no answer for this long is disconnected */
+
+struct dns_endpoint;
+
 /* callback function type for packet processing */
 // a callback function is any function that receives the packet from the network and processes it.
 // since the program already parses the packet before this function is called, all that's left is to 
 // call a function that would, for example, take the query data and search it in the dns tree to create a response.
+// ep is the socket the packet arrived on, so an answer can be sent back through it.
 
-typedef void (*dns_callback_fn) (struct dns_packet *packet, 
+typedef void (*dns_callback_fn) (struct dns_endpoint *ep,
+                                struct dns_packet *packet, 
                                 struct sockaddr_in *sender, 
                                 void *user_data);
 
@@ -20,52 +37,200 @@ typedef void (*dns_callback_fn) (struct dns_packet *packet,
 typedef void (*dns_response_callback_fn) (struct dns_packet* response, 
                                          void* user_data);
 
+// same, for listeners that work on the raw datagram: query is a non-owning view into the receive buffer
+// (see dns_view.h), valid only during the call. nothing is allocated per packet on this path.
+typedef void (*dns_view_callback_fn) (struct dns_endpoint *ep,
+                                     const struct dns_msg_view *query,
+                                     const struct sockaddr_in *sender,
+                                     void *user_data);
+
+// same, for a whole receive batch at once (up to DNS_RECV_BATCH queries, senders[i] sent queries[i]),
+// so the lookups behind it can be batched too
+typedef void (*dns_view_batch_callback_fn) (struct dns_endpoint *ep,
+                                           const struct dns_msg_view *queries,
+                                           const struct sockaddr_in *senders,
+                                           int nr_queries,
+                                           void *user_data);
+
+/* a bound udp socket: either a listener or the local end of a forward */
+// nothing in dns_server.c keeps global socket state; every function works on the endpoint it is given,
+// so several listeners and any number of forwards can run at the same time.
+// a tcp listener is an endpoint too, and so is each connection it accepts: the view callback gets the
+// connection as ep, and the send functions below write to it with the length prefix instead of sendto.
+// that is where clients go when a udp answer came with TC set (see dns_encode_answer).
+struct dns_endpoint {
+    int sockfd;
+    uint16_t port;                   /* bound port (host order) */
+    volatile sig_atomic_t running;   /* listen loop control */
+    dns_callback_fn callback;        /* set for listeners owned by a context */
+    dns_view_callback_fn view_callback; /* used instead of callback when set */
+    dns_view_batch_callback_fn view_batch_callback; /* used instead of both when set */
+    struct dns_pcache *cache;        /* optional; queries seen before are answered from it unparsed */
+    void *user_data;
+    pthread_t thread;
+    int cpu;                         /* the listener thread runs on this cpu only, -1 = anywhere */
+    void (*poll)(void *poll_data);   /* optional, run by the listener after every batch and timeout */
+    void *poll_data;
+    struct dns_server_ctx *ctx;      /* owning context, NULL for standalone endpoints */
+    int tcp;                         /* a tcp listener or one of its connections */
+    atomic_int nr_connections;       /* a tcp listener's connections still being read */
+};
+
+/* all listeners of one server instance */
+struct dns_server_ctx {
+    struct dns_endpoint listeners[DNS_MAX_LISTENERS];
+    int nr_listeners;
+    pthread_mutex_t lock;
+};
+
+/* where a forwarded query came from, so the answer can be sent back (see example_dns_forward_callback) */
+struct dns_forward_origin {
+    struct dns_endpoint *listener;
+    struct sockaddr_in client;
+    uint16_t client_id;
+};
+
 /* * * * * * * */
 
-/* server functions */
-/* server socket init */
-int dns_init_socket(uint16_t port);
+/* endpoint functions */
+/* open a udp socket bound to port (0 = any free port) */
+int dns_endpoint_open(struct dns_endpoint *ep, uint16_t port);
+
+/* same, with SO_REUSEPORT: every socket opened this way on port gets a share of its datagrams */
+int dns_endpoint_open_reuseport(struct dns_endpoint *ep, uint16_t port);
 
-/* server cleanup */
-void dns_cleanup_socket(void);
+/* endpoint cleanup */
+void dns_endpoint_close(struct dns_endpoint *ep);
 
 /* send dns packet to X address */
-int dns_send_packet(const struct dns_packet *pkt, 
+int dns_send_packet(const struct dns_endpoint *ep,
+                    const struct dns_packet *pkt, 
                     const char *server_ip, 
                     uint16_t port);
 
-/* send dns answer to same socket query was recv'd from */
-int dns_send_answer(const struct dns_packet* answer_pkt, 
+/* send dns answer from the endpoint the query was recv'd on */
+int dns_send_answer(const struct dns_endpoint *ep,
+                    const struct dns_packet* answer_pkt, 
                     const struct sockaddr_in* client_addr);
 
-/* start listening */
-int dns_start_listening(dns_callback_fn callback, void *user_data);
+/* encode the answer dns_send_answer would send into buffer; returns its length or -1 */
+int dns_encode_answer(const struct dns_packet *answer_pkt, uint8_t *buffer, size_t size);
+
+/* send a message that is already in wire format as it is */
+int dns_send_message(const struct dns_endpoint *ep,
+                     const uint8_t *data,
+                     size_t len,
+                     const struct sockaddr_in *client_addr);
+
+/* send a message that is already in wire format, with its header replaced by header (host order).
+   the rest goes out straight from data, without being copied */
+int dns_send_raw(const struct dns_endpoint *ep,
+                 const struct dns_header *header,
+                 const uint8_t *data,
+                 size_t len,
+                 const struct sockaddr_in *client_addr);
+
+/* answer a query that can't be served as asked (no question, several questions) with FORMERR: its
+   header sent back as a response, with no question and no records */
+int dns_send_format_error(const struct dns_endpoint *ep,
+                          const struct dns_header *query,
+                          const struct sockaddr_in *client_addr);
+
+/* start listening (blocks until dns_stop_listening) */
+int dns_start_listening(struct dns_endpoint *ep, dns_callback_fn callback, void *user_data);
 
 /* stop listening */
-void dns_stop_listening(void);
+void dns_stop_listening(struct dns_endpoint *ep);
+
+/* server context functions */
+void dns_server_ctx_init(struct dns_server_ctx *ctx);
+
+/* bind a listener on port and serve it from its own thread */
+struct dns_endpoint* dns_server_add_listener(struct dns_server_ctx *ctx,
+                                             uint16_t port,
+                                             dns_callback_fn callback,
+                                             void *user_data);
+
+/* same, but packets are handed over as views instead of parsed dns_packets */
+struct dns_endpoint* dns_server_add_view_listener(struct dns_server_ctx *ctx,
+                                                  uint16_t port,
+                                                  dns_view_callback_fn callback,
+                                                  void *user_data);
+
+/* same, but every receive batch is handed over at once */
+struct dns_endpoint* dns_server_add_batch_listener(struct dns_server_ctx *ctx,
+                                                   uint16_t port,
+                                                   dns_view_batch_callback_fn callback,
+                                                   void *user_data);
+
+/* a batch listener for thread-per-core serving: its own SO_REUSEPORT socket on port, served by a
+   thread pinned to cpu. poll(poll_data), if given, runs between batches on that thread */
+struct dns_endpoint* dns_server_add_core_listener(struct dns_server_ctx *ctx,
+                                                  uint16_t port,
+                                                  int cpu,
+                                                  dns_view_batch_callback_fn callback,
+                                                  void *user_data,
+                                                  void (*poll)(void *poll_data),
+                                                  void *poll_data);
+
+/* a tcp listener on port: every connection gets a thread of its own (up to DNS_TCP_MAX_CONNECTIONS)
+   that reads length-prefixed queries and hands them to callback one by one, with edns.tcp set, so
+   the answers may use the whole 64k. answers may be sent after the callback returned, from any
+   thread, as long as the endpoint is held for them (dns_endpoint_hold) */
+struct dns_endpoint* dns_server_add_tcp_listener(struct dns_server_ctx *ctx,
+                                                 uint16_t port,
+                                                 dns_view_callback_fn callback,
+                                                 void *user_data);
+
+/* keep the endpoint a callback got usable after the callback returns, until the matching release.
+   only tcp connections need it (they are freed once their client is gone and nothing holds them);
+   for any other endpoint both do nothing */
+void dns_endpoint_hold(struct dns_endpoint *ep);
+void dns_endpoint_release(struct dns_endpoint *ep);
+
+/* hand each query to the context's listener i = dns_steer_qname() of its qname, instead of the
+   kernel's choice by address and port. all listeners have to be core listeners on one port,
+   added in order, none closed. datagrams without a full qname go to listener 0 */
+int dns_server_steer_by_qname(struct dns_server_ctx *ctx);
+
+/* the listener a qname (wire form, any case) is steered to, out of nr_listeners: a hash of its first
+   DNS_STEER_NAME_BYTES bytes, computed exactly like the kernel-side program does */
+int dns_steer_qname(const uint8_t *qname, size_t len, int nr_listeners);
+
+/* answer repeated queries on ep from cache (see dns_pcache.h); the responders behind it fill it */
+void dns_endpoint_set_cache(struct dns_endpoint *ep, struct dns_pcache *cache);
+
+/* stop and join every listener */
+void dns_server_stop(struct dns_server_ctx *ctx);
+
+void dns_server_ctx_destroy(struct dns_server_ctx *ctx);
 
 /* test callback function */
-void example_dns_callback(struct dns_packet *packet, 
+void example_dns_callback(struct dns_endpoint *ep,
+                         struct dns_packet *packet, 
                          struct sockaddr_in *sender, 
                          void *user_data);
 
 /* forwarding function */
-int dns_forward_query(const struct dns_packet* query_pkt, 
+int dns_forward_query(struct dns_endpoint *ep,
+                     const struct dns_packet* query_pkt, 
                      const char* forward_ip, 
                      uint16_t forward_port,
                      dns_callback_fn callback,
                      void* user_data);
 
 /* waiting for response after forwarding */
-int dns_wait_response(uint16_t query_id, 
+int dns_wait_response(struct dns_endpoint *ep,
+                     uint16_t query_id, 
                      int timeout_sec,
                      void* callback,
                      void* user_data,
                      int callback_type);
 
 /* example callback for forwarding */
-void example_dns_forward_callback(struct dns_packet* packet, 
-                                  struct sockaddr_in* client_addr, 
+void example_dns_forward_callback(struct dns_endpoint *ep,
+                                  struct dns_packet* packet, 
+                                  struct sockaddr_in* upstream_addr, 
                                   void* user_data);
 
 /* made for integration with rest of project */
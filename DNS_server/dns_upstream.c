@@ -0,0 +1,226 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dns_upstream.h"
+
+/* pool setup */
+
+void dns_upstream_pool_init(struct dns_upstream_pool* pool) {
+    memset(pool, 0, sizeof(struct dns_upstream_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+int dns_upstream_pool_add(struct dns_upstream_pool* pool, const char* ip, uint16_t port) {
+    if (pool->nr_upstreams == DNS_UPSTREAM_MAX) {
+        fprintf(stderr, "Too many upstream servers, ignoring %s\n", ip);
+        return -1;
+    }
+
+    struct dns_upstream* up = &pool->upstreams[pool->nr_upstreams];
+    memset(up, 0, sizeof(struct dns_upstream));
+    up->addr.sin_family = AF_INET;
+    up->addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &up->addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid upstream address: %s\n", ip);
+        return -1;
+    }
+
+    pool->nr_upstreams++;
+    return 0;
+}
+
+int dns_upstream_pool_load(struct dns_upstream_pool* pool, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    char line[128];
+    int added = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // strip comments
+        line[strcspn(line, "#\n")] = '\0';
+
+        char ip[INET_ADDRSTRLEN];
+        int port = DNS_UPSTREAM_DEFAULT_PORT;
+        int fields = sscanf(line, "%15s %d", ip, &port);
+        if (fields < 1) {
+            continue;
+        }
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Invalid upstream port in %s: %d\n", path, port);
+            continue;
+        }
+        if (dns_upstream_pool_add(pool, ip, (uint16_t)port) == 0) {
+            added++;
+        }
+    }
+
+    fclose(file);
+    return added;
+}
+
+void dns_upstream_pool_destroy(struct dns_upstream_pool* pool) {
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* selection */
+
+// a server is usable while it answers, or once its hold-down expired (so it can recover)
+static int upstream_usable(const struct dns_upstream* up, uint64_t now_ms) {
+    return up->fail_rate <= DNS_FAIL_THRESHOLD || now_ms >= up->retry_at_ms;
+}
+
+int dns_upstream_select(struct dns_upstream_pool* pool, uint32_t exclude_mask, uint64_t now_ms) {
+    int best = -1;
+    int fallback = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->nr_upstreams; i++) {
+        const struct dns_upstream* up = &pool->upstreams[i];
+        if (exclude_mask & (1u << i)) {
+            continue;
+        }
+
+        // least bad server, in case none is healthy
+        if (fallback == -1 || up->fail_rate < pool->upstreams[fallback].fail_rate) {
+            fallback = i;
+        }
+
+        if (!upstream_usable(up, now_ms)) {
+            continue;
+        }
+        // unmeasured servers have srtt 0, so they are tried (measured) first
+        if (best == -1 || up->srtt_ms < pool->upstreams[best].srtt_ms) {
+            best = i;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return best != -1 ? best : fallback;
+}
+
+int dns_upstream_rto(struct dns_upstream_pool* pool, int index) {
+    pthread_mutex_lock(&pool->lock);
+    const struct dns_upstream* up = &pool->upstreams[index];
+    int rto = DNS_RTO_INITIAL_MS;
+    if (up->nr_samples > 0) {
+        rto = (int)(up->srtt_ms + 4 * up->rttvar_ms);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (rto < DNS_RTO_MIN_MS) rto = DNS_RTO_MIN_MS;
+    if (rto > DNS_RTO_MAX_MS) rto = DNS_RTO_MAX_MS;
+    return rto;
+}
+
+int dns_upstream_hedge_delay(struct dns_upstream_pool* pool, int index) {
+    pthread_mutex_lock(&pool->lock);
+    const struct dns_upstream* up = &pool->upstreams[index];
+    int delay = 0;
+    if (pool->nr_upstreams > 1) {
+        // a p95 over a handful of samples is noise
+        delay = up->nr_samples >= 8 ? (int)up->p95_ms : DNS_HEDGE_DEFAULT_MS;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (delay > 0 && delay < DNS_RTO_MIN_MS / 5) {
+        delay = DNS_RTO_MIN_MS / 5;
+    }
+    return delay;
+}
+
+/* feedback */
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// p95 of the sample window; caller holds the lock
+static void upstream_update_p95(struct dns_upstream* up) {
+    uint32_t sorted[DNS_RTT_SAMPLES];
+    memcpy(sorted, up->samples, up->nr_samples * sizeof(uint32_t));
+    qsort(sorted, up->nr_samples, sizeof(uint32_t), compare_u32);
+    up->p95_ms = sorted[(up->nr_samples * 95) / 100];
+}
+
+void dns_upstream_report_success(struct dns_upstream_pool* pool, int index, uint32_t rtt_ms) {
+    pthread_mutex_lock(&pool->lock);
+    struct dns_upstream* up = &pool->upstreams[index];
+
+    // rfc 6298: alpha = 1/8, beta = 1/4
+    if (up->nr_samples == 0) {
+        up->srtt_ms = rtt_ms;
+        up->rttvar_ms = rtt_ms / 2.0;
+    } else {
+        double delta = up->srtt_ms - rtt_ms;
+        if (delta < 0) delta = -delta;
+        up->rttvar_ms = 0.75 * up->rttvar_ms + 0.25 * delta;
+        up->srtt_ms = 0.875 * up->srtt_ms + 0.125 * rtt_ms;
+    }
+
+    up->samples[up->sample_pos] = rtt_ms;
+    up->sample_pos = (up->sample_pos + 1) % DNS_RTT_SAMPLES;
+    if (up->nr_samples < DNS_RTT_SAMPLES) {
+        up->nr_samples++;
+    }
+    // sorting 64 values on every answer is wasteful; the estimate moves slowly anyway
+    if (up->nr_samples < DNS_RTT_SAMPLES || up->sample_pos % 8 == 0) {
+        upstream_update_p95(up);
+    }
+
+    up->fail_rate *= 0.8;
+    up->queries++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void dns_upstream_report_failure(struct dns_upstream_pool* pool, int index, uint64_t now_ms) {
+    pthread_mutex_lock(&pool->lock);
+    struct dns_upstream* up = &pool->upstreams[index];
+
+    up->fail_rate = 0.8 * up->fail_rate + 0.2;
+    up->queries++;
+    up->failures++;
+    if (up->fail_rate > DNS_FAIL_THRESHOLD) {
+        up->retry_at_ms = now_ms + DNS_HOLDDOWN_MS;
+    }
+    // back off the timeout too, so a slow server is not hammered with retransmits
+    if (up->nr_samples > 0) {
+        up->rttvar_ms *= 2;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void dns_upstream_report_slow(struct dns_upstream_pool* pool, int index, uint32_t elapsed_ms) {
+    pthread_mutex_lock(&pool->lock);
+    struct dns_upstream* up = &pool->upstreams[index];
+
+    // only a lower bound, so it may raise srtt but never lowers it, and stays out of the p95 window
+    if (up->srtt_ms == 0) {
+        up->srtt_ms = elapsed_ms;
+    } else if (up->srtt_ms < elapsed_ms) {
+        up->srtt_ms = 0.875 * up->srtt_ms + 0.125 * elapsed_ms;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* debug */
+
+void dns_upstream_print(struct dns_upstream_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    printf("Upstreams:\n");
+    printf("----------\n");
+    for (int i = 0; i < pool->nr_upstreams; i++) {
+        const struct dns_upstream* up = &pool->upstreams[i];
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &up->addr.sin_addr, ip, sizeof(ip));
+        printf("%s:%d srtt=%.1fms rttvar=%.1fms p95=%ums fail=%.2f (%lu/%lu)\n",
+               ip, ntohs(up->addr.sin_port), up->srtt_ms, up->rttvar_ms, up->p95_ms,
+               up->fail_rate, up->failures, up->queries);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
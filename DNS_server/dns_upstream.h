@@ -0,0 +1,69 @@
+#ifndef __DNS_UPSTREAM_H__
+#define __DNS_UPSTREAM_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* upstream server pool */
+// every upstream keeps a smoothed rtt (rfc 6298 style), a failure rate and a small window of
+// recent rtt samples. the forwarder asks the pool which server to use, how long to wait before
+// giving up on it (rto) and when to send a hedged duplicate to a second server (p95 latency).
+
+#define DNS_UPSTREAM_MAX 8
+#define DNS_UPSTREAM_CONF "upstreams.conf"   /* one "ip [port]" per line */
+#define DNS_UPSTREAM_DEFAULT_IP "1.1.1.1"
+#define DNS_UPSTREAM_DEFAULT_PORT 53
+
+#define DNS_RTT_SAMPLES 64           /* window used for the p95 estimate */
+#define DNS_RTO_INITIAL_MS 1000      /* before the first rtt sample */
+#define DNS_RTO_MIN_MS 50
+#define DNS_RTO_MAX_MS 5000
+#define DNS_HEDGE_DEFAULT_MS 250     /* hedge delay until a server has enough samples for a p95 */
+#define DNS_FAIL_THRESHOLD 0.5       /* failure rate above which a server is unhealthy */
+#define DNS_HOLDDOWN_MS 10000        /* unhealthy servers get a probe after this long */
+
+struct dns_upstream {
+    struct sockaddr_in addr;
+    double srtt_ms;                  /* smoothed rtt, 0 until the first sample */
+    double rttvar_ms;                /* rtt variation */
+    double fail_rate;                /* ewma of timeouts (0 = always answers) */
+    uint64_t retry_at_ms;            /* when an unhealthy server may be probed again */
+    uint32_t samples[DNS_RTT_SAMPLES];
+    int nr_samples;
+    int sample_pos;
+    uint32_t p95_ms;                 /* cached, refreshed as samples arrive */
+    unsigned long queries;
+    unsigned long failures;
+};
+
+struct dns_upstream_pool {
+    struct dns_upstream upstreams[DNS_UPSTREAM_MAX];
+    int nr_upstreams;
+    pthread_mutex_t lock;
+};
+
+/* setup */
+void dns_upstream_pool_init(struct dns_upstream_pool *pool);
+int dns_upstream_pool_add(struct dns_upstream_pool *pool, const char *ip, uint16_t port);
+/* read upstreams from a config file; returns how many were added, -1 if the file can't be read */
+int dns_upstream_pool_load(struct dns_upstream_pool *pool, const char *path);
+void dns_upstream_pool_destroy(struct dns_upstream_pool *pool);
+
+/* selection: fastest healthy upstream whose bit is not set in exclude_mask, -1 if the pool is empty */
+int dns_upstream_select(struct dns_upstream_pool *pool, uint32_t exclude_mask, uint64_t now_ms);
+/* retransmit timeout for one upstream: srtt + 4 * rttvar, clamped */
+int dns_upstream_rto(struct dns_upstream_pool *pool, int index);
+/* delay after which a hedged duplicate should go out (p95 latency), 0 = don't hedge yet */
+int dns_upstream_hedge_delay(struct dns_upstream_pool *pool, int index);
+
+/* feedback from the forwarder */
+void dns_upstream_report_success(struct dns_upstream_pool *pool, int index, uint32_t rtt_ms);
+void dns_upstream_report_failure(struct dns_upstream_pool *pool, int index, uint64_t now_ms);
+/* a copy lost the race against a hedge after elapsed_ms; its rtt is at least that */
+void dns_upstream_report_slow(struct dns_upstream_pool *pool, int index, uint32_t elapsed_ms);
+
+/* debug */
+void dns_upstream_print(struct dns_upstream_pool *pool);
+
+#endif
@@ -0,0 +1,278 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "dns_view.h"
+
+static inline uint16_t view_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t view_u32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// walks one name starting at offset and fills name. labels (optional) receives the offset of every
+// label's length byte. compression pointers have to point before the start of the label run they
+// interrupt, which makes every hop strictly backwards and the walk guaranteed to end.
+static int view_walk_name(const uint8_t* data, size_t len, size_t offset,
+                          struct dns_name_view* name, uint16_t* labels) {
+    size_t pos = offset;
+    size_t run_start = offset;   // first byte of the label run being walked
+    int hops = 0;
+
+    name->offset = (uint16_t)offset;
+    name->wire_len = 0;
+    name->name_len = 0;
+    name->nr_labels = 0;
+    name->compressed = 0;
+
+    while (1) {
+        if (pos >= len) {
+            return DNS_VIEW_ESHORT;
+        }
+        uint8_t label_length = data[pos];
+
+        if (label_length == 0) {
+            name->name_len += 1;
+            if (!name->compressed) {
+                name->wire_len = (uint16_t)(pos + 1 - offset);
+            }
+            return DNS_VIEW_OK;
+        }
+
+        if ((label_length & 0xC0) == 0xC0) {
+            if (pos + 1 >= len) {
+                return DNS_VIEW_ESHORT;
+            }
+            size_t target = ((label_length & 0x3F) << 8) | data[pos + 1];
+            if (target >= run_start || ++hops > DNS_MAX_POINTERS) {
+                return DNS_VIEW_ENAME;
+            }
+            if (!name->compressed) {
+                name->wire_len = (uint16_t)(pos + 2 - offset);
+                name->compressed = 1;
+            }
+            pos = target;
+            run_start = target;
+            continue;
+        }
+
+        if (label_length > DNS_MAX_LABEL) {
+            return DNS_VIEW_ENAME;   // 0x40 / 0x80 label types are not in use
+        }
+        if (pos + 1 + label_length > len) {
+            return DNS_VIEW_ESHORT;
+        }
+        // + 1 leaves room for the root byte
+        if (name->name_len + label_length + 1 + 1 > DNS_MAX_NAME_WIRE) {
+            return DNS_VIEW_ENAME;
+        }
+
+        if (labels) {
+            labels[name->nr_labels] = (uint16_t)pos;
+        }
+        name->nr_labels++;
+        name->name_len += label_length + 1;
+        pos += label_length + 1;
+    }
+}
+
+int dns_view_read_rr(const struct dns_msg_view* view, size_t offset, struct dns_rr_view* rr) {
+    int result = view_walk_name(view->data, view->len, offset, &rr->name, NULL);
+    if (result != DNS_VIEW_OK) {
+        return result;
+    }
+    offset += rr->name.wire_len;
+
+    if (offset + 10 > view->len) {
+        return DNS_VIEW_ESHORT;
+    }
+    rr->type = view_u16(view->data + offset);
+    rr->class = view_u16(view->data + offset + 2);
+    rr->ttl = view_u32(view->data + offset + 4);
+    rr->rdlength = view_u16(view->data + offset + 8);
+    offset += 10;
+
+    if (offset + rr->rdlength > view->len) {
+        return DNS_VIEW_ESHORT;
+    }
+    rr->rdata = (uint16_t)offset;
+
+    return (int)(offset + rr->rdlength);
+}
+
+int dns_view_name_at(const struct dns_msg_view* view, size_t offset, struct dns_name_view* name) {
+    return view_walk_name(view->data, view->len, offset, name, NULL);
+}
+
+int dns_view_parse(struct dns_msg_view* view, const uint8_t* data, size_t len,
+                   struct dns_rr_view* rrs, uint16_t max_rrs) {
+    view->data = data;
+    view->len = len;
+    view->rrs = rrs;
+    view->max_rrs = rrs ? max_rrs : 0;
+    view->nr_rrs = 0;
+    view->qtype = 0;
+    view->qclass = 0;
+    view->qhash = 0;
+    view->qname_status = DNS_NAME_OK;
+    memset(&view->qname, 0, sizeof(view->qname));
+    memset(&view->edns, 0, sizeof(view->edns));
+
+    if (len < sizeof(struct dns_header)) {
+        return DNS_VIEW_ESHORT;
+    }
+    dns_header_parse(&view->header, data);
+
+    size_t offset = sizeof(struct dns_header);
+
+    // question
+    if (view->header.qdcount > 1) {
+        return DNS_VIEW_EFORMAT;
+    }
+    if (view->header.qdcount == 1) {
+        int result = view_walk_name(data, len, offset, &view->qname, view->qlabels);
+        if (result != DNS_VIEW_OK) {
+            return result;
+        }
+        offset += view->qname.wire_len;
+        if (offset + 4 > len) {
+            return DNS_VIEW_ESHORT;
+        }
+        view->qtype = view_u16(data + offset);
+        view->qclass = view_u16(data + offset + 2);
+        offset += 4;
+
+        // canonical form shared with the caches and the trie; odd characters are passed on, not refused
+        struct dns_name_info info;
+        if (view->qname.compressed) {
+            uint8_t wire[DNS_MAX_NAME_WIRE];
+            dns_view_name_wire(view, &view->qname, wire, sizeof(wire));
+            view->qname_status = dns_name_canon(wire, sizeof(wire), view->qname_lower, &info);
+        } else {
+            view->qname_status = dns_name_canon(data + view->qname.offset, view->qname.wire_len, view->qname_lower, &info);
+        }
+        if (view->qname_status == DNS_NAME_ELABEL) {
+            return DNS_VIEW_ENAME;
+        }
+        view->qhash = info.hash;
+        memcpy(view->qname_labels, info.labels, info.nr_labels);
+    }
+    view->question_end = (uint16_t)offset;
+
+    // answer, authority and additional records
+    uint32_t nr_records = (uint32_t)view->header.ancount + view->header.nscount + view->header.arcount;
+    uint32_t additional_start = (uint32_t)view->header.ancount + view->header.nscount;
+
+    for (uint32_t i = 0; i < nr_records; i++) {
+        struct dns_rr_view rr;
+        int next = dns_view_read_rr(view, offset, &rr);
+        if (next < 0) {
+            return next;
+        }
+        offset = next;
+
+        // OPT: root owner, additional section only; its class/ttl fields are reused by edns
+        if (rr.type == DNS_TYPE_OPT && i >= additional_start && rr.name.nr_labels == 0 && !view->edns.present) {
+            view->edns.present = 1;
+            view->edns.udp_size = rr.class;
+            view->edns.ext_rcode = (uint8_t)(rr.ttl >> 24);
+            view->edns.version = (uint8_t)(rr.ttl >> 16);
+            view->edns.do_bit = (rr.ttl & 0x8000) ? 1 : 0;
+        }
+
+        if (view->rrs) {
+            if (view->nr_rrs == view->max_rrs) {
+                return DNS_VIEW_ETOOMANY;
+            }
+            view->rrs[view->nr_rrs++] = rr;
+        }
+    }
+
+    return DNS_VIEW_OK;
+}
+
+// runs body for every label of an already validated name, following pointers
+#define VIEW_FOR_EACH_LABEL(view, name, label, label_length, body)             \
+    do {                                                                    \
+        size_t pos_ = (name)->offset;                                       \
+        while ((view)->data[pos_] != 0) {                                   \
+            if (((view)->data[pos_] & 0xC0) == 0xC0) {                      \
+                pos_ = (((view)->data[pos_] & 0x3F) << 8) | (view)->data[pos_ + 1]; \
+                continue;                                                   \
+            }                                                               \
+            uint8_t label_length = (view)->data[pos_];                      \
+            const uint8_t* label = (view)->data + pos_ + 1;                 \
+            body                                                            \
+            pos_ += label_length + 1;                                       \
+        }                                                                   \
+    } while (0)
+
+int dns_view_name_str(const struct dns_msg_view* view, const struct dns_name_view* name,
+                      char* dest, size_t max_len) {
+    size_t out = 0;
+
+    if (max_len < 2) {
+        return -1;
+    }
+    // the root is written as "." only when it is the whole name
+    if (name->nr_labels == 0) {
+        dest[0] = '.';
+        dest[1] = '\0';
+        return 1;
+    }
+
+    VIEW_FOR_EACH_LABEL(view, name, label, label_length, {
+        if (out + label_length + 1 >= max_len) {
+            return -1;
+        }
+        if (out > 0) {
+            dest[out++] = '.';
+        }
+        memcpy(dest + out, label, label_length);
+        out += label_length;
+    });
+
+    dest[out] = '\0';
+    return (int)out;
+}
+
+int dns_view_name_wire(const struct dns_msg_view* view, const struct dns_name_view* name,
+                       uint8_t* dest, size_t max_len) {
+    size_t out = 0;
+
+    if (name->name_len > max_len) {
+        return -1;
+    }
+    VIEW_FOR_EACH_LABEL(view, name, label, label_length, {
+        dest[out++] = label_length;
+        memcpy(dest + out, label, label_length);
+        out += label_length;
+    });
+    dest[out++] = 0;
+
+    return (int)out;
+}
+
+int dns_view_name_equals(const struct dns_msg_view* view, const struct dns_name_view* name,
+                         const char* dotted) {
+    size_t pos = 0;
+
+    VIEW_FOR_EACH_LABEL(view, name, label, label_length, {
+        if (pos > 0) {
+            if (dotted[pos] != '.') {
+                return 0;
+            }
+            pos++;
+        }
+        for (int i = 0; i < label_length; i++) {
+            if (dotted[pos] == '\0' || tolower(label[i]) != tolower((unsigned char)dotted[pos])) {
+                return 0;
+            }
+            pos++;
+        }
+    });
+
+    // tolerate a trailing dot on the dotted side
+    return dotted[pos] == '\0' || (dotted[pos] == '.' && dotted[pos + 1] == '\0');
+}
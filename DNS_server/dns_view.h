@@ -0,0 +1,99 @@
+#ifndef __DNS_VIEW_H__
+#define __DNS_VIEW_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dns_packet.h"
+#include "dns_name.h"
+
+/* zero-allocation message parser */
+// dns_view_parse() makes one forward pass over a received datagram and describes it with offsets
+// and lengths into that buffer. nothing is copied or allocated, so the buffer must outlive the view.
+// every length, label and compression pointer is bounds-checked; pointers must jump strictly
+// backwards and at most DNS_MAX_POINTERS times, so crafted packets can't make it loop.
+
+#define DNS_MAX_NAME_WIRE 255     /* longest uncompressed wire name (rfc 1035) */
+#define DNS_MAX_LABEL 63
+#define DNS_MAX_LABELS 128        /* 255 bytes hold at most 127 labels + root */
+#define DNS_MAX_POINTERS 16       /* compression hops followed per name */
+
+/* error codes */
+#define DNS_VIEW_OK 0
+#define DNS_VIEW_ESHORT -1        /* packet ends inside a field */
+#define DNS_VIEW_ENAME -2         /* bad label, name too long or pointer loop */
+#define DNS_VIEW_EFORMAT -3       /* more than one question; view->header is set, the rest is not */
+#define DNS_VIEW_ETOOMANY -4      /* more records than the caller's array holds */
+
+struct dns_name_view {
+    uint16_t offset;              /* where the name starts in the message */
+    uint16_t wire_len;            /* bytes it occupies there (up to and including the pointer/root) */
+    uint16_t name_len;            /* length once decompressed, root byte included */
+    uint8_t nr_labels;            /* not counting the root */
+    uint8_t compressed;
+};
+
+struct dns_rr_view {
+    struct dns_name_view name;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t rdlength;
+    uint16_t rdata;               /* offset of rdata in the message */
+};
+
+struct dns_msg_view {
+    const uint8_t *data;
+    size_t len;
+    struct dns_header header;     /* host byte order */
+
+    /* question (qdcount is 0 or 1) */
+    struct dns_name_view qname;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint16_t qlabels[DNS_MAX_LABELS]; /* offset of each qname label's length byte, leftmost first */
+    uint8_t qname_lower[DNS_NAME_MAX]; /* qname decompressed and lowercased (see dns_name.h) */
+    uint8_t qname_labels[DNS_MAX_LABELS]; /* offset of each label's length byte in qname_lower */
+    uint32_t qhash;               /* dns_name hash of qname_lower */
+    int qname_status;             /* DNS_NAME_OK, or DNS_NAME_ECHAR for names outside letters/digits/-/_ */
+    uint16_t question_end;        /* offset just past the question section */
+
+    /* records of all three sections, in packet order; may be NULL to only validate them */
+    struct dns_rr_view *rrs;
+    uint16_t max_rrs;
+    uint16_t nr_rrs;
+
+    struct dns_edns edns;
+};
+
+/* parse data into view. rrs/max_rrs give room for the records (NULL/0 = don't keep them) */
+int dns_view_parse(struct dns_msg_view *view, const uint8_t *data, size_t len,
+                   struct dns_rr_view *rrs, uint16_t max_rrs);
+
+/* read the record at offset (e.g. question_end for the first one); returns the offset of the next
+   record or a DNS_VIEW_E* code. lets callers walk the records without keeping an array */
+int dns_view_read_rr(const struct dns_msg_view *view, size_t offset, struct dns_rr_view *rr);
+
+/* validate and measure the name at offset, e.g. one inside rdata */
+int dns_view_name_at(const struct dns_msg_view *view, size_t offset, struct dns_name_view *name);
+
+/* first record of a section: answer = 0, authority = ancount, additional = ancount + nscount */
+static inline uint16_t dns_view_authority_start(const struct dns_msg_view *view) {
+    return view->header.ancount;
+}
+static inline uint16_t dns_view_additional_start(const struct dns_msg_view *view) {
+    return view->header.ancount + view->header.nscount;
+}
+
+/* decompress a (validated) name into dest as a dotted string; returns its length or -1 */
+int dns_view_name_str(const struct dns_msg_view *view, const struct dns_name_view *name,
+                      char *dest, size_t max_len);
+
+/* decompress a (validated) name into dest in wire format; returns its length or -1 */
+int dns_view_name_wire(const struct dns_msg_view *view, const struct dns_name_view *name,
+                       uint8_t *dest, size_t max_len);
+
+/* case-insensitive comparison of a name in the message with a dotted string */
+int dns_view_name_equals(const struct dns_msg_view *view, const struct dns_name_view *name,
+                         const char *dotted);
+
+#endif
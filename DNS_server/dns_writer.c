@@ -0,0 +1,285 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "dns_writer.h"
+
+#define WRITER_MAX_NAME 255
+#define WRITER_MAX_POINTER 0x3FFF    /* highest offset a compression pointer can hold */
+
+static int writer_room(const struct dns_writer* w, size_t n) {
+    return w->len + n + w->reserved <= w->size;
+}
+
+// length of the uncompressed wire name at name (at most max bytes), root byte included; -1 if invalid
+static int writer_wire_length(const uint8_t* name, size_t max) {
+    size_t pos = 0;
+
+    while (pos < max && pos < WRITER_MAX_NAME) {
+        uint8_t label_length = name[pos];
+        if (label_length == 0) {
+            return (int)(pos + 1);
+        }
+        if (label_length > 63) {
+            return -1;
+        }
+        pos += label_length + 1;
+    }
+    return -1;
+}
+
+// compares the uncompressed wire name with the one written at offset, which may end in a pointer.
+// everything in the buffer was written by us, so the pointers only go backwards
+static int writer_name_equals(const uint8_t* buf, size_t offset, const uint8_t* name) {
+    while (1) {
+        uint8_t label_length = buf[offset];
+        if ((label_length & 0xC0) == 0xC0) {
+            offset = ((label_length & 0x3F) << 8) | buf[offset + 1];
+            continue;
+        }
+        if (label_length != *name) {
+            return 0;
+        }
+        if (label_length == 0) {
+            return 1;
+        }
+        for (int i = 1; i <= label_length; i++) {
+            if (tolower(buf[offset + i]) != tolower(name[i])) {
+                return 0;
+            }
+        }
+        offset += label_length + 1;
+        name += label_length + 1;
+    }
+}
+
+// appends a wire name, replacing its longest suffix already in the message with a pointer
+static int writer_wire_name(struct dns_writer* w, const uint8_t* name) {
+    uint16_t labels[WRITER_MAX_NAME / 2];
+    int nr_labels = 0;
+    size_t root = 0;               // offset of the terminating zero
+
+    for (; name[root] != 0; root += name[root] + 1) {
+        labels[nr_labels++] = (uint16_t)root;
+    }
+
+    int match = nr_labels;         // first label of the suffix found in the message
+    uint16_t match_offset = 0;
+    for (int i = 0; i < nr_labels && match == nr_labels; i++) {
+        for (int j = 0; j < w->nr_names; j++) {
+            if (writer_name_equals(w->buf, w->names[j], name + labels[i])) {
+                match = i;
+                match_offset = w->names[j];
+                break;
+            }
+        }
+    }
+
+    size_t literal = match < nr_labels ? labels[match] : root;   // leading bytes copied as is
+    size_t needed = literal + (match < nr_labels ? 2 : 1);
+    if (!writer_room(w, needed)) {
+        return -1;
+    }
+
+    // the labels written as is become compression targets for later names
+    for (int i = 0; i < match && w->nr_names < DNS_COMPRESS_MAX; i++) {
+        size_t at = w->len + labels[i];
+        if (at <= WRITER_MAX_POINTER) {
+            w->names[w->nr_names++] = (uint16_t)at;
+        }
+    }
+
+    memcpy(w->buf + w->len, name, literal);
+    w->len += literal;
+    if (match < nr_labels) {
+        w->buf[w->len++] = 0xC0 | (match_offset >> 8);
+        w->buf[w->len++] = match_offset & 0xFF;
+    } else {
+        w->buf[w->len++] = 0;
+    }
+    return 0;
+}
+
+static int writer_name(struct dns_writer* w, const char* name) {
+    uint8_t wire[WRITER_MAX_NAME + 2];
+
+    if (strlen(name) > WRITER_MAX_NAME - 2) {
+        return -1;
+    }
+    int wire_len = dns_encode_name(wire, name);
+    // catches empty and oversized labels
+    if (writer_wire_length(wire, wire_len) != wire_len) {
+        return -1;
+    }
+    return writer_wire_name(w, wire);
+}
+
+// appends rdata, compressing the names inside the well-known types that carry them (rfc 3597 4)
+static int writer_rdata(struct dns_writer* w, const struct dns_answer* rr) {
+    const uint8_t* rdata = (const uint8_t*)rr->rdata;
+    size_t prefix = 0;
+    size_t suffix = 0;
+    int nr_names;
+
+    switch (rr->type) {
+        case DNS_TYPE_NS:
+        case DNS_TYPE_CNAME:
+        case DNS_TYPE_PTR:
+            nr_names = 1;
+            break;
+        case DNS_TYPE_MX:
+            prefix = 2;
+            nr_names = 1;
+            break;
+        case DNS_TYPE_SOA:
+            nr_names = 2;
+            suffix = 20;
+            break;
+        default:
+            if (!writer_room(w, rr->rdlength)) {
+                return -1;
+            }
+            memcpy(w->buf + w->len, rdata, rr->rdlength);
+            w->len += rr->rdlength;
+            return 0;
+    }
+
+    size_t pos = 0;
+    if (prefix > rr->rdlength || !writer_room(w, prefix)) {
+        return -1;
+    }
+    memcpy(w->buf + w->len, rdata, prefix);
+    w->len += prefix;
+    pos += prefix;
+
+    for (int i = 0; i < nr_names; i++) {
+        int name_len = writer_wire_length(rdata + pos, rr->rdlength - pos);
+        if (name_len < 0 || writer_wire_name(w, rdata + pos) < 0) {
+            return -1;
+        }
+        pos += name_len;
+    }
+
+    if (pos + suffix != rr->rdlength || !writer_room(w, suffix)) {
+        return -1;
+    }
+    memcpy(w->buf + w->len, rdata + pos, suffix);
+    w->len += suffix;
+    return 0;
+}
+
+void dns_writer_init(struct dns_writer* w, uint8_t* buf, size_t size, const struct dns_header* header) {
+    w->buf = buf;
+    w->size = size;
+    w->len = sizeof(struct dns_header);
+    w->reserved = 0;
+    w->question_end = w->len;
+    w->header = *header;
+    w->header.qdcount = 0;
+    w->header.ancount = 0;
+    w->header.nscount = 0;
+    w->header.arcount = 0;
+    w->section = DNS_SECTION_ANSWER;
+    w->nr_names = 0;
+    w->nr_question_names = 0;
+}
+
+int dns_writer_reserve(struct dns_writer* w, size_t n) {
+    if (w->len + n > w->size) {
+        return -1;
+    }
+    w->reserved = n;
+    return 0;
+}
+
+int dns_writer_question(struct dns_writer* w, const char* qname, uint16_t qtype, uint16_t qclass) {
+    size_t start = w->len;
+    int start_names = w->nr_names;
+
+    if (writer_name(w, qname) < 0 || !writer_room(w, 4)) {
+        w->len = start;
+        w->nr_names = start_names;
+        return -1;
+    }
+
+    uint16_t net_qtype = htons(qtype);
+    uint16_t net_qclass = htons(qclass);
+    memcpy(w->buf + w->len, &net_qtype, sizeof(uint16_t));
+    memcpy(w->buf + w->len + 2, &net_qclass, sizeof(uint16_t));
+    w->len += 4;
+
+    w->header.qdcount++;
+    w->question_end = w->len;
+    w->nr_question_names = w->nr_names;
+    return 0;
+}
+
+int dns_writer_rr(struct dns_writer* w, int section, const struct dns_answer* rr) {
+    if (section < w->section || section > DNS_SECTION_ADDITIONAL) {
+        return -1;
+    }
+
+    size_t start = w->len;
+    int start_names = w->nr_names;
+
+    if (writer_name(w, rr->name) < 0 || !writer_room(w, 10)) {
+        goto fail;
+    }
+    size_t fixed = w->len;
+    w->len += 10;
+    if (writer_rdata(w, rr) < 0) {
+        goto fail;
+    }
+
+    // rdlength is only known now, compression may have shortened the rdata
+    uint16_t type = htons(rr->type);
+    uint16_t class = htons(rr->class);
+    uint32_t ttl = htonl(rr->ttl);
+    uint16_t rdlength = htons((uint16_t)(w->len - fixed - 10));
+    memcpy(w->buf + fixed, &type, sizeof(uint16_t));
+    memcpy(w->buf + fixed + 2, &class, sizeof(uint16_t));
+    memcpy(w->buf + fixed + 4, &ttl, sizeof(uint32_t));
+    memcpy(w->buf + fixed + 8, &rdlength, sizeof(uint16_t));
+
+    if (section == DNS_SECTION_ANSWER) {
+        w->header.ancount++;
+    } else if (section == DNS_SECTION_AUTHORITY) {
+        w->header.nscount++;
+    } else {
+        w->header.arcount++;
+    }
+    w->section = section;
+    return 0;
+
+fail:
+    w->len = start;
+    w->nr_names = start_names;
+    return -1;
+}
+
+int dns_writer_opt(struct dns_writer* w, uint16_t udp_size, uint8_t do_bit) {
+    int written = dns_write_opt(w->buf + w->len, w->size - w->len, udp_size, do_bit);
+    if (written < 0) {
+        return -1;
+    }
+    w->len += written;
+    w->reserved = w->reserved > (size_t)written ? w->reserved - written : 0;
+    w->header.arcount++;
+    w->section = DNS_SECTION_ADDITIONAL;
+    return 0;
+}
+
+void dns_writer_truncate(struct dns_writer* w) {
+    w->len = w->question_end;
+    w->nr_names = w->nr_question_names;
+    w->header.ancount = 0;
+    w->header.nscount = 0;
+    w->header.arcount = 0;
+    w->header.tc = 1;
+    w->section = DNS_SECTION_ANSWER;
+}
+
+size_t dns_writer_finish(struct dns_writer* w) {
+    dns_header_write(w->buf, &w->header);
+    return w->len;
+}
@@ -0,0 +1,55 @@
+#ifndef __DNS_WRITER_H__
+#define __DNS_WRITER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "dns_packet.h"
+
+/* response writer */
+// appends a message into a caller-provided buffer: header, question, then records section by
+// section. names are compressed (rfc 1035 4.1.4) against everything already written, using a small
+// table of offsets where earlier names and their suffixes start. the size limit is enforced while
+// encoding: an append that doesn't fit fails and leaves the message as it was.
+
+#define DNS_COMPRESS_MAX 64        /* name offsets remembered for compression */
+
+/* sections, in the order they have to be written */
+#define DNS_SECTION_ANSWER 0
+#define DNS_SECTION_AUTHORITY 1
+#define DNS_SECTION_ADDITIONAL 2
+
+struct dns_writer {
+    uint8_t *buf;
+    size_t size;                   /* payload limit (e.g. the client's edns size) */
+    size_t len;                    /* bytes written, header included */
+    size_t reserved;               /* kept back at the end, e.g. for the OPT record */
+    size_t question_end;
+    struct dns_header header;      /* host order; counts are kept up to date by the writer */
+    int section;                   /* section of the last record written */
+    uint16_t names[DNS_COMPRESS_MAX];
+    int nr_names;
+    int nr_question_names;         /* names[] entries that belong to the question */
+};
+
+/* start a message in buf; size is the most it may grow to */
+void dns_writer_init(struct dns_writer *w, uint8_t *buf, size_t size, const struct dns_header *header);
+
+/* keep n bytes free at the end for a record appended last (dns_writer_opt) */
+int dns_writer_reserve(struct dns_writer *w, size_t n);
+
+/* append the question; returns 0 or -1 if it doesn't fit */
+int dns_writer_question(struct dns_writer *w, const char *qname, uint16_t qtype, uint16_t qclass);
+
+/* append a record to section (not before records of a later one); returns 0 or -1 if it doesn't fit */
+int dns_writer_rr(struct dns_writer *w, int section, const struct dns_answer *rr);
+
+/* append an OPT record, using the reserved room */
+int dns_writer_opt(struct dns_writer *w, uint16_t udp_size, uint8_t do_bit);
+
+/* drop all records, keep the question and set TC */
+void dns_writer_truncate(struct dns_writer *w);
+
+/* write the header in front and return the message length */
+size_t dns_writer_finish(struct dns_writer *w);
+
+#endif
@@ -1,9 +1,438 @@
 #include "logger.h"
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 
+atomic_int logRuntimeLevel = LOG_DEFAULT_LEVEL;
+
+static const char* const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+#define STAMP_SIZE 64 // "[date time]"; room for any year the compiler can think of
+
+// what a conversion of a format takes; its argument is read (and recorded) as that type
+typedef enum { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+               ARG_DOUBLE, ARG_LDOUBLE, ARG_STRING, ARG_POINTER, ARG_CHAR } LogArgType;
+
+// one conversion of a format, from after its '%'
+typedef struct {
+    const char* flags;       // the flags, width and precision as written
+    int flags_len;
+    int star_width;          // a '*' width, which takes an int argument of its own
+    int star_precision;
+    LogArgType type;
+    int bits;                // integers: how wide printf takes them, 0 for the rest
+    char conversion;         // 0 for "%%" and conversions we can't record
+} LogSpec;
+
+static uint64_t nowNs(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// p points after a '%'; returns where the conversion ends
+static const char* parseSpec(const char* p, LogSpec* spec) {
+    memset(spec, 0, sizeof(LogSpec));
+    spec->flags = p;
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    spec->flags_len = (int)(p - spec->flags);
+
+    LogArgType integer = ARG_INT;
+    int int_bits = 32;
+    if (p[0] == 'h') {
+        int_bits = p[1] == 'h' ? 8 : 16;
+        p += p[1] == 'h' ? 2 : 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        integer = ARG_LLONG;
+        p += 2;
+    } else if (p[0] == 'l') {
+        integer = ARG_LONG;
+        p++;
+    } else if (p[0] == 'z') {
+        integer = ARG_SIZE;
+        p++;
+    } else if (p[0] == 'j') {
+        integer = ARG_INTMAX;
+        p++;
+    } else if (p[0] == 't') {
+        integer = ARG_PTRDIFF;
+        p++;
+    } else if (p[0] == 'L') {
+        integer = ARG_LDOUBLE;
+        p++;
+    }
+
+    spec->conversion = *p;
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+        spec->type = integer == ARG_LDOUBLE ? ARG_LLONG : integer;
+        spec->bits = spec->type == ARG_INT ? int_bits : 64;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->type = integer == ARG_LDOUBLE ? ARG_LDOUBLE : ARG_DOUBLE;
+        break;
+    case 'c':
+        spec->type = ARG_CHAR;
+        break;
+    case 's':
+        spec->type = ARG_STRING;
+        break;
+    case 'p':
+        spec->type = ARG_POINTER;
+        break;
+    case '\0':
+        return p;
+    default:
+        // "%%", and "%n" which we never honor
+        spec->type = *p == 'n' ? ARG_POINTER : ARG_NONE;
+        spec->conversion = 0;
+        break;
+    }
+    return p + 1;
+}
+
+static int putValue(unsigned char* args, size_t* len, size_t size, uint64_t value) {
+    if (*len + sizeof(value) > size) {
+        return -1;
+    }
+    memcpy(args + *len, &value, sizeof(value));
+    *len += sizeof(value);
+    return 0;
+}
+
+// record format's arguments; stops at the first that does not fit, except strings, which are cut short
+static size_t encodeArgs(unsigned char* args, size_t size, const char* format, va_list ap) {
+    size_t len = 0;
+    LogSpec spec;
+
+    for (const char* p = strchr(format, '%'); p; p = strchr(p, '%')) {
+        p = parseSpec(p + 1, &spec);
+        if ((spec.star_width && putValue(args, &len, size, (uint64_t)(int64_t)va_arg(ap, int)) != 0) ||
+            (spec.star_precision && putValue(args, &len, size, (uint64_t)(int64_t)va_arg(ap, int)) != 0)) {
+            return len;
+        }
+
+        uint64_t value = 0;
+        double real = 0;
+        switch (spec.type) {
+        case ARG_NONE:
+            continue;
+        case ARG_INT:
+        case ARG_CHAR:
+            value = (uint64_t)(int64_t)va_arg(ap, int);
+            break;
+        case ARG_LONG:
+            value = (uint64_t)va_arg(ap, long);
+            break;
+        case ARG_LLONG:
+            value = (uint64_t)va_arg(ap, long long);
+            break;
+        case ARG_SIZE:
+            value = (uint64_t)va_arg(ap, size_t);
+            break;
+        case ARG_INTMAX:
+            value = (uint64_t)va_arg(ap, intmax_t);
+            break;
+        case ARG_PTRDIFF:
+            value = (uint64_t)va_arg(ap, ptrdiff_t);
+            break;
+        case ARG_DOUBLE:
+            real = va_arg(ap, double);
+            memcpy(&value, &real, sizeof(value));
+            break;
+        case ARG_LDOUBLE:
+            real = (double)va_arg(ap, long double);
+            memcpy(&value, &real, sizeof(value));
+            break;
+        case ARG_POINTER:
+            value = (uint64_t)(uintptr_t)va_arg(ap, void*);
+            break;
+        case ARG_STRING: {
+            const char* string = va_arg(ap, const char*);
+            if (len + sizeof(uint16_t) > size) {
+                return len;
+            }
+            // UINT16_MAX stands for NULL
+            size_t string_len = string ? strlen(string) : 0;
+            if (string_len > size - len - sizeof(uint16_t)) {
+                string_len = size - len - sizeof(uint16_t);
+            }
+            uint16_t stored = string ? (uint16_t)string_len : UINT16_MAX;
+            memcpy(args + len, &stored, sizeof(stored));
+            memcpy(args + len + sizeof(stored), string, string_len);
+            len += sizeof(stored) + string_len;
+            continue;
+        }
+        }
+        // integers are kept 64 bits wide: zero-extended for the unsigned conversions, sign-extended
+        // for the others, from the width printf would have taken
+        if (spec.bits > 0 && spec.bits < 64) {
+            uint64_t mask = (1ull << spec.bits) - 1;
+            value &= mask;
+            if (!strchr("uxXo", spec.conversion) && (value >> (spec.bits - 1))) {
+                value |= ~mask;
+            }
+        }
+        if (putValue(args, &len, size, value) != 0) {
+            return len;
+        }
+    }
+    return len;
+}
+
+static int getValue(const LogRecord* record, size_t* pos, uint64_t* value) {
+    if (*pos + sizeof(*value) > record->args_len) {
+        return -1;
+    }
+    memcpy(value, record->args + *pos, sizeof(*value));
+    *pos += sizeof(*value);
+    return 0;
+}
+
+// print one conversion with its recorded argument: the spec is rebuilt with any '*' filled in and the
+// length the value was recorded with. returns -1 once the record has no more arguments
+static int writeArg(FILE* file, const LogSpec* spec, const LogRecord* record, size_t* pos) {
+    char format[64];
+    int len = 0;
+    uint64_t width = 0, precision = 0, value = 0;
+
+    if ((spec->star_width && getValue(record, pos, &width) != 0) ||
+        (spec->star_precision && getValue(record, pos, &precision) != 0)) {
+        return -1;
+    }
+    format[len++] = '%';
+    for (const char* p = spec->flags; p < spec->flags + spec->flags_len && len < 40; p++) {
+        if (*p != '*') {
+            format[len++] = *p;
+        } else {
+            len += snprintf(format + len, sizeof(format) - len, "%d",
+                            (int)(p == spec->flags || p[-1] != '.' ? width : precision));
+        }
+    }
+
+    if (spec->type == ARG_STRING) {
+        uint16_t stored;
+        if (*pos + sizeof(stored) > record->args_len) {
+            return -1;
+        }
+        memcpy(&stored, record->args + *pos, sizeof(stored));
+        *pos += sizeof(stored);
+        if (stored == UINT16_MAX) {
+            fputs("(null)", file);
+            return 0;
+        }
+        // recorded without their terminator
+        char string[LOGGER_RECORD_SIZE];
+        memcpy(string, record->args + *pos, stored);
+        string[stored] = '\0';
+        *pos += stored;
+        snprintf(format + len, sizeof(format) - len, "s");
+        fprintf(file, format, string);
+        return 0;
+    }
+
+    if (getValue(record, pos, &value) != 0) {
+        return -1;
+    }
+    switch (spec->type) {
+    case ARG_CHAR:
+        snprintf(format + len, sizeof(format) - len, "c");
+        fprintf(file, format, (int)value);
+        break;
+    case ARG_DOUBLE:
+    case ARG_LDOUBLE: {
+        double real;
+        memcpy(&real, &value, sizeof(real));
+        snprintf(format + len, sizeof(format) - len, "%c", spec->conversion);
+        fprintf(file, format, real);
+        break;
+    }
+    case ARG_POINTER:
+        if (spec->conversion) {
+            snprintf(format + len, sizeof(format) - len, "p");
+            fprintf(file, format, (void*)(uintptr_t)value);
+        }
+        break;
+    default:
+        // every integer was recorded 8 bytes wide, sign-extended if it was signed
+        snprintf(format + len, sizeof(format) - len, "ll%c", spec->conversion);
+        fprintf(file, format, (long long)value);
+        break;
+    }
+    return 0;
+}
+
+// the "[date time] [level] " prefix; the date is formatted again only when the second changes
+static void writeRecord(FILE* file, const LogRecord* record, time_t* stamp_second, char* stamp) {
+    time_t second = (time_t)(record->time_ns / 1000000000ull);
+    if (second != *stamp_second) {
+        struct tm t;
+        localtime_r(&second, &t);
+        snprintf(stamp, STAMP_SIZE, "[%04d-%02d-%02d %02d:%02d:%02d]",
+                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        *stamp_second = second;
+    }
+    fprintf(file, "%s [%s] ", stamp, record->level);
+
+    size_t pos = 0;
+    LogSpec spec;
+    const char* p = record->format;
+    for (const char* percent = strchr(p, '%'); percent; percent = strchr(p, '%')) {
+        fwrite(p, 1, percent - p, file);
+        p = parseSpec(percent + 1, &spec);
+        if (spec.type == ARG_NONE) {
+            if (*(p - 1) == '%') {
+                fputc('%', file);
+            }
+            continue;
+        }
+        if (writeArg(file, &spec, record, &pos) != 0) {
+            // the arguments did not all fit in the record
+            fputs("...\n", file);
+            return;
+        }
+    }
+    fputs(p, file);
+    fputc('\n', file);
+}
+
+static void unlinkRing(Logger* logger, LogRing* ring) {
+    pthread_mutex_lock(&(logger->lock));
+    LogRing* head = atomic_load(&logger->rings);
+    if (head == ring) {
+        atomic_store(&logger->rings, ring->next);
+    } else {
+        for (LogRing* prev = head; prev; prev = prev->next) {
+            if (prev->next == ring) {
+                prev->next = ring->next;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(logger->lock));
+    free(ring);
+}
+
+// write every record waiting in the rings; returns how many there were
+static size_t drainRings(Logger* logger, time_t* stamp_second, char* stamp) {
+    size_t written = 0;
+    LogRing* ring = atomic_load_explicit(&logger->rings, memory_order_acquire);
+
+    while (ring) {
+        LogRing* next = ring->next;
+        // looked at first: a ring closed by then has all its records published
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        written += tail - head;
+        for (; head != tail; head++) {
+            writeRecord(logger->log_file, &ring->records[head & (LOGGER_RING_SIZE - 1)], stamp_second, stamp);
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported_dropped) {
+            fprintf(logger->log_file, "%s [WARN] %llu log messages dropped, the writer fell behind\n",
+                    stamp, (unsigned long long)(dropped - ring->reported_dropped));
+            ring->reported_dropped = dropped;
+        }
+
+        if (closed) {
+            unlinkRing(logger, ring);
+        }
+        ring = next;
+    }
+    return written;
+}
+
+static void* loggerWriter(void* arg) {
+    Logger* logger = (Logger*)arg;
+    time_t stamp_second = 0;
+    char stamp[STAMP_SIZE] = "";
+    uint64_t flushed_at = nowNs(CLOCK_MONOTONIC);
+    uint64_t interval = (uint64_t)logger->flush_interval_ms * 1000000;
+    int poll_ms = logger->flush_interval_ms < LOGGER_POLL_MS ? logger->flush_interval_ms : LOGGER_POLL_MS;
+    struct timespec poll = { 0, (long)poll_ms * 1000000 };
+
+    while (1) {
+        // everything logged before stop was set is in the rings by the time it is seen
+        int stop = atomic_load(&logger->stop);
+        size_t written = drainRings(logger, &stamp_second, stamp);
+
+        uint64_t now = nowNs(CLOCK_MONOTONIC);
+        if (now - flushed_at >= interval) {
+            fflush(logger->log_file);
+            flushed_at = now;
+        }
+        if (stop) {
+            break;
+        }
+        if (written == 0) {
+            nanosleep(&poll, NULL);
+        }
+    }
+    fflush(logger->log_file);
+    return NULL;
+}
+
+// runs when a thread that logged exits
+static void closeRing(void* arg) {
+    LogRing* ring = (LogRing*)arg;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+// the calling thread's ring, made on its first message
+static LogRing* threadRing(Logger* logger) {
+    LogRing* ring = (LogRing*)pthread_getspecific(logger->ring_key);
+    if (ring) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->closed, 0);
+    pthread_setspecific(logger->ring_key, ring);
+
+    pthread_mutex_lock(&(logger->lock));
+    ring->next = atomic_load(&logger->rings);
+    atomic_store_explicit(&logger->rings, ring, memory_order_release);
+    pthread_mutex_unlock(&(logger->lock));
+    return ring;
+}
+
 // Initialize the logger
 Logger* initLogger(const char* filename) {
+    return initLoggerWithInterval(filename, LOGGER_FLUSH_INTERVAL_MS);
+}
+
+Logger* initLoggerWithInterval(const char* filename, int flush_interval_ms) {
     Logger* logger = malloc(sizeof(Logger));
     if (!logger) {
         perror("Failed to allocate memory for logger");
@@ -16,42 +445,101 @@ Logger* initLogger(const char* filename) {
         free(logger);
         return NULL;
     }
+    // the writer fills this and hands it to the kernel whole
+    setvbuf(logger->log_file, NULL, _IOFBF, LOGGER_BUFFER_SIZE);
 
     pthread_mutex_init(&(logger->lock), NULL);
+    pthread_key_create(&logger->ring_key, closeRing);
+    atomic_init(&logger->rings, NULL);
+    atomic_init(&logger->stop, 0);
+    logger->flush_interval_ms = flush_interval_ms > 0 ? flush_interval_ms : 1;
+
+    if (pthread_create(&logger->writer, NULL, loggerWriter, logger) != 0) {
+        perror("Failed to start the log writer");
+        pthread_key_delete(logger->ring_key);
+        pthread_mutex_destroy(&(logger->lock));
+        fclose(logger->log_file);
+        free(logger);
+        return NULL;
+    }
     return logger;
 }
 
 // Write a message to the log
 void logMessage(Logger* logger, const char* level, const char* format, ...) {
-    pthread_mutex_lock(&(logger->lock));
+    LogRing* ring = threadRing(logger);
+    if (!ring) {
+        return;
+    }
 
-    // Get current timestamp
-    time_t now = time(NULL);
-    struct tm* t = localtime(&now);
+    // only this thread moves tail; head is looked at again only when the ring seems full
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->cached_head >= LOGGER_RING_SIZE) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head >= LOGGER_RING_SIZE) {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return;
+        }
+    }
 
-    // Write the timestamp and log level
-    fprintf(logger->log_file, "[%04d-%02d-%02d %02d:%02d:%02d] [%s] ",
-            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-            t->tm_hour, t->tm_min, t->tm_sec, level);
+    LogRecord* record = &ring->records[tail & (LOGGER_RING_SIZE - 1)];
+    record->time_ns = nowNs(CLOCK_REALTIME_COARSE);
+    record->level = level;
+    record->format = format;
 
-    // Write the formatted message
     va_list args;
     va_start(args, format);
-    vfprintf(logger->log_file, format, args);
+    record->args_len = (uint16_t)encodeArgs(record->args, sizeof(record->args), format, args);
     va_end(args);
 
-    // Add a newline and flush the log
-    fprintf(logger->log_file, "\n");
-    fflush(logger->log_file);
-
-    pthread_mutex_unlock(&(logger->lock));
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
 }
 
 // Clean up the logger
 void destroyLogger(Logger* logger) {
     if (logger) {
+        atomic_store(&logger->stop, 1);
+        pthread_join(logger->writer, NULL);
+
+        LogRing* ring = atomic_load(&logger->rings);
+        while (ring) {
+            LogRing* next = ring->next;
+            free(ring);
+            ring = next;
+        }
+        pthread_key_delete(logger->ring_key);
         fclose(logger->log_file);
         pthread_mutex_destroy(&(logger->lock));
         free(logger);
     }
 }
+
+void setLogLevel(int level) {
+    if (level < LOG_LEVEL_DEBUG) {
+        level = LOG_LEVEL_DEBUG;
+    } else if (level > LOG_LEVEL_OFF) {
+        level = LOG_LEVEL_OFF;
+    }
+    atomic_store_explicit(&logRuntimeLevel, level, memory_order_relaxed);
+}
+
+int getLogLevel(void) {
+    return atomic_load_explicit(&logRuntimeLevel, memory_order_relaxed);
+}
+
+int parseLogLevel(const char* name) {
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++) {
+        if (strcasecmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+const char* logLevelName(int level) {
+    if (level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_OFF) {
+        return "?";
+    }
+    return level_names[level];
+}
@@ -4,16 +4,111 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define LOGGER_RING_SIZE 1024 // records a thread can have waiting (power of two)
+#define LOGGER_RECORD_SIZE 256 // bytes per record; longer string arguments are cut short
+#define LOGGER_FLUSH_INTERVAL_MS 100 // default: how long a written line may sit in the file buffer
+#define LOGGER_POLL_MS 2 // how long the writer sleeps when it found nothing to write
+#define LOGGER_BUFFER_SIZE 65536 // file buffer of the writer
+#define LOGGER_CACHE_LINE 64
+
+// log levels
+#define LOG_LEVEL_DEBUG 0 // per-query detail
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+// messages below this level are not compiled in at all (make LOG_LEVEL=LOG_LEVEL_INFO); the rest are
+// filtered at runtime, see setLogLevel()
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO // runtime level until setLogLevel()
+
+extern atomic_int logRuntimeLevel;
+
+// whether a message of level is written. a constant 0 for levels compiled out, so whatever it guards
+// goes with them; otherwise one relaxed load
+#define LOG_ON(level) ((level) >= LOG_COMPILE_LEVEL && \
+                       (level) >= atomic_load_explicit(&logRuntimeLevel, memory_order_relaxed))
+
+// console output, for the modules without a Logger: debug and info to stdout, the rest to stderr.
+// the arguments are only evaluated, and the message only formatted, if it is written
+#define LOG_PRINT(level, ...)                                                           \
+    do {                                                                                \
+        if (LOG_ON(level)) {                                                            \
+            fprintf((level) >= LOG_LEVEL_WARN ? stderr : stdout, __VA_ARGS__);          \
+        }                                                                               \
+    } while (0)
+#define LOG_DEBUG(...) LOG_PRINT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_PRINT(LOG_LEVEL_INFO, __VA_ARGS__)
+
+// the same for a Logger; the level also names the line
+#define LOGGER_LOG(logger, level, ...)                                                  \
+    do {                                                                                \
+        if (LOG_ON(level)) {                                                            \
+            logMessage((logger), logLevelName(level), __VA_ARGS__);                     \
+        }                                                                               \
+    } while (0)
+#define LOGGER_DEBUG(logger, ...) LOGGER_LOG(logger, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGGER_INFO(logger, ...) LOGGER_LOG(logger, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGGER_WARN(logger, ...) LOGGER_LOG(logger, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGGER_ERROR(logger, ...) LOGGER_LOG(logger, LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// one logMessage() call, not formatted yet: the arguments as the format says they are (integers as
+// 8 bytes, doubles, pointers, strings as a 2 byte length and their bytes)
+typedef struct {
+    uint64_t time_ns;                    // CLOCK_REALTIME_COARSE
+    const char* level;
+    const char* format;                  // also tells how args is laid out
+    uint16_t args_len;
+    unsigned char args[LOGGER_RECORD_SIZE - 2 * sizeof(uint64_t) - 2 * sizeof(char*)];
+} LogRecord;
+
+// records of one thread; only that thread writes them, only the writer thread takes them
+typedef struct LogRing {
+    LogRecord records[LOGGER_RING_SIZE];
+    _Alignas(LOGGER_CACHE_LINE) atomic_size_t tail;  // next record the thread writes
+    size_t cached_head;                  // the thread's last look at head
+    atomic_uint_fast64_t dropped;        // records the thread had no room for
+    _Alignas(LOGGER_CACHE_LINE) atomic_size_t head;  // next record the writer takes
+    uint64_t reported_dropped;           // writer only
+    atomic_int closed;                   // the thread has exited; freed once empty
+    struct LogRing* next;
+} LogRing;
 
 // Logger structure
+// logMessage() only copies its arguments into the calling thread's ring, without locks, syscalls or
+// formatting, and drops the message if the ring is full. a writer thread formats the rings' records
+// and writes them out in large blocks, flushing the file every flush_interval_ms. lines of different
+// threads may therefore appear slightly out of order
 typedef struct {
     FILE* log_file;          // File pointer for the log file
-    pthread_mutex_t lock;    // Mutex to ensure thread-safe logging
+    pthread_mutex_t lock;    // adding and removing rings only
+    pthread_key_t ring_key;  // the calling thread's LogRing
+    _Atomic(LogRing*) rings;
+    int flush_interval_ms;
+    atomic_int stop;
+    pthread_t writer;
 } Logger;
 
 // Function prototypes
 Logger* initLogger(const char* filename);
+// same, flushing every flush_interval_ms instead of LOGGER_FLUSH_INTERVAL_MS
+Logger* initLoggerWithInterval(const char* filename, int flush_interval_ms);
+// level and format are kept by address until the line is written: pass string literals
 void logMessage(Logger* logger, const char* level, const char* format, ...);
+// writes out everything logged so far
 void destroyLogger(Logger* logger);
+// the runtime level, for every thread at once; levels below LOG_COMPILE_LEVEL stay off
+void setLogLevel(int level);
+int getLogLevel(void);
+// "debug", "info", "warn", "error" or "off" (any case); -1 for anything else
+int parseLogLevel(const char* name);
+// "DEBUG", "INFO", ...; a literal, so it can be passed to logMessage()
+const char* logLevelName(int level);
 
 #endif // LOGGER_H
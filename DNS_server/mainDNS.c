@@ -3,35 +3,68 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include "trie.h"
 #include "cache.h"
 #include "thread.h"
 #include "logger.h"
+#include "coroutine.h"
 #include "dns_server.h"
+#include "dns_forwarder.h"
+#include "dns_relay.h"
+#include "dns_cores.h"
 
 // graceful shutdown stuff
 // if ctrl+c is entered, the wile(1) loop at the end of the program will not repeat, thus the clean up functions
 // will be reached
 static volatile sig_atomic_t server_running = 1;
 void handle_sigint(int sig) {
-    printf("\nServer will shut down after next request.\n");
+    printf("\nServer is shutting down.\n");
     server_running = 0;
 }
 
+#define PORT 8081
+#define BUFFER_SIZE 1024
+#define FORWARD_SOCKETS 2
+#define DNS_UDP_PORT 8053      // plain dns over udp: our zones answered locally, the rest relayed upstream;
+                               // over tcp too, for answers that came back truncated
+#define CLIENT_DEADLINE_MS 3000 // how long after it connected a client still waits for its answer
+#define MAX_WAITING_CLIENTS 256 // connected clients whose query hasn't arrived yet; more are refused right away
+#define MAX_PENDING_MISSES 512  // forwarded requests in flight at once; more are refused right away
+#define SLOW_POOL_QUEUE 256
+#define SLOW_POOL_CONF "slow_pool.conf" // same keys as thread_pool.conf
+#define DRAIN_POLL_US 10000     // how often shutdown looks whether the last requests have ended
+
 typedef struct {
     struct TrieNode* root;
     struct DNSCache* cache;
     Logger* logger;
+    ThreadPool* pool;                   // reads the query and answers hits from cache and trie
+    ThreadPool* slow_pool;              // only forwarded misses, so a slow upstream can't hold up hits
+    struct dns_forwarder* forwarder;
+    struct dns_pcache* packet_cache;    // the udp listener's, unless it is served per core
+    struct dns_cores* cores;            // NULL unless udp is served per core
+    atomic_int nr_misses;               // forwarded requests not answered yet, at most MAX_PENDING_MISSES
+    atomic_int nr_requests;             // accepted and not ended yet; shutdown waits for them
 } ServerContext;
 
+// one client request, from accept to answer. serveClient runs it as a coroutine (see coroutine.h),
+// so everything it needs after waiting for a pool or the upstream is kept here
 typedef struct {
+    Coroutine co;
     int client_socket;
     ServerContext* context;
-} ClientTask;
-
-#define PORT 8081
-#define BUFFER_SIZE 1024
+    uint64_t deadline;                  // threadPoolNow() time the client gives up at
+    int miss;                           // counted in nr_misses
+    int worker;                         // the slow pool worker that sent the query, resumes it too
+    char domain[BUFFER_SIZE];
+    char ip_address[INET_ADDRSTR_LEN];
+    struct CacheEntry* cache_entry;     // every answer record of the reply, built on the i/o thread
+    int status;
+} ClientRequest;
 
 void printTrie(struct TrieNode* node, int level) {
     if (!node) return;
@@ -81,114 +114,431 @@ void visualizeTrie(struct TrieNode* root) {
     system("xdg-open trie.png");
 }
 
-void handleClient(void* arg) {
-    ClientTask* task = (ClientTask*)arg; // Cast argument to ClientTask*
-    int client_socket = task->client_socket;
-    ServerContext* context = task->context;
-    free(task);
+// send the final answer for domain and close the client connection
+void sendClientResponse(ServerContext* context, int client_socket, struct CacheEntry* cache_entry) {
+    char* response;
+    if (cache_entry && cache_entry->record_value) {
+        response = cache_entry->record_value;
+    } else {
+        response = "Record not found";
+    }
 
-    logMessage(context->logger, "INFO", "Handling client socket: %d", client_socket);
+    // Send the response back to the client
+    if (send(client_socket, response, strlen(response), 0) < 0) {
+        LOGGER_ERROR(context->logger, "Failed to send response to client socket: %d", client_socket);
+    } else {
+        LOGGER_DEBUG(context->logger, "Sent response to client %d: %s", client_socket, response);
+    }
 
-    char buffer[BUFFER_SIZE] = {0};
-    int valread = read(client_socket, buffer, BUFFER_SIZE);
+    close(client_socket);
+    LOGGER_DEBUG(context->logger, "Closed connection for client socket: %d", client_socket);
+}
 
-    if (valread <= 0) {
-        logMessage(context->logger, "ERROR", "Failed to read from client socket: %d", client_socket);
-        close(client_socket);
-        return;
+// one line of the "pool" command's reply; returns its length
+int formatPoolStats(const char* name, ThreadPool* pool, char* buffer, size_t size) {
+    ThreadPoolStats stats;
+    getThreadPoolStats(pool, &stats);
+    int len = snprintf(buffer, size,
+                       "%s: threads %d idle %d queued %zu utilization %.2f avg_wait_us %.1f tasks %llu expired %llu shed %llu%s\n",
+                       name, stats.nr_threads, stats.nr_idle, stats.nr_queued, stats.utilization, stats.avg_wait_us,
+                       (unsigned long long)stats.nr_tasks, (unsigned long long)stats.nr_expired,
+                       (unsigned long long)stats.nr_shed, stats.overloaded ? " overloaded" : "");
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// tell a client we can't take its request now; cheaper for both sides than an answer that comes too late
+void sendServerBusy(int client_socket) {
+    const char* response = "Server busy";
+    send(client_socket, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+}
+
+// the end of every request, answered or not
+void endRequest(ClientRequest* request) {
+    ServerContext* context = request->context;
+    if (request->miss) {
+        atomic_fetch_sub(&context->nr_misses, 1);
+    }
+    free(request);
+    atomic_fetch_sub(&context->nr_requests, 1);
+}
+
+// wait until every accepted request has ended. no new ones may be accepted by then; the rest end by
+// their deadline at the latest (queued ones expire, the upstream gets no longer), so after this no
+// worker runs serveClient and nothing waits on the forwarder
+void drainRequests(ServerContext* context) {
+    while (atomic_load(&context->nr_requests) > 0) {
+        usleep(DRAIN_POLL_US);
+    }
+}
+
+// a client that waited in a queue past its deadline has given up; it is closed without another look
+// at its query, so under overload no time goes into answers nobody waits for (see getThreadPoolStats)
+void dropExpiredRequest(void* arg) {
+    ClientRequest* request = (ClientRequest*)arg;
+    close(request->client_socket);
+    endRequest(request);
+}
+
+// how long the accept loop may sleep: until the first deadline of the clients it waits on, -1 = forever
+int waitingTimeout(ClientRequest** waiting, int nr_waiting) {
+    uint64_t now = threadPoolNow();
+    int timeout_ms = -1;
+
+    for (int i = 0; i < nr_waiting; i++) {
+        int left = now < waiting[i]->deadline ? (int)((waiting[i]->deadline - now + 999999) / 1000000) : 0;
+        if (timeout_ms < 0 || left < timeout_ms) {
+            timeout_ms = left;
+        }
+    }
+    return timeout_ms;
+}
+
+// what is left of the client's time, which is all the upstream gets
+int forwardTimeout(const ClientRequest* request) {
+    uint64_t now = threadPoolNow();
+    int timeout_ms = now < request->deadline ? (int)((request->deadline - now) / 1000000) : 0;
+    if (timeout_ms > DNS_FWD_TIMEOUT_MS) {
+        return DNS_FWD_TIMEOUT_MS;
+    }
+    return timeout_ms < 1 ? 1 : timeout_ms;
+}
+
+void serveClient(void* arg);
+
+// completion callback of the forwarder; runs on its i/o thread, so it only extracts the
+// answer and resumes the request on the slow pool worker that sent it
+void handleForwardDone(int status, const uint8_t* reply, size_t len, void* user_data) {
+    ClientRequest* request = (ClientRequest*)user_data;
+    request->status = status;
+
+    if (status == DNS_FWD_OK) {
+        struct dns_packet response;
+        memset(&response, 0, sizeof(response));
+        if (dns_request_parse(&response, reply, len) == 0) {
+            handle_dns_response(&response, request->ip_address);
+            request->cache_entry = dns_createRecordSetEntry(request->domain, &response);
+            dns_packet_release(&response);
+        }
     }
 
-    buffer[valread] = '\0';
-    logMessage(context->logger, "INFO", "Received query from client %d: %s", client_socket, buffer);
-    // "buffer" contains query string (i.e. google.com)
+    if (addTaskToThreadPoolWorker(request->context->slow_pool, request->worker, serveClient, request) != 0) {
+        // queue is full; finishing here is cheap compared to dropping the client
+        serveClient(request);
+    }
+}
 
+// text commands instead of a name; returns 1 if buffer was one (and the client is answered)
+int serveCommand(ServerContext* context, int client_socket, char* buffer) {
     // Check for "trie" command
     if (strcmp(buffer, "trie") == 0) {
-        logMessage(context->logger, "INFO", "Client requested Trie visualization.");
+        LOGGER_INFO(context->logger, "Client requested Trie visualization.");
         visualizeTrie(context->root);
         char* response = "Trie visualization opened on the server.";
         send(client_socket, response, strlen(response), 0);
         close(client_socket);
+        return 1;
+    }
+
+    // Check for "pool" command
+    if (strcmp(buffer, "pool") == 0) {
+        char response[512];
+        int len = formatPoolStats("fast", context->pool, response, sizeof(response));
+        len += formatPoolStats("slow", context->slow_pool, response + len, sizeof(response) - len);
+        snprintf(response + len, sizeof(response) - len, "misses pending %d", atomic_load(&context->nr_misses));
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        return 1;
+    }
+
+    // Check for "loglevel" command: "loglevel" tells the level, "loglevel <level>" sets it for every thread
+    if (strncmp(buffer, "loglevel", 8) == 0 && (buffer[8] == '\0' || buffer[8] == ' ')) {
+        char response[64];
+        int level = buffer[8] ? parseLogLevel(buffer + 9) : getLogLevel();
+        if (level < 0) {
+            snprintf(response, sizeof(response), "Unknown log level.");
+        } else {
+            if (buffer[8]) {
+                setLogLevel(level);
+                LOGGER_INFO(context->logger, "Client set the log level to %s.", logLevelName(level));
+            }
+            snprintf(response, sizeof(response), "Log level %s.", logLevelName(getLogLevel()));
+        }
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        return 1;
+    }
+
+    // Check for "flush" command: "flush" empties the udp packet cache, "flush <name>" drops one name from it
+    if (strncmp(buffer, "flush", 5) == 0 && (buffer[5] == '\0' || buffer[5] == ' ')) {
+        const char* name = buffer[5] ? buffer + 6 : NULL;
+        int ret = 0;
+        if (context->cores) {
+            // the cores drop it themselves, between two batches
+            ret = dns_cores_invalidate(context->cores, name);
+        } else if (name) {
+            uint8_t wire[DNS_NAME_MAX];
+            struct dns_name_info info;
+            ret = dns_name_canon_dotted(name, wire, &info) == DNS_NAME_ELABEL ? -1 :
+                  dns_pcache_invalidate(context->packet_cache, wire, info.len);
+        } else {
+            dns_pcache_flush(context->packet_cache);
+        }
+        LOGGER_INFO(context->logger, "Client flushed %s from the packet cache.", name ? name : "everything");
+        char* response = ret < 0 ? "Flush failed." : "Flushed.";
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        return 1;
+    }
+
+    return 0;
+}
+
+// a client request, top to bottom. it starts on the pool, moves to the slow pool on a miss and waits
+// for the upstream there; each wait gives the worker back (CO_AWAIT) and the request carries on
+// below it when it is called again, so any number of requests can wait on a few threads
+void serveClient(void* arg) {
+    ClientRequest* request = (ClientRequest*)arg;
+    ServerContext* context = request->context;
+    int valread;
+
+    CO_BEGIN(&request->co);
+
+    LOGGER_DEBUG(context->logger, "Handling client socket: %d", request->client_socket);
+
+    // the accept loop queues a request only once its query is there, so this never waits on the client
+    valread = recv(request->client_socket, request->domain, BUFFER_SIZE - 1, MSG_DONTWAIT);
+    if (valread <= 0) {
+        LOGGER_ERROR(context->logger, "Failed to read from client socket: %d", request->client_socket);
+        close(request->client_socket);
+        endRequest(request);
+        return;
+    }
+
+    request->domain[valread] = '\0';
+    LOGGER_DEBUG(context->logger, "Received query from client %d: %s", request->client_socket, request->domain);
+    // "domain" contains query string (i.e. google.com)
+
+    if (serveCommand(context, request->client_socket, request->domain)) {
+        endRequest(request);
         return;
     }
 
     // CacheEntry object is created ONLY if the qname is found within the tree/cache
     // If retrieveValue can't find the requested domain name, it returns NULL
     // This means I need to create cache_entry at a later point
-    struct CacheEntry* cache_entry = retriveValue(context->root, buffer, context->cache);
+    request->cache_entry = retriveValue(context->root, request->domain, context->cache);
+
+    if (request->cache_entry) {
+        LOGGER_DEBUG(context->logger, "Cache/Trie hit for query %s -> %s", request->domain, request->cache_entry->record_value);
+        addCacheEntry(context->cache, request->cache_entry);
+        LOGGER_DEBUG(context->logger, "Added query result to cache: %s", request->domain);
+        sendClientResponse(context, request->client_socket, request->cache_entry);
+        endRequest(request);
+        return;
+    }
 
-    if (cache_entry) {
-        logMessage(context->logger, "INFO", "Cache/Trie hit for query %s -> %s", buffer, cache_entry->record_value);
-    } else {
-        logMessage(context->logger, "INFO", "Domain not found in local server: %s", buffer);
+    LOGGER_DEBUG(context->logger, "Domain not found in local server: %s", request->domain);
+
+    // If program enters here, it means that the requested domain name does not exist locally and must be obtained
+    // through forwarding. That is slow work: it goes on in the slow pool, which has its own threads, queue and limit
+    // on requests in flight, so however slow the upstream gets, the hits behind it here are not held up.
+    if (atomic_fetch_add(&context->nr_misses, 1) >= MAX_PENDING_MISSES) {
+        atomic_fetch_sub(&context->nr_misses, 1);
+        LOGGER_WARN(context->logger, "Too many forwarded requests pending. Dropping client socket: %d", request->client_socket);
+        sendServerBusy(request->client_socket);
+        endRequest(request);
+        return;
+    }
+    request->miss = 1;
+
+    CO_AWAIT(&request->co, addDeadlineTaskToThreadPool(context->slow_pool, serveClient, dropExpiredRequest,
+                                                       request, request->deadline));
+    if (request->co.failed) {
+        LOGGER_WARN(context->logger, "Slow pool overloaded. Dropping client socket: %d", request->client_socket);
+        sendServerBusy(request->client_socket);
+        endRequest(request);
+        return;
     }
 
-    if (cache_entry) {
-        addCacheEntry(context->cache, cache_entry);
-        logMessage(context->logger, "INFO", "Added query result to cache: %s", buffer);
-    } else {
-        // If program enters here, it means that the requested domain name does not exist locally and must be obtained
-        // through forwarding.
-        char ip_address[INET_ADDRSTR_LEN] = {0};
-        dns_query_domain(buffer, "1.1.1.1", 53, handle_dns_response, &ip_address);
-        logMessage(context->logger, "INFO", "Query for %s was successfuly forwarded.", buffer);
-        if(ip_address[0] != '\0') {
-            cache_entry = dns_createNewEntry(buffer, ip_address);
-            addCacheEntry(context->cache, cache_entry);
-            logMessage(context->logger, "INFO", "Added forwarded query result to cache: %s", ip_address);
-        } else {
-            logMessage(context->logger, "INFO", "Forwarding failed to return result.");
-        }
+    // on the slow pool now; the answer comes back to this worker
+    request->worker = currentThreadPoolWorker(context->slow_pool);
+    request->status = DNS_FWD_ERROR;
+    CO_AWAIT(&request->co, dns_forwarder_submit(context->forwarder, request->domain, DNS_TYPE_A,
+                                                forwardTimeout(request), handleForwardDone, request));
+    if (request->co.failed) {
+        LOGGER_ERROR(context->logger, "Failed to forward query for %s", request->domain);
     }
 
-    // Prepare the response
-    char* response;
-    if (cache_entry && cache_entry->record_value) {
-        response = cache_entry->record_value;
+    // the reply (or the timeout) is in request, see handleForwardDone
+    if (request->status == DNS_FWD_OK && request->cache_entry) {
+        LOGGER_DEBUG(context->logger, "Query for %s was successfuly forwarded (%d records).",
+                   request->domain, request->cache_entry->nr_records);
+        addCacheEntry(context->cache, request->cache_entry);
+        LOGGER_DEBUG(context->logger, "Added forwarded query result to cache: %s", request->ip_address);
     } else {
-        response = "Record not found";
+        LOGGER_DEBUG(context->logger, "Forwarding failed to return result.");
     }
 
-    // Send the response back to the client
-    if (send(client_socket, response, strlen(response), 0) < 0) {
-        logMessage(context->logger, "ERROR", "Failed to send response to client socket: %d", client_socket);
-    } else {
-        logMessage(context->logger, "INFO", "Sent response to client %d: %s", client_socket, response);
+    sendClientResponse(context, request->client_socket, request->cache_entry);
+    endRequest(request);
+    return;
+
+    CO_END(&request->co);
+}
+
+// one zone of the trie, read on a pool worker
+typedef struct {
+    char* domain;
+    struct TrieNode* branch;
+} ZoneLoad;
+
+void loadZone(void* arg) {
+    ZoneLoad* zone = (ZoneLoad*)arg;
+    zone->branch = createBranch(zone->domain);
+}
+
+// reading a zone file is mostly waiting for the scripts that parse it, so they all run at once
+void loadZones(ThreadPool* pool, struct TrieNode* root, char** domains, int nr_zones) {
+    ZoneLoad* zones = calloc(nr_zones, sizeof(ZoneLoad));
+    void** arguments = calloc(nr_zones, sizeof(void*));
+    if (!zones || !arguments) {
+        fprintf(stderr, "Failed to allocate the zone loads. Exiting...\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nr_zones; i++) {
+        zones[i].domain = domains[i];
+        arguments[i] = &zones[i];
     }
 
-    close(client_socket);
-    logMessage(context->logger, "INFO", "Closed connection for client socket: %d", client_socket);
+    ThreadPoolLatch loaded;
+    initThreadPoolLatch(&loaded, nr_zones);
+    for (int i = addTasksToThreadPool(pool, loadZone, arguments, nr_zones, &loaded); i < nr_zones; i++) {
+        loadZone(&zones[i]);
+        countDownThreadPoolLatch(&loaded);
+    }
+    waitThreadPoolLatch(&loaded);
+
+    for (int i = 0; i < nr_zones; i++) {
+        root->childrens[i] = zones[i].branch;
+    }
+    free(arguments);
+    free(zones);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // udp serving mode: one listener by default, or one pinned listener per cpu (--per-core), with
+    // queries steered to them by qname (--steer). --log-level sets where logging starts (info by default;
+    // the "loglevel" command changes it while running)
+    int per_core = 0;
+    int steer = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--per-core") == 0) {
+            per_core = 1;
+        } else if (strcmp(argv[i], "--steer") == 0) {
+            per_core = 1;
+            steer = 1;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc && parseLogLevel(argv[i + 1]) >= 0) {
+            setLogLevel(parseLogLevel(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [--per-core] [--steer] [--log-level debug|info|warn|error|off]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Logger* logger = initLogger("dns_server.log");
+    if (!logger) {
+        fprintf(stderr, "Failed to initialize logger. Exiting...\n");
+        return EXIT_FAILURE;
+    }
+
+    // Initialize thread pool, sized from the cpus we may use unless thread_pool.conf says otherwise
+    ThreadPoolConfig pool_config;
+    defaultThreadPoolConfig(&pool_config);
+    pool_config.work_stealing = 1;
+    loadThreadPoolConfig(&pool_config, THREAD_POOL_CONF);
+    ThreadPool* pool = initThreadPoolWithConfig(&pool_config);
+
+    // and a smaller one for forwarded misses; their answers go back to the worker that sent the query
+    ThreadPoolConfig slow_config;
+    defaultThreadPoolConfig(&slow_config);
+    slow_config.min_threads = 1;
+    slow_config.max_threads = pool_config.min_threads;
+    slow_config.queue_capacity = SLOW_POOL_QUEUE;
+    slow_config.work_stealing = 1;
+    loadThreadPoolConfig(&slow_config, SLOW_POOL_CONF);
+    ThreadPool* slow_pool = initThreadPoolWithConfig(&slow_config);
+    if (!pool || !slow_pool) {
+        LOGGER_ERROR(logger, "Failed to create thread pool");
+        if (pool) destroyThreadPool(pool);
+        if (slow_pool) destroyThreadPool(slow_pool);
+        destroyLogger(logger);
+        return EXIT_FAILURE;
+    }
+
     // Initialize the trie
     struct TrieNode* root = createTrieROOT();
-    // Populate trie with domain data
+    // Populate trie with domain data, one zone per task
     char** domains = getArrayOfDomainNames();
     int nr_branches = getNrBranches();
-    for (int i = 0; i < nr_branches; i++) {
-        struct TrieNode* branch = createBranch(domains[i]);
-        root->childrens[i] = branch;
-    }
+    loadZones(pool, root, domains, nr_branches);
+    buildNameIndex(root);
 
-    printf("Trie Structure:\n");
-    printTrie(root, 0);
+    if (LOG_ON(LOG_LEVEL_DEBUG)) {
+        printf("Trie Structure:\n");
+        printTrie(root, 0);
+    }
 
     // Initialize cache
     struct DNSCache* cache = initializeDNSCache();
 
-    Logger* logger = initLogger("dns_server.log");
-    if (!logger) {
-        fprintf(stderr, "Failed to initialize logger. Exiting...\n");
+    // Upstream servers used for forwarding; fall back to a public resolver if none are configured
+    struct dns_upstream_pool upstreams;
+    dns_upstream_pool_init(&upstreams);
+    if (dns_upstream_pool_load(&upstreams, DNS_UPSTREAM_CONF) <= 0) {
+        dns_upstream_pool_add(&upstreams, DNS_UPSTREAM_DEFAULT_IP, DNS_UPSTREAM_DEFAULT_PORT);
+    }
+    dns_upstream_print(&upstreams);
+
+    // Start the forwarding engine used for cache misses
+    struct dns_forwarder* forwarder = dns_forwarder_create(FORWARD_SOCKETS, &upstreams);
+    if (!forwarder) {
+        fprintf(stderr, "Failed to initialize forwarder. Exiting...\n");
         return EXIT_FAILURE;
     }
 
-    // Create shared server context
-    ServerContext context = { .root = root, .cache = cache, .logger = logger };
+    // Serve regular dns clients over udp: names in our zones are answered from the trie, the rest are
+    // relayed upstream and the replies kept in a packet cache. per core, every cpu has its own listener
+    // and cache shard instead (see dns_cores.h)
+    struct dns_pcache packet_cache;
+    dns_pcache_init(&packet_cache);
+    struct dns_relay relay = { .forwarder = forwarder, .cache = &packet_cache, .zones = root };
+    struct dns_server_ctx udp_server;
+    dns_server_ctx_init(&udp_server);
+    struct dns_cores udp_cores;
+    if (per_core) {
+        if (dns_cores_start(&udp_cores, DNS_UDP_PORT, forwarder, root, steer) != 0) {
+            LOGGER_ERROR(logger, "Failed to start the per-core udp listeners on port %d", DNS_UDP_PORT);
+            per_core = 0;
+        }
+    } else {
+        struct dns_endpoint* udp_listener = dns_server_add_batch_listener(&udp_server, DNS_UDP_PORT, dns_relay_query_batch, &relay);
+        if (udp_listener) {
+            dns_endpoint_set_cache(udp_listener, &packet_cache);
+        } else {
+            LOGGER_ERROR(logger, "Failed to start the udp listener on port %d", DNS_UDP_PORT);
+        }
+    }
+    // clients that got an answer with TC set ask again over tcp, on the same port
+    if (!dns_server_add_tcp_listener(&udp_server, DNS_UDP_PORT, dns_relay_query, &relay)) {
+        LOGGER_ERROR(logger, "Failed to start the tcp listener on port %d", DNS_UDP_PORT);
+    }
 
-    // Initialize thread pool
-    ThreadPool* pool = initThreadPool(5);
-    logMessage(logger, "INFO", "DNS server initialized. Listening on port %d", PORT);
+    // Create shared server context
+    ServerContext context = { .root = root, .cache = cache, .logger = logger,
+                              .pool = pool, .slow_pool = slow_pool, .forwarder = forwarder,
+                              .packet_cache = &packet_cache, .cores = per_core ? &udp_cores : NULL };
+    LOGGER_INFO(logger, "DNS server initialized. Listening on port %d", PORT);
 
     // prepare signal handling for ctrl+c
     struct sigaction sa = {
@@ -204,7 +554,7 @@ int main() {
     int addrlen = sizeof(address);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        logMessage(logger, "ERROR", "Socket creation failed");
+        LOGGER_ERROR(logger, "Socket creation failed");
         perror("Socket failed");
         return EXIT_FAILURE;
     }
@@ -214,57 +564,125 @@ int main() {
     address.sin_port = htons(PORT);
 
     if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        logMessage(logger, "ERROR", "Bind failed");
+        LOGGER_ERROR(logger, "Bind failed");
         perror("Bind failed");
         close(server_fd);
         return EXIT_FAILURE;
     }
 
     if (listen(server_fd, 3) < 0) {
-        logMessage(logger, "ERROR", "Listen failed");
+        LOGGER_ERROR(logger, "Listen failed");
         perror("Listen failed");
         close(server_fd);
         return EXIT_FAILURE;
     }
 
-    logMessage(logger, "INFO", "Server is listening on port %d", PORT);
+    LOGGER_INFO(logger, "Server is listening on port %d", PORT);
     signal(SIGINT, handle_sigint);
 
+    // a client's query is read on a worker, but only once it has arrived: until then the connection
+    // waits here, in poll(), so clients that connect and say nothing can't hold up the pool. waiting[0]
+    // is the listening socket, waiting[i] belongs to waiting_requests[i - 1]
+    struct pollfd waiting[1 + MAX_WAITING_CLIENTS];
+    ClientRequest* waiting_requests[MAX_WAITING_CLIENTS];
+    int nr_waiting = 0;
+    waiting[0].fd = server_fd;
+    waiting[0].events = POLLIN;
+
     while (server_running) {
+        if (poll(waiting, 1 + nr_waiting, waitingTimeout(waiting_requests, nr_waiting)) < 0) {
+            if (errno != EINTR) {
+                LOGGER_ERROR(logger, "Poll failed");
+                perror("Poll failed");
+            }
+            continue;
+        }
+
+        // queries that arrived go to the pool, clients out of time are closed; the last entry takes
+        // the place of one that leaves
+        uint64_t now = threadPoolNow();
+        for (int i = nr_waiting - 1; i >= 0; i--) {
+            ClientRequest* request = waiting_requests[i];
+            if (waiting[1 + i].revents) {
+                // when the queue is full or has been slow for too long the client is told so right away
+                // instead of waiting for an answer that would come too late
+                if (addDeadlineTaskToThreadPool(pool, serveClient, dropExpiredRequest, request, request->deadline) != 0) {
+                    LOGGER_WARN(logger, "Thread pool overloaded. Dropping connection for client socket: %d", request->client_socket);
+                    sendServerBusy(request->client_socket);
+                    endRequest(request);
+                }
+            } else if (now >= request->deadline) {
+                LOGGER_DEBUG(logger, "Client socket %d sent no query in time", request->client_socket);
+                dropExpiredRequest(request);
+            } else {
+                continue;
+            }
+            nr_waiting--;
+            waiting[1 + i] = waiting[1 + nr_waiting];
+            waiting_requests[i] = waiting_requests[nr_waiting];
+        }
+
+        if (!(waiting[0].revents & POLLIN)) {
+            continue;
+        }
         int new_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
         if (new_socket < 0) {
-            logMessage(logger, "ERROR", "Accept failed");
+            LOGGER_ERROR(logger, "Accept failed");
             perror("Accept failed");
             continue;
         }
 
-        logMessage(logger, "INFO", "Accepted connection from client socket: %d", new_socket);
+        LOGGER_DEBUG(logger, "Accepted connection from client socket: %d", new_socket);
+        if (nr_waiting == MAX_WAITING_CLIENTS) {
+            LOGGER_WARN(logger, "Too many clients waiting to send their query. Dropping client socket: %d", new_socket);
+            sendServerBusy(new_socket);
+            continue;
+        }
 
-        // Allocate memory for the ClientTask
-        ClientTask* task = malloc(sizeof(ClientTask));
-        if (task == NULL) {
-            logMessage(logger, "ERROR", "Failed to allocate memory for client task");
+        // Allocate memory for the ClientRequest
+        ClientRequest* request = calloc(1, sizeof(ClientRequest));
+        if (request == NULL) {
+            LOGGER_ERROR(logger, "Failed to allocate memory for client request");
             close(new_socket);
             continue;
         }
 
-        task->client_socket = new_socket;
-        task->context = &context; // Pass the shared ServerContext
+        CO_INIT(&request->co);
+        request->client_socket = new_socket;
+        request->context = &context; // Pass the shared ServerContext
+        request->deadline = threadPoolNow() + (uint64_t)CLIENT_DEADLINE_MS * 1000000;
+        request->worker = -1;
+        atomic_fetch_add(&context.nr_requests, 1);
 
-        // Add the task to the thread pool
-        if (addTaskToThreadPool(pool, handleClient, task) != 0) {
-            logMessage(logger, "ERROR", "Thread pool queue is full. Dropping connection for client socket: %d", new_socket);
-            close(new_socket);
-            free(task);
-        }
+        waiting[1 + nr_waiting].fd = new_socket;
+        waiting[1 + nr_waiting].events = POLLIN;
+        waiting_requests[nr_waiting++] = request;
     }
 
-    // Cleanup
-    logMessage(logger, "INFO", "Shutting down DNS server");
-    destroyLogger(logger);
+    // clients still waiting for their query to arrive get no answer now
+    for (int i = 0; i < nr_waiting; i++) {
+        dropExpiredRequest(waiting_requests[i]);
+    }
+
+    // Cleanup: take no more clients and let the ones accepted finish before anything they use goes
+    LOGGER_INFO(logger, "Shutting down DNS server");
+    close(server_fd);
+    drainRequests(&context);
+    dns_server_stop(&udp_server);
+    if (per_core) {
+        dns_cores_stop(&udp_cores);
+    }
+    dns_forwarder_destroy(forwarder);
+    dns_server_ctx_destroy(&udp_server);
+    dns_pcache_destroy(&packet_cache);
+    if (per_core) {
+        dns_cores_destroy(&udp_cores);
+    }
+    dns_upstream_pool_destroy(&upstreams);
     destroyThreadPool(pool);
+    destroyThreadPool(slow_pool);
+    destroyLogger(logger);
     free(root);
     free(cache);
-    close(server_fd);
     return 0;
 }
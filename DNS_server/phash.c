@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include "phash.h"
+#include "dns_name.h"
+
+// a key during the build: its hash under the current seed and where it came from
+typedef struct PhashKey{
+    uint64_t hash;
+    size_t bucket;
+    size_t entry;
+}PhashKey;
+
+static uint64_t phashHash(const uint8_t* key, size_t len, uint64_t seed)
+{
+    return dns_name_hash_bytes(key, len, seed);
+}
+
+// maps x onto [0, n) without a division
+static size_t phashRange(uint64_t x, size_t n)
+{
+    return (size_t)(((__uint128_t)x * n) >> 64);
+}
+
+// the pilot is mixed in before the final multiply: xoring it into the bits phashRange() keeps would
+// move every key of a bucket by the same pattern, so two keys that collide once would always collide
+static size_t phashSlot(uint64_t hash, uint32_t pilot, size_t nr_slots)
+{
+    uint64_t slot = hash ^ ((pilot + 1) * 0xD6E8FEB86659FD93ULL);
+    slot ^= slot >> 32;
+    slot *= 0x9E3779B97F4A7C15ULL;
+    return phashRange(slot ^ (slot >> 29), nr_slots);
+}
+
+static int compareKeys(const void* a, const void* b)
+{
+    const struct PhashKey* x = (const struct PhashKey*)a;
+    const struct PhashKey* y = (const struct PhashKey*)b;
+    if (x->bucket != y->bucket) {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return 0;
+}
+
+// a run of keys sharing a bucket, placed largest first
+typedef struct PhashBucket{
+    size_t bucket;
+    size_t first; // index in the sorted keys
+    size_t size;
+}PhashBucket;
+
+static int compareBuckets(const void* a, const void* b)
+{
+    const struct PhashBucket* x = (const struct PhashBucket*)a;
+    const struct PhashBucket* y = (const struct PhashBucket*)b;
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    return x->bucket < y->bucket ? -1 : (x->bucket > y->bucket);
+}
+
+// hashes, sorts and places every key under seed; fills hash->pilots and owner (slot -> entry).
+// returns 0, or -1 when a bucket can't be placed and another seed has to be tried
+static int placeKeys(struct PerfectHash* hash, const struct PerfectHashEntry* entries, struct PhashKey* keys,
+                     size_t nr_keys, struct PhashBucket* buckets, size_t* owner, uint8_t* taken)
+{
+    for (size_t i = 0; i < nr_keys; i++) {
+        const struct PerfectHashEntry* entry = &entries[keys[i].entry];
+        keys[i].hash = phashHash(entry->key, entry->len, hash->seed);
+        keys[i].bucket = phashRange(keys[i].hash, hash->nr_buckets);
+    }
+    qsort(keys, nr_keys, sizeof(struct PhashKey), compareKeys);
+
+    size_t nr_runs = 0;
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (i > 0 && keys[i].bucket == keys[i - 1].bucket) {
+            // the same hash twice in one bucket can never be split
+            if (keys[i].hash == keys[i - 1].hash) {
+                return -1;
+            }
+            buckets[nr_runs - 1].size++;
+            continue;
+        }
+        buckets[nr_runs].bucket = keys[i].bucket;
+        buckets[nr_runs].first = i;
+        buckets[nr_runs].size = 1;
+        nr_runs++;
+    }
+    qsort(buckets, nr_runs, sizeof(struct PhashBucket), compareBuckets);
+
+    memset(taken, 0, hash->nr_slots);
+    memset(hash->pilots, 0, hash->nr_buckets * sizeof(uint32_t));
+    for (size_t b = 0; b < nr_runs; b++) {
+        const struct PhashBucket* run = &buckets[b];
+        const struct PhashKey* run_keys = keys + run->first;
+        uint32_t pilot;
+
+        for (pilot = 0; pilot < PHASH_MAX_PILOT; pilot++) {
+            size_t i;
+            for (i = 0; i < run->size; i++) {
+                size_t slot = phashSlot(run_keys[i].hash, pilot, hash->nr_slots);
+                if (taken[slot]) {
+                    break;
+                }
+                taken[slot] = 1;
+            }
+            if (i == run->size) {
+                break;
+            }
+            // undo this try
+            while (i-- > 0) {
+                taken[phashSlot(run_keys[i].hash, pilot, hash->nr_slots)] = 0;
+            }
+        }
+        if (pilot == PHASH_MAX_PILOT) {
+            return -1;
+        }
+
+        hash->pilots[run->bucket] = pilot;
+        for (size_t i = 0; i < run->size; i++) {
+            owner[phashSlot(run_keys[i].hash, pilot, hash->nr_slots)] = run_keys[i].entry;
+        }
+    }
+    return 0;
+}
+
+// indices of the entries whose key wasn't given before; returns how many there are
+static size_t uniqueEntries(const struct PerfectHashEntry* entries, size_t nr_entries, struct PhashKey* keys)
+{
+    for (size_t i = 0; i < nr_entries; i++) {
+        keys[i].hash = phashHash(entries[i].key, entries[i].len, 0);
+        keys[i].bucket = 0;
+        keys[i].entry = i;
+    }
+    qsort(keys, nr_entries, sizeof(struct PhashKey), compareKeys);
+
+    size_t nr_unique = 0;
+    for (size_t i = 0; i < nr_entries; i++) {
+        const struct PerfectHashEntry* entry = &entries[keys[i].entry];
+        int duplicate = 0;
+        for (size_t j = nr_unique; j > 0 && keys[j - 1].hash == keys[i].hash; j--) {
+            const struct PerfectHashEntry* kept = &entries[keys[j - 1].entry];
+            if (kept->len == entry->len && memcmp(kept->key, entry->key, entry->len) == 0) {
+                duplicate = 1;
+                break;
+            }
+        }
+        if (!duplicate) {
+            keys[nr_unique++] = keys[i];
+        }
+    }
+    return nr_unique;
+}
+
+struct PerfectHash* createPerfectHash(const struct PerfectHashEntry* entries, size_t nr_entries)
+{
+    struct PerfectHash* hash = (struct PerfectHash*)calloc(1, sizeof(struct PerfectHash));
+    struct PhashKey* keys = (struct PhashKey*)malloc((nr_entries + 1) * sizeof(struct PhashKey));
+    if (hash == NULL || keys == NULL) {
+        free(hash);
+        free(keys);
+        return NULL;
+    }
+
+    size_t nr_keys = uniqueEntries(entries, nr_entries, keys);
+    hash->nr_slots = nr_keys ? nr_keys : 1;
+    hash->nr_buckets = nr_keys / PHASH_BUCKET_SIZE + 1;
+
+    size_t arena_size = 0;
+    for (size_t i = 0; i < nr_keys; i++) {
+        arena_size += entries[keys[i].entry].len;
+    }
+
+    struct PhashBucket* buckets = (struct PhashBucket*)malloc((nr_keys + 1) * sizeof(struct PhashBucket));
+    size_t* owner = (size_t*)malloc(hash->nr_slots * sizeof(size_t));
+    uint8_t* taken = (uint8_t*)malloc(hash->nr_slots);
+    hash->pilots = (uint32_t*)malloc(hash->nr_buckets * sizeof(uint32_t));
+    hash->slots = (struct PerfectHashEntry*)calloc(hash->nr_slots, sizeof(struct PerfectHashEntry));
+    hash->arena = (uint8_t*)malloc(arena_size + 1);
+
+    int placed = -1;
+    if (buckets && owner && taken && hash->pilots && hash->slots && hash->arena) {
+        for (uint64_t seed = 0; seed < PHASH_MAX_SEEDS && placed < 0; seed++) {
+            hash->seed = seed * 0x2545F4914F6CDD1DULL;
+            placed = placeKeys(hash, entries, keys, nr_keys, buckets, owner, taken);
+        }
+    }
+
+    if (placed == 0) {
+        uint8_t* arena = hash->arena;
+        for (size_t slot = 0; slot < nr_keys; slot++) {
+            const struct PerfectHashEntry* entry = &entries[owner[slot]];
+            memcpy(arena, entry->key, entry->len);
+            hash->slots[slot].key = arena;
+            hash->slots[slot].len = entry->len;
+            hash->slots[slot].value = entry->value;
+            arena += entry->len;
+        }
+    }
+
+    free(keys);
+    free(buckets);
+    free(owner);
+    free(taken);
+    if (placed != 0) {
+        destroyPerfectHash(hash);
+        return NULL;
+    }
+    return hash;
+}
+
+void destroyPerfectHash(struct PerfectHash* hash)
+{
+    if (hash) {
+        free(hash->pilots);
+        free(hash->slots);
+        free(hash->arena);
+        free(hash);
+    }
+}
+
+// keys outside the set land on some slot too; only the compare tells them apart
+static void* phashMatch(const struct PerfectHashEntry* slot, const uint8_t* key, size_t len)
+{
+    if (slot->len != len || memcmp(slot->key, key, len) != 0) {
+        return NULL;
+    }
+    return slot->value;
+}
+
+void* perfectHashLookup(const struct PerfectHash* hash, const uint8_t* key, size_t len)
+{
+    uint64_t h = phashHash(key, len, hash->seed);
+    uint32_t pilot = hash->pilots[phashRange(h, hash->nr_buckets)];
+    return phashMatch(&hash->slots[phashSlot(h, pilot, hash->nr_slots)], key, len);
+}
+
+void perfectHashLookupBatch(const struct PerfectHash* hash, const uint8_t* const* keys, const size_t* lens,
+                            size_t n, void** values)
+{
+    uint64_t hashes[PHASH_LOOKUP_GROUP];
+    const struct PerfectHashEntry* slots[PHASH_LOOKUP_GROUP];
+
+    for (size_t first = 0; first < n; first += PHASH_LOOKUP_GROUP) {
+        size_t group = n - first < PHASH_LOOKUP_GROUP ? n - first : PHASH_LOOKUP_GROUP;
+
+        for (size_t i = 0; i < group; i++) {
+            hashes[i] = phashHash(keys[first + i], lens[first + i], hash->seed);
+            __builtin_prefetch(&hash->pilots[phashRange(hashes[i], hash->nr_buckets)]);
+        }
+        for (size_t i = 0; i < group; i++) {
+            uint32_t pilot = hash->pilots[phashRange(hashes[i], hash->nr_buckets)];
+            slots[i] = &hash->slots[phashSlot(hashes[i], pilot, hash->nr_slots)];
+            __builtin_prefetch(slots[i]);
+        }
+        for (size_t i = 0; i < group; i++) {
+            __builtin_prefetch(slots[i]->key);
+        }
+        for (size_t i = 0; i < group; i++) {
+            values[first + i] = phashMatch(slots[i], keys[first + i], lens[first + i]);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// minimal perfect hash ("hash and displace", as in CHD/PTHash) over a fixed set of byte-string keys.
+// keys are spread over buckets of about PHASH_BUCKET_SIZE; every bucket gets a pilot value that
+// moves all its keys into free slots, so n keys fill exactly n slots. a lookup is one hash, one
+// pilot read and one slot compare, whatever the number of keys. the set can't change after the
+// build: build a new one instead.
+#define PHASH_BUCKET_SIZE 4
+#define PHASH_MAX_PILOT (1u << 24)   // tries per bucket before giving up on a seed
+#define PHASH_MAX_SEEDS 16
+#define PHASH_LOOKUP_GROUP 16        // keys perfectHashLookupBatch() keeps in flight together
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct PerfectHashEntry{
+    const uint8_t* key;
+    size_t len;
+    void* value;
+}PerfectHashEntry;
+
+typedef struct PerfectHash{
+    uint64_t seed;
+    size_t nr_slots;   // == number of keys
+    size_t nr_buckets;
+    uint32_t* pilots;  // one per bucket
+    struct PerfectHashEntry* slots; // keys point into arena
+    uint8_t* arena;
+}PerfectHash;
+
+// keys are copied; a key given twice is kept once. returns NULL if no seed works (or out of memory)
+struct PerfectHash* createPerfectHash(const struct PerfectHashEntry* entries, size_t nr_entries);
+void destroyPerfectHash(struct PerfectHash* hash);
+// value stored for key, NULL if key is not in the set
+void* perfectHashLookup(const struct PerfectHash* hash, const uint8_t* key, size_t len);
+// the same for n keys at once: each step (pilot, slot, key bytes) is prefetched for a whole group
+// before any of them is read, so the cache misses of the group overlap instead of adding up
+void perfectHashLookupBatch(const struct PerfectHash* hash, const uint8_t* const* keys, const size_t* lens,
+                            size_t n, void** values);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
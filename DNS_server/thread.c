@@ -1,97 +1,779 @@
+#define _GNU_SOURCE  // sched_getaffinity, CPU_COUNT
 #include "thread.h"
+#include "logger.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-// Worker thread function
-void* threadWorker(void* threadpool) {
-    ThreadPool* pool = (ThreadPool*)threadpool;
+// the worker the calling thread is, NULL outside of pools in work-stealing mode
+static __thread ThreadPoolWorker* current_worker = NULL;
+
+static uint64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// returns 0 when woken (or *word was no longer expected: a wake between the check and the call is
+// not lost), -1 once timeout_ms (0 = none) passed
+static int futexWait(atomic_uint* word, unsigned int expected, int timeout_ms) {
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    long ret = syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout_ms > 0 ? &timeout : NULL, NULL, 0);
+    return ret < 0 && errno == ETIMEDOUT ? -1 : 0;
+}
+
+static void futexWake(atomic_uint* word, int nr_waiters) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, nr_waiters, NULL, NULL, 0);
+}
+
+static int initTaskRing(TaskRing* ring, size_t capacity) {
+    ring->capacity = 2;
+    while (ring->capacity < capacity) {
+        ring->capacity <<= 1;
+    }
+    ring->mask = ring->capacity - 1;
+    ring->cells = (ThreadPoolCell*)malloc(ring->capacity * sizeof(ThreadPoolCell));
+    if (ring->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < ring->capacity; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+    }
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return 0;
+}
+
+// claim the next free cell and put the task in it; -1 if the ring is full
+static int enqueueTask(TaskRing* ring, ThreadPoolTask task) {
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
 
     while (1) {
-        pthread_mutex_lock(&(pool->lock));
+        ThreadPoolCell* cell = &ring->cells[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
 
-        // Wait for tasks
-        while (pool->queue_size == 0 && !pool->stop) { //daca coasa este goala si thread pool-ul este inca activ
-            printf("Worker waiting for tasks.\n");
-            pthread_cond_wait(&(pool->notify), &(pool->lock)); //isi da sleep pana cand primeste variabila de conditie 
+        if (diff == 0) {
+            // the cell is free for this position; take the position if nobody else did
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->task = task;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // the cell still holds a task from the previous lap
+        } else {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
         }
+    }
+}
+
+// take the oldest task; -1 if the ring is empty
+static int dequeueTask(TaskRing* ring, ThreadPoolTask* task) {
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+
+    while (1) {
+        ThreadPoolCell* cell = &ring->cells[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
 
-        if (pool->stop) {
-            pthread_mutex_unlock(&(pool->lock));
-            printf("Worker stopping.\n");
-            pthread_exit(NULL);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *task = cell->task;
+                // free the cell for the producer one lap ahead
+                atomic_store_explicit(&cell->sequence, pos + ring->capacity, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // nothing was put here yet
+        } else {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
         }
+    }
+}
+
+/* Chase-Lev deque, with the memory orders of Le et al., "Correct and Efficient Work-Stealing for
+   Weak Memory Models". it never grows: a full deque sends the task to the shared queue instead */
+
+// owner only; -1 if the deque is full
+static int pushDeque(ThreadPoolDeque* deque, ThreadPoolTask task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= THREAD_DEQUE_SIZE) {
+        return -1;
+    }
+    ThreadPoolDequeCell* cell = &deque->tasks[bottom & (THREAD_DEQUE_SIZE - 1)];
+    atomic_store_explicit(&cell->function, task.function, memory_order_relaxed);
+    atomic_store_explicit(&cell->argument, task.argument, memory_order_relaxed);
+    atomic_store_explicit(&cell->queued_at, task.queued_at, memory_order_relaxed);
+    atomic_store_explicit(&cell->expired, task.expired, memory_order_relaxed);
+    atomic_store_explicit(&cell->deadline, task.deadline, memory_order_relaxed);
+    atomic_store_explicit(&cell->latch, task.latch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
 
-        // Fetch task 
-        ThreadPoolTask task = pool->task_queue[pool->queue_front]; //ia primul task disponibil din coada 
-        pool->queue_front = (pool->queue_front + 1) % MAX_QUEUE; //update (fucntioneaza ca o coada circulara)
-        pool->queue_size--;
+// owner only: the newest task; -1 if the deque is empty (or a thief got the last one)
+static int popDeque(ThreadPoolDeque* deque, ThreadPoolTask* task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
 
-        printf("Worker fetched a task. Queue size: %d\n", pool->queue_size);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return -1;
+    }
+    ThreadPoolDequeCell* cell = &deque->tasks[bottom & (THREAD_DEQUE_SIZE - 1)];
+    task->function = atomic_load_explicit(&cell->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&cell->argument, memory_order_relaxed);
+    task->queued_at = atomic_load_explicit(&cell->queued_at, memory_order_relaxed);
+    task->expired = atomic_load_explicit(&cell->expired, memory_order_relaxed);
+    task->deadline = atomic_load_explicit(&cell->deadline, memory_order_relaxed);
+    task->latch = atomic_load_explicit(&cell->latch, memory_order_relaxed);
+    if (top == bottom) {
+        // the last task: race the thieves for it
+        int won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                          memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
 
-        pthread_mutex_unlock(&(pool->lock));
+// any thread: the oldest task; -1 if the deque is empty or another thief was faster
+static int stealDeque(ThreadPoolDeque* deque, ThreadPoolTask* task) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
 
-        // Execute the task
-        printf("Worker executing task.\n");
-        (*(task.function))(task.argument);
+    if (top >= bottom) {
+        return -1;
     }
+    ThreadPoolDequeCell* cell = &deque->tasks[top & (THREAD_DEQUE_SIZE - 1)];
+    task->function = atomic_load_explicit(&cell->function, memory_order_relaxed);
+    task->argument = atomic_load_explicit(&cell->argument, memory_order_relaxed);
+    task->queued_at = atomic_load_explicit(&cell->queued_at, memory_order_relaxed);
+    task->expired = atomic_load_explicit(&cell->expired, memory_order_relaxed);
+    task->deadline = atomic_load_explicit(&cell->deadline, memory_order_relaxed);
+    task->latch = atomic_load_explicit(&cell->latch, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return -1;
+    }
+    return 0;
 }
 
-// Initialize the thread pool
-ThreadPool* initThreadPool(int thread_count) {
-    ThreadPool* pool = (ThreadPool*)malloc(sizeof(ThreadPool));
+// the next task for worker: its own deque and inbox in work-stealing mode, the shared queue, then
+// the other slots' deques and inboxes (also of threads that left), starting at a random one
+static int findTask(ThreadPool* pool, ThreadPoolWorker* worker, ThreadPoolTask* task) {
+    if (!pool->config.work_stealing) {
+        return dequeueTask(&pool->queue, task);
+    }
+    if (popDeque(&worker->deque, task) == 0 || dequeueTask(&worker->inbox, task) == 0 ||
+        dequeueTask(&pool->queue, task) == 0) {
+        return 0;
+    }
 
-    pool->queue_size = 0;
-    pool->queue_front = 0;
-    pool->queue_rear = 0;
-    pool->stop = 0;
+    int nr_slots = pool->config.max_threads;
+    worker->steal_seed ^= worker->steal_seed << 13;
+    worker->steal_seed ^= worker->steal_seed >> 17;
+    worker->steal_seed ^= worker->steal_seed << 5;
+    int first = worker->steal_seed % nr_slots;
+    for (int i = 0; i < nr_slots; i++) {
+        ThreadPoolWorker* victim = &pool->workers[(first + i) % nr_slots];
+        if (victim == worker) {
+            continue;
+        }
+        if (stealDeque(&victim->deque, task) == 0 || dequeueTask(&victim->inbox, task) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    pthread_mutex_init(&(pool->lock), NULL);
-    pthread_cond_init(&(pool->notify), NULL);
+static void* threadWorker(void* arg);
 
-    for (int i = 0; i < thread_count; i++) {
-        if (pthread_create(&(pool->threads[i]), NULL, threadWorker, (void*)pool) != 0) {
+// start a thread in the first slot without one; caller holds resize_lock
+static int startWorker(ThreadPool* pool) {
+    for (int i = 0; i < pool->config.max_threads; i++) {
+        ThreadPoolWorker* worker = &pool->workers[i];
+        int state = atomic_load(&worker->state);
+        if (state == THREAD_SLOT_RUNNING) {
+            continue;
+        }
+        if (state == THREAD_SLOT_EXITED) {
+            pthread_join(worker->thread, NULL);
+        }
+        atomic_store(&worker->state, THREAD_SLOT_RUNNING);
+        atomic_fetch_add(&pool->nr_threads, 1);
+        if (pthread_create(&worker->thread, NULL, threadWorker, (void*)worker) != 0) {
             perror("Failed to create worker thread");
+            atomic_store(&worker->state, THREAD_SLOT_FREE);
+            atomic_fetch_sub(&pool->nr_threads, 1);
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// one more thread, unless the pool is at max_threads or grew a moment ago. never blocks: if
+// another thread is resizing, that one will do
+static void growThreadPool(ThreadPool* pool) {
+    uint64_t now = nowNs();
+    if (atomic_load(&pool->nr_threads) >= pool->config.max_threads ||
+        now - atomic_load(&pool->last_resize_ns) < THREAD_POOL_RESIZE_INTERVAL_MS * 1000000ull) {
+        return;
+    }
+    if (pthread_mutex_trylock(&pool->resize_lock) != 0) {
+        return;
+    }
+    if (!atomic_load(&pool->stop) && atomic_load(&pool->nr_threads) < pool->config.max_threads &&
+        now - atomic_load(&pool->last_resize_ns) >= THREAD_POOL_RESIZE_INTERVAL_MS * 1000000ull) {
+        if (startWorker(pool) == 0) {
+            atomic_store(&pool->last_resize_ns, now);
+            LOG_INFO("Thread pool grew to %d threads.\n", atomic_load(&pool->nr_threads));
+        }
+    }
+    pthread_mutex_unlock(&pool->resize_lock);
+}
+
+// leave the pool if it is above min_threads; returns 1 if the calling worker has to exit
+static int retireWorker(ThreadPool* pool, ThreadPoolWorker* worker) {
+    int nr_threads = atomic_load(&pool->nr_threads);
+    while (nr_threads > pool->config.min_threads) {
+        if (atomic_compare_exchange_weak(&pool->nr_threads, &nr_threads, nr_threads - 1)) {
+            // joined when the slot is reused or the pool is destroyed
+            atomic_store(&worker->state, THREAD_SLOT_EXITED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// wake a parked worker for each of nr_tasks tasks, as far as there are any, with one futex call;
+// called after the tasks were made visible. when nobody is idle and the shared queue holds more tasks
+// than there are threads, the pool grows instead
+static void wakeWorkers(ThreadPool* pool, int nr_tasks) {
+    // pairs with the worker's announce-then-look-again: either it sees the task or we see it asleep
+    atomic_thread_fence(memory_order_seq_cst);
+    int nr_sleeping = atomic_load(&pool->nr_sleeping);
+    if (nr_sleeping > 0) {
+        atomic_fetch_add(&pool->wake_seq, 1);
+        futexWake(&pool->wake_seq, nr_tasks < nr_sleeping ? nr_tasks : nr_sleeping);
+        return;
+    }
+    if (pool->config.max_threads > pool->config.min_threads) {
+        size_t queued = atomic_load_explicit(&pool->queue.enqueue_pos, memory_order_relaxed) -
+                        atomic_load_explicit(&pool->queue.dequeue_pos, memory_order_relaxed);
+        if (queued > (size_t)atomic_load(&pool->nr_threads)) {
+            growThreadPool(pool);
+        }
+    }
+}
+
+// CoDel's test on the queue delay of every task taken: it is overload only when the delay stayed
+// above target for a whole interval, so a short burst that drains quickly is still admitted. each
+// field is written only when it changes, not per task
+static void controlDelay(ThreadPool* pool, uint64_t wait, uint64_t now) {
+    if (pool->config.target_delay_us == 0) {
+        return;
+    }
+    uint64_t interval = (uint64_t)pool->config.delay_interval_ms * 1000000;
+    if (wait < (uint64_t)pool->config.target_delay_us * 1000) {
+        if (atomic_load_explicit(&pool->over_target_until, memory_order_relaxed) != 0) {
+            atomic_store(&pool->over_target_until, 0);
+        }
+        if (atomic_load_explicit(&pool->overloaded, memory_order_relaxed)) {
+            atomic_store(&pool->overloaded, 0);
+            atomic_store(&pool->overload_left_at, now);
+        }
+        return;
+    }
+
+    uint64_t until = atomic_load_explicit(&pool->over_target_until, memory_order_relaxed);
+    if (until == 0) {
+        // like CoDel, an overload that ended less than an interval ago is taken up again at once: the
+        // backlog that built up while it waited a whole interval would outlive short deadlines
+        int recent = now - atomic_load_explicit(&pool->overload_left_at, memory_order_relaxed) < interval;
+        atomic_compare_exchange_strong(&pool->over_target_until, &until, recent ? now : now + interval);
+    } else if (now >= until && !atomic_load_explicit(&pool->overloaded, memory_order_relaxed)) {
+        atomic_store(&pool->overloaded, 1);
+    }
+}
+
+// run a task and account for it; a task that waited too long asks for another thread, one whose
+// deadline passed is dropped before it does any work
+static void runTask(ThreadPool* pool, ThreadPoolWorker* worker, ThreadPoolTask* task) {
+    uint64_t start = nowNs();
+    uint64_t wait = start > task->queued_at ? start - task->queued_at : 0;
+
+    controlDelay(pool, wait, start);
+    if (task->deadline != 0 && start > task->deadline) {
+        if (task->expired) {
+            (*(task->expired))(task->argument);
+        }
+        atomic_store_explicit(&worker->nr_expired, atomic_load_explicit(&worker->nr_expired, memory_order_relaxed) + 1, memory_order_relaxed);
+        if (task->latch) {
+            countDownThreadPoolLatch(task->latch);
+        }
+        return;
+    }
+
+    (*(task->function))(task->argument);
+    if (task->latch) {
+        countDownThreadPoolLatch(task->latch);
+    }
+
+    // only this worker writes its counters; they are atomics so getThreadPoolStats() can read them
+    atomic_store_explicit(&worker->busy_ns, atomic_load_explicit(&worker->busy_ns, memory_order_relaxed) + nowNs() - start, memory_order_relaxed);
+    atomic_store_explicit(&worker->wait_ns, atomic_load_explicit(&worker->wait_ns, memory_order_relaxed) + wait, memory_order_relaxed);
+    atomic_store_explicit(&worker->nr_tasks, atomic_load_explicit(&worker->nr_tasks, memory_order_relaxed) + 1, memory_order_relaxed);
+
+    if (wait > (uint64_t)pool->config.grow_wait_us * 1000 && atomic_load(&pool->nr_sleeping) == 0) {
+        growThreadPool(pool);
+    }
+}
+
+// Worker thread function
+static void* threadWorker(void* arg) {
+    ThreadPoolWorker* worker = (ThreadPoolWorker*)arg;
+    ThreadPool* pool = worker->pool;
+    ThreadPoolTask task;
+    // a fixed-size pool never shrinks, so its workers sleep without a timeout
+    int idle_timeout_ms = pool->config.max_threads > pool->config.min_threads ? pool->config.idle_shrink_ms : 0;
+
+    current_worker = worker;
+    while (1) {
+        if (atomic_load(&pool->stop)) {
+            LOG_DEBUG("Worker stopping.\n");
+            return NULL;
+        }
+
+        if (findTask(pool, worker, &task) == 0) {
+            runTask(pool, worker, &task);
+            continue;
+        }
+
+        // an empty queue has no delay
+        if (atomic_load_explicit(&pool->overloaded, memory_order_relaxed)) {
+            atomic_store(&pool->over_target_until, 0);
+            atomic_store(&pool->overloaded, 0);
+            atomic_store(&pool->overload_left_at, nowNs());
+        }
+
+        // nothing to do: announce that we are going to sleep, then look once more. a producer either
+        // sees nr_sleeping and bumps wake_seq (so the wait below returns at once) or its task is seen here
+        unsigned int seq = atomic_load(&pool->wake_seq);
+        atomic_fetch_add(&pool->nr_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (findTask(pool, worker, &task) == 0) {
+            atomic_fetch_sub(&pool->nr_sleeping, 1);
+            runTask(pool, worker, &task);
+            continue;
+        }
+        int timed_out = 0;
+        if (!atomic_load(&pool->stop)) {
+            timed_out = futexWait(&pool->wake_seq, seq, idle_timeout_ms) < 0;
+        }
+        atomic_fetch_sub(&pool->nr_sleeping, 1);
+
+        // a wake that came while timing out went to a thread still waiting, so leaving loses nothing
+        if (timed_out && retireWorker(pool, worker)) {
+            LOG_INFO("Worker idle for %d ms, leaving; %d threads left.\n", idle_timeout_ms, atomic_load(&pool->nr_threads));
+            return NULL;
+        }
+    }
+}
+
+int availableCpus(void) {
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = CPU_COUNT(&set);
+    }
+
+    // a cpu quota caps how much of them we get, even if we may run on all of them. inside a container
+    // the cgroup mounted at /sys/fs/cgroup is our own
+    long long quota = -1;
+    long long period = 0;
+    FILE* file = fopen("/sys/fs/cgroup/cpu.max", "r"); // v2: "max 100000" or "<quota> <period>"
+    if (file) {
+        char value[32];
+        if (fscanf(file, "%31s %lld", value, &period) == 2 && strcmp(value, "max") != 0) {
+            quota = atoll(value);
+        }
+        fclose(file);
+    } else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) { // v1
+        if (fscanf(file, "%lld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(file);
+        if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+            if (fscanf(file, "%lld", &period) != 1) {
+                period = 0;
+            }
+            fclose(file);
+        }
+    }
+    if (quota > 0 && period > 0) {
+        int quota_cpus = (int)((quota + period - 1) / period);
+        if (quota_cpus < cpus) {
+            cpus = quota_cpus;
+        }
+    }
+
+    return cpus > 0 ? cpus : 1;
+}
+
+void defaultThreadPoolConfig(ThreadPoolConfig* config) {
+    int cpus = availableCpus();
+    config->min_threads = cpus < MAX_THREADS ? cpus : MAX_THREADS;
+    config->max_threads = cpus * THREAD_POOL_THREADS_PER_CPU < MAX_THREADS ? cpus * THREAD_POOL_THREADS_PER_CPU : MAX_THREADS;
+    config->queue_capacity = MAX_QUEUE;
+    config->work_stealing = 0;
+    config->grow_wait_us = THREAD_POOL_GROW_WAIT_US;
+    config->idle_shrink_ms = THREAD_POOL_IDLE_SHRINK_MS;
+    config->target_delay_us = THREAD_POOL_TARGET_DELAY_US;
+    config->delay_interval_ms = THREAD_POOL_DELAY_INTERVAL_MS;
+}
+
+int loadThreadPoolConfig(ThreadPoolConfig* config, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    char line[128];
+    int set = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // strip comments
+        line[strcspn(line, "#\n")] = '\0';
+
+        char key[32];
+        long value;
+        if (sscanf(line, "%31s %ld", key, &value) != 2) {
+            continue;
+        }
+        if (value < 0) {
+            fprintf(stderr, "Invalid value for %s in %s: %ld\n", key, path, value);
+            continue;
+        }
+        if (strcmp(key, "min_threads") == 0) {
+            config->min_threads = (int)value;
+        } else if (strcmp(key, "max_threads") == 0) {
+            config->max_threads = (int)value;
+        } else if (strcmp(key, "queue_capacity") == 0) {
+            config->queue_capacity = (size_t)value;
+        } else if (strcmp(key, "work_stealing") == 0) {
+            config->work_stealing = value != 0;
+        } else if (strcmp(key, "grow_wait_us") == 0) {
+            config->grow_wait_us = (int)value;
+        } else if (strcmp(key, "idle_shrink_ms") == 0) {
+            config->idle_shrink_ms = (int)value;
+        } else if (strcmp(key, "target_delay_us") == 0) {
+            config->target_delay_us = (int)value;
+        } else if (strcmp(key, "delay_interval_ms") == 0) {
+            config->delay_interval_ms = (int)value;
+        } else {
+            fprintf(stderr, "Unknown thread pool setting in %s: %s\n", path, key);
+            continue;
+        }
+        set++;
+    }
+
+    fclose(file);
+    return set;
+}
+
+ThreadPool* initThreadPoolWithConfig(const ThreadPoolConfig* config) {
+    if (config->min_threads < 1 || config->max_threads < config->min_threads || config->max_threads > MAX_THREADS) {
+        fprintf(stderr, "Invalid thread pool size: %d..%d threads (at most %d)\n",
+                config->min_threads, config->max_threads, MAX_THREADS);
+        return NULL;
+    }
+
+    // the counters sit on cache lines of their own, so the pool needs that alignment too
+    size_t size = (sizeof(ThreadPool) + THREAD_CACHE_LINE - 1) / THREAD_CACHE_LINE * THREAD_CACHE_LINE;
+    ThreadPool* pool = (ThreadPool*)aligned_alloc(THREAD_CACHE_LINE, size);
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, size);
+    pool->config = *config;
+    if (pool->config.idle_shrink_ms < 1) {
+        pool->config.idle_shrink_ms = 1;
+    }
+    if (pool->config.delay_interval_ms < 1) {
+        pool->config.delay_interval_ms = 1;
+    }
+    if (initTaskRing(&pool->queue, config->queue_capacity) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    size_t workers_size = (config->max_threads * sizeof(ThreadPoolWorker) + THREAD_CACHE_LINE - 1) /
+                          THREAD_CACHE_LINE * THREAD_CACHE_LINE;
+    pool->workers = (ThreadPoolWorker*)aligned_alloc(THREAD_CACHE_LINE, workers_size);
+    if (pool->workers == NULL) {
+        free(pool->queue.cells);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, workers_size);
+    for (int i = 0; i < config->max_threads; i++) {
+        ThreadPoolWorker* worker = &pool->workers[i];
+        if (config->work_stealing && initTaskRing(&worker->inbox, THREAD_INBOX_SIZE) != 0) {
+            perror("Failed to allocate worker inbox");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&worker->deque.top, 0);
+        atomic_init(&worker->deque.bottom, 0);
+        atomic_init(&worker->state, THREAD_SLOT_FREE);
+        worker->pool = pool;
+        worker->index = i;
+        worker->steal_seed = 2654435761u * (i + 1);
+    }
+
+    atomic_init(&pool->nr_threads, 0);
+    atomic_init(&pool->wake_seq, 0);
+    atomic_init(&pool->nr_sleeping, 0);
+    atomic_init(&pool->stop, 0);
+    pthread_mutex_init(&pool->resize_lock, NULL);
+    atomic_init(&pool->over_target_until, 0);
+    atomic_init(&pool->overloaded, 0);
+    atomic_init(&pool->overload_left_at, 0);
+    atomic_init(&pool->nr_shed, 0);
+    pool->stats_at_ns = nowNs();
+
+    pthread_mutex_lock(&pool->resize_lock);
+    for (int i = 0; i < config->min_threads; i++) {
+        if (startWorker(pool) != 0) {
             exit(EXIT_FAILURE);
         }
-        printf("Worker thread %d created.\n", i);
+        LOG_DEBUG("Worker thread %d created.\n", i);
     }
+    pthread_mutex_unlock(&pool->resize_lock);
 
     return pool;
 }
 
+static ThreadPool* createFixedThreadPool(int thread_count, size_t queue_capacity, int work_stealing) {
+    ThreadPoolConfig config;
+    defaultThreadPoolConfig(&config);
+    config.min_threads = thread_count;
+    config.max_threads = thread_count;
+    config.queue_capacity = queue_capacity;
+    config.work_stealing = work_stealing;
+    return initThreadPoolWithConfig(&config);
+}
+
+// Initialize the thread pool
+ThreadPool* initThreadPool(int thread_count) {
+    return createFixedThreadPool(thread_count, MAX_QUEUE, 0);
+}
+
+ThreadPool* initThreadPoolWithQueue(int thread_count, size_t queue_capacity) {
+    return createFixedThreadPool(thread_count, queue_capacity, 0);
+}
+
+ThreadPool* initWorkStealingThreadPool(int thread_count, size_t queue_capacity) {
+    return createFixedThreadPool(thread_count, queue_capacity, 1);
+}
+
+uint64_t threadPoolNow(void) {
+    return nowNs();
+}
+
+// make task visible to the workers, without waking them
+static int pushTask(ThreadPool* pool, ThreadPoolTask task) {
+    // a worker's own follow-up work stays with it, unless its deque is full
+    if (!pool->config.work_stealing || current_worker == NULL || current_worker->pool != pool ||
+        pushDeque(&current_worker->deque, task) != 0) {
+        if (enqueueTask(&pool->queue, task) != 0) {
+            return -1; // Queue is full
+        }
+    }
+    return 0;
+}
+
+static int addTask(ThreadPool* pool, ThreadPoolTask task) {
+    if (pushTask(pool, task) != 0) {
+        return -1;
+    }
+    wakeWorkers(pool, 1);
+    return 0;
+}
+
 // Add a task to the thread pool
 int addTaskToThreadPool(ThreadPool* pool, void (*function)(void*), void* argument) {
-    pthread_mutex_lock(&(pool->lock));
+    ThreadPoolTask task = { .function = function, .argument = argument, .queued_at = nowNs() };
+    return addTask(pool, task);
+}
+
+int addDeadlineTaskToThreadPool(ThreadPool* pool, void (*function)(void*), void (*expired)(void*),
+                                void* argument, uint64_t deadline) {
+    // refusing it now is cheaper than queueing work that would wait past its deadline anyway
+    if (atomic_load_explicit(&pool->overloaded, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&pool->nr_shed, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    ThreadPoolTask task = { .function = function, .argument = argument, .queued_at = nowNs(),
+                            .expired = expired, .deadline = deadline };
+    return addTask(pool, task);
+}
 
-    if (pool->queue_size == MAX_QUEUE) {
-        pthread_mutex_unlock(&(pool->lock));
-        return -1; // Queue is full
+int addTasksToThreadPool(ThreadPool* pool, void (*function)(void*), void** arguments, int nr_tasks,
+                         ThreadPoolLatch* latch) {
+    ThreadPoolTask task = { .function = function, .queued_at = nowNs(), .latch = latch };
+    int added = 0;
+
+    while (added < nr_tasks) {
+        task.argument = arguments[added];
+        if (pushTask(pool, task) != 0) {
+            break;
+        }
+        added++;
+    }
+    if (added > 0) {
+        wakeWorkers(pool, added);
     }
+    return added;
+}
+
+void initThreadPoolLatch(ThreadPoolLatch* latch, int count) {
+    atomic_init(&latch->count, count);
+    latch->then_pool = NULL;
+    latch->then_function = NULL;
+    latch->then_argument = NULL;
+}
 
-    pool->task_queue[pool->queue_rear].function = function;
-    pool->task_queue[pool->queue_rear].argument = argument;
-    pool->queue_rear = (pool->queue_rear + 1) % MAX_QUEUE;
-    pool->queue_size++;
+void thenThreadPoolLatch(ThreadPoolLatch* latch, ThreadPool* pool, void (*function)(void*), void* argument) {
+    latch->then_pool = pool;
+    latch->then_function = function;
+    latch->then_argument = argument;
+}
 
-    printf("Task added. Queue size: %d\n", pool->queue_size);
+void countDownThreadPoolLatch(ThreadPoolLatch* latch) {
+    // read before counting down: once it is zero a waiter may release the latch
+    ThreadPool* then_pool = latch->then_pool;
+    void (*then_function)(void*) = latch->then_function;
+    void* then_argument = latch->then_argument;
 
-    pthread_cond_signal(&(pool->notify));
-    pthread_mutex_unlock(&(pool->lock));
+    if (atomic_fetch_sub(&latch->count, 1) != 1) {
+        return;
+    }
+    // the word may already be reused; a stray wake only sends another waiter back to its check
+    futexWake(&latch->count, INT_MAX);
+    if (then_pool && addTaskToThreadPool(then_pool, then_function, then_argument) != 0) {
+        (*then_function)(then_argument);
+    }
+}
+
+void waitThreadPoolLatch(ThreadPoolLatch* latch) {
+    unsigned int count;
+    while ((count = atomic_load(&latch->count)) != 0) {
+        futexWait(&latch->count, count, 0);
+    }
+}
+
+int currentThreadPoolWorker(ThreadPool* pool) {
+    if (current_worker == NULL || current_worker->pool != pool) {
+        return -1;
+    }
+    return current_worker->index;
+}
+
+int addTaskToThreadPoolWorker(ThreadPool* pool, int worker, void (*function)(void*), void* argument) {
+    ThreadPoolTask task = { .function = function, .argument = argument, .queued_at = nowNs() };
+
+    // a worker that has left the pool can't take it any more
+    if (!pool->config.work_stealing || worker < 0 || worker >= pool->config.max_threads ||
+        atomic_load(&pool->workers[worker].state) != THREAD_SLOT_RUNNING) {
+        return addTaskToThreadPool(pool, function, argument);
+    }
+    if (current_worker == &pool->workers[worker]) {
+        return addTaskToThreadPool(pool, function, argument);
+    }
+    if (enqueueTask(&pool->workers[worker].inbox, task) != 0 && enqueueTask(&pool->queue, task) != 0) {
+        return -1;
+    }
+
+    // the futex is shared, so this may wake another worker; it then steals the task
+    wakeWorkers(pool, 1);
     return 0;
 }
 
+void getThreadPoolStats(ThreadPool* pool, ThreadPoolStats* stats) {
+    uint64_t busy = 0;
+    uint64_t wait = 0;
+    uint64_t tasks = 0;
+    uint64_t expired = 0;
+
+    pthread_mutex_lock(&pool->resize_lock);
+    uint64_t now = nowNs();
+    for (int i = 0; i < pool->config.max_threads; i++) {
+        busy += atomic_load_explicit(&pool->workers[i].busy_ns, memory_order_relaxed);
+        wait += atomic_load_explicit(&pool->workers[i].wait_ns, memory_order_relaxed);
+        tasks += atomic_load_explicit(&pool->workers[i].nr_tasks, memory_order_relaxed);
+        expired += atomic_load_explicit(&pool->workers[i].nr_expired, memory_order_relaxed);
+    }
+
+    stats->nr_threads = atomic_load(&pool->nr_threads);
+    stats->nr_idle = atomic_load(&pool->nr_sleeping);
+    stats->nr_queued = atomic_load_explicit(&pool->queue.enqueue_pos, memory_order_relaxed) -
+                       atomic_load_explicit(&pool->queue.dequeue_pos, memory_order_relaxed);
+    stats->nr_tasks = tasks;
+    stats->nr_expired = expired;
+    stats->nr_shed = atomic_load_explicit(&pool->nr_shed, memory_order_relaxed);
+    stats->overloaded = atomic_load(&pool->overloaded);
+
+    // both over the time since the previous call
+    double thread_time = (double)(now - pool->stats_at_ns) * (stats->nr_threads > 0 ? stats->nr_threads : 1);
+    stats->utilization = thread_time > 0 ? (double)(busy - pool->stats_busy_ns) / thread_time : 0;
+    if (stats->utilization > 1) {
+        stats->utilization = 1; // threads that left still count their busy time
+    }
+    stats->avg_wait_us = tasks > pool->stats_tasks ?
+                         (double)(wait - pool->stats_wait_ns) / (tasks - pool->stats_tasks) / 1000 : 0;
+
+    pool->stats_at_ns = now;
+    pool->stats_busy_ns = busy;
+    pool->stats_wait_ns = wait;
+    pool->stats_tasks = tasks;
+    pthread_mutex_unlock(&pool->resize_lock);
+}
+
 // Destroy the thread pool
 void destroyThreadPool(ThreadPool* pool) {
-    pthread_mutex_lock(&(pool->lock));
-    pool->stop = 1;
-    pthread_cond_broadcast(&(pool->notify));
-    pthread_mutex_unlock(&(pool->lock));
+    atomic_store(&pool->stop, 1);
+    atomic_fetch_add(&pool->wake_seq, 1);
+    futexWake(&pool->wake_seq, INT_MAX);
 
-    for (int i = 0; i < MAX_THREADS; i++) {
-        pthread_join(pool->threads[i], NULL);
+    // only the slots that ever got a thread are joined
+    pthread_mutex_lock(&pool->resize_lock);
+    for (int i = 0; i < pool->config.max_threads; i++) {
+        if (atomic_load(&pool->workers[i].state) != THREAD_SLOT_FREE) {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+        free(pool->workers[i].inbox.cells);
     }
+    pthread_mutex_unlock(&pool->resize_lock);
 
-    pthread_mutex_destroy(&(pool->lock));
-    pthread_cond_destroy(&(pool->notify));
+    pthread_mutex_destroy(&pool->resize_lock);
+    free(pool->workers);
+    free(pool->queue.cells);
     free(pool);
-}
\ No newline at end of file
+}
@@ -2,30 +2,202 @@
 #define THREAD_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 
-#define MAX_THREADS 10
-#define MAX_QUEUE 100
+#define MAX_THREADS 256 // hard upper bound for max_threads
+#define MAX_QUEUE 1024 // default queue capacity; any capacity is rounded up to a power of two
+#define THREAD_CACHE_LINE 64
+#define THREAD_DEQUE_SIZE 256 // tasks a worker's own deque holds (power of two); more go to the shared queue
+#define THREAD_INBOX_SIZE 256 // tasks other threads can hand to one worker
+#define THREAD_POOL_CONF "thread_pool.conf" // one "key value" per line, see loadThreadPoolConfig()
+#define THREAD_POOL_THREADS_PER_CPU 4 // default max_threads per cpu: handlers also wait on sockets
+#define THREAD_POOL_GROW_WAIT_US 2000 // default grow_wait_us
+#define THREAD_POOL_IDLE_SHRINK_MS 5000 // default idle_shrink_ms
+#define THREAD_POOL_RESIZE_INTERVAL_MS 10 // at most one new thread per interval
+#define THREAD_POOL_TARGET_DELAY_US 5000 // default target_delay_us
+#define THREAD_POOL_DELAY_INTERVAL_MS 100 // default delay_interval_ms
+
+// counts tasks down to zero, then wakes whoever waits for them and queues what was chained to them;
+// see initThreadPoolLatch()
+typedef struct ThreadPoolLatch {
+    atomic_uint count;                   // tasks not finished yet; also the futex word waiters sleep on
+    struct ThreadPool* then_pool;        // where then_function is queued at zero, NULL = nothing chained
+    void (*then_function)(void*);
+    void* then_argument;
+} ThreadPoolLatch;
 
 // Task structure
 typedef struct {
     void (*function)(void*); // Function pointer for the task
     void* argument;          // Argument for the function
+    uint64_t queued_at;      // monotonic ns, when it was added; tells how long it waited
+    void (*expired)(void*);  // called instead of function once deadline passed; may be NULL
+    uint64_t deadline;       // monotonic ns, 0 = none
+    ThreadPoolLatch* latch;  // counted down once the task ran (or expired); may be NULL
 } ThreadPoolTask;
 
-// Thread pool structure
+// one slot of a task ring. sequence says whose turn the slot is: equal to a producer's position
+// it is free, one past a consumer's position it holds that consumer's task
+typedef struct {
+    atomic_size_t sequence;
+    ThreadPoolTask task;
+} ThreadPoolCell;
+
+// bounded lock-free ring (Vyukov's MPMC queue): producers and consumers each claim a position with
+// one compare-and-swap and never wait on each other, so adding and fetching a task stay O(1)
+// however many threads do it
+typedef struct {
+    ThreadPoolCell* cells;               // capacity cells
+    size_t capacity;                     // power of two
+    size_t mask;
+    _Alignas(THREAD_CACHE_LINE) atomic_size_t enqueue_pos; // next position a producer claims
+    _Alignas(THREAD_CACHE_LINE) atomic_size_t dequeue_pos; // next position a consumer claims
+} TaskRing;
+
+// a deque slot; the fields are atomics only because thieves read them while the owner may write
+typedef struct {
+    _Atomic(void (*)(void*)) function;
+    _Atomic(void*) argument;
+    _Atomic(uint64_t) queued_at;
+    _Atomic(void (*)(void*)) expired;
+    _Atomic(uint64_t) deadline;
+    _Atomic(ThreadPoolLatch*) latch;
+} ThreadPoolDequeCell;
+
+// Chase-Lev deque: only its owner pushes and pops at the bottom (newest first, so a follow-up task
+// runs while what it needs is still in cache), other workers steal from the top (oldest first)
+typedef struct {
+    _Alignas(THREAD_CACHE_LINE) atomic_long top;     // next task a thief takes
+    _Alignas(THREAD_CACHE_LINE) atomic_long bottom;  // next free slot of the owner
+    ThreadPoolDequeCell tasks[THREAD_DEQUE_SIZE];
+} ThreadPoolDeque;
+
+struct ThreadPool;
+
+#define THREAD_SLOT_FREE 0    // no thread, never started or joined
+#define THREAD_SLOT_RUNNING 1
+#define THREAD_SLOT_EXITED 2  // the thread left (the pool shrank) and waits to be joined
+
+// one worker slot of a pool; a slot outlives its thread, so tasks left in its deque or inbox can still be stolen
+typedef struct {
+    ThreadPoolDeque deque;               // tasks the worker added itself (work-stealing mode)
+    TaskRing inbox;                      // tasks other threads sent to this worker (work-stealing mode)
+    struct ThreadPool* pool;
+    int index;
+    uint32_t steal_seed;                 // picks the first victim
+    pthread_t thread;
+    atomic_int state;                    // THREAD_SLOT_*
+    _Alignas(THREAD_CACHE_LINE) _Atomic(uint64_t) busy_ns; // time spent running tasks
+    _Atomic(uint64_t) wait_ns;           // time its tasks spent queued
+    _Atomic(uint64_t) nr_tasks;
+    _Atomic(uint64_t) nr_expired;        // tasks dropped because their deadline passed while queued
+} ThreadPoolWorker;
+
+// sizing of a pool; see defaultThreadPoolConfig() and loadThreadPoolConfig()
 typedef struct {
-    pthread_t threads[MAX_THREADS];      // array of worker threads
-    ThreadPoolTask task_queue[MAX_QUEUE]; // task queue
-    int queue_size;                      // Current size of the task queue
-    int queue_front;                     // Front index of the task queue
-    int queue_rear;                      // Rear index of the task queue
-    pthread_mutex_t lock;                // Mutex for thread synchronization
-    pthread_cond_t notify;               // Condition variable to signal workers
-    int stop;                            // Flag to stop the thread pool
+    int min_threads;
+    int max_threads;                     // == min_threads for a fixed size
+    size_t queue_capacity;
+    int work_stealing;
+    int grow_wait_us;                    // a task that waited longer than this asks for another thread
+    int idle_shrink_ms;                  // a thread idle this long leaves, down to min_threads
+    int target_delay_us;                 // queue delay the pool aims for; 0 turns admission control off
+    int delay_interval_ms;               // tasks waiting longer than the target for this long mean overload
+} ThreadPoolConfig;
+
+// what getThreadPoolStats() reports
+typedef struct {
+    int nr_threads;
+    int nr_idle;                         // parked, waiting for tasks
+    size_t nr_queued;                    // in the shared queue (approximate)
+    double utilization;                  // busy time / thread time since the previous call, 0..1
+    double avg_wait_us;                  // mean queue wait of the tasks run since the previous call
+    uint64_t nr_tasks;                   // tasks run since the pool started
+    uint64_t nr_expired;                 // tasks dropped at their deadline since the pool started
+    uint64_t nr_shed;                    // tasks refused by admission control since the pool started
+    int overloaded;                      // admission control is refusing new tasks right now
+} ThreadPoolStats;
+
+// Thread pool structure
+// tasks go through the shared task queue; idle workers sleep on a futex (wake_seq) that producers
+// only touch when someone is asleep. in work-stealing mode every worker also has a deque for the
+// tasks it adds itself and an inbox for tasks sent to it, and idle workers steal from the others
+// before they sleep. the pool starts with min_threads; workers add one when tasks wait longer than
+// grow_wait_us (or the queue backs up while nobody is idle) and leave after idle_shrink_ms idle.
+// admission is CoDel-like: when every task for a whole delay_interval_ms waited longer than
+// target_delay_us, tasks with a deadline are refused until one waits less again (or a worker idles).
+typedef struct ThreadPool {
+    ThreadPoolConfig config;
+    ThreadPoolWorker* workers;           // config.max_threads slots
+    TaskRing queue;                      // shared task queue
+    _Alignas(THREAD_CACHE_LINE) atomic_int nr_threads;     // running threads
+    atomic_uint wake_seq;                // futex word, bumped to wake sleepers
+    atomic_int nr_sleeping;              // workers parked (or about to park) on wake_seq
+    atomic_int stop;                     // Flag to stop the thread pool
+    _Alignas(THREAD_CACHE_LINE) pthread_mutex_t resize_lock; // growing, shrinking and stats only, never per task
+    _Atomic(uint64_t) last_resize_ns;
+    uint64_t stats_at_ns;                // the previous getThreadPoolStats() call, for the deltas
+    uint64_t stats_busy_ns;
+    uint64_t stats_wait_ns;
+    uint64_t stats_tasks;
+    _Alignas(THREAD_CACHE_LINE) _Atomic(uint64_t) over_target_until; // when the queue delay, above target
+                                                                      // since then, becomes overload; 0 = below
+    atomic_int overloaded;
+    _Atomic(uint64_t) overload_left_at;
+    _Atomic(uint64_t) nr_shed;
 } ThreadPool;
 
+// cpus this process may run on: its affinity mask, further limited by a cgroup cpu quota (v2 or v1)
+int availableCpus(void);
+// min_threads = available cpus, max_threads = THREAD_POOL_THREADS_PER_CPU per cpu, no work stealing,
+// admission control on
+void defaultThreadPoolConfig(ThreadPoolConfig* config);
+// overrides config with the "key value" lines of path (min_threads, max_threads, queue_capacity,
+// work_stealing, grow_wait_us, idle_shrink_ms, target_delay_us, delay_interval_ms; "#" starts a comment). returns how many were set, -1 if
+// the file can't be read
+int loadThreadPoolConfig(ThreadPoolConfig* config, const char* path);
+ThreadPool* initThreadPoolWithConfig(const ThreadPoolConfig* config);
+// fixed-size pools (min_threads == max_threads == thread_count)
 ThreadPool* initThreadPool(int thread_count);
+// same, with a task queue of (at least) queue_capacity tasks instead of MAX_QUEUE
+ThreadPool* initThreadPoolWithQueue(int thread_count, size_t queue_capacity);
+// same, in work-stealing mode
+ThreadPool* initWorkStealingThreadPool(int thread_count, size_t queue_capacity);
+// returns -1 if the queue is full. in work-stealing mode a task added by one of the pool's own
+// workers goes to that worker's deque
 int addTaskToThreadPool(ThreadPool* pool, void (*function)(void*), void* argument);
+// the clock queued_at and deadlines are in (CLOCK_MONOTONIC, ns)
+uint64_t threadPoolNow(void);
+// a new request, worth running only until deadline (see threadPoolNow()). if it is still queued then,
+// expired(argument) is called instead of function, and should only release it. returns -1 if the queue
+// is full, or if the pool is overloaded and sheds new work; continuations of admitted requests should
+// use addTaskToThreadPool(), which is never refused while there is room
+int addDeadlineTaskToThreadPool(ThreadPool* pool, void (*function)(void*), void (*expired)(void*),
+                                void* argument, uint64_t deadline);
+// add nr_tasks tasks, function(arguments[i]) each, and wake as many workers as they need with one
+// call instead of one per task. latch (may be NULL) is counted down as each of them finishes. returns
+// how many were added, the first ones; the rest did not fit in the queue and are the caller's, latch
+// included (run them and count it down, or count it down without)
+int addTasksToThreadPool(ThreadPool* pool, void (*function)(void*), void** arguments, int nr_tasks,
+                         ThreadPoolLatch* latch);
+// a latch that opens after count countdowns
+void initThreadPoolLatch(ThreadPoolLatch* latch, int count);
+// once the latch opens, queue function(argument) on pool (run it on the opening thread if pool is full).
+// set it before anything counts down
+void thenThreadPoolLatch(ThreadPoolLatch* latch, ThreadPool* pool, void (*function)(void*), void* argument);
+void countDownThreadPoolLatch(ThreadPoolLatch* latch);
+// block until the latch is open; it may be released as soon as this returns. not from a worker of a
+// pool whose tasks the latch waits for, unless it has other workers to run them
+void waitThreadPoolLatch(ThreadPoolLatch* latch);
+// index of the calling thread among the pool's workers, -1 if it is not one of them
+int currentThreadPoolWorker(ThreadPool* pool);
+// hand a task to one worker (e.g. the one that started the request it continues) from any thread;
+// other workers may still steal it if that one is busy. without work stealing, or with worker -1,
+// this is addTaskToThreadPool()
+int addTaskToThreadPoolWorker(ThreadPool* pool, int worker, void (*function)(void*), void* argument);
+void getThreadPoolStats(ThreadPool* pool, ThreadPoolStats* stats);
 void destroyThreadPool(ThreadPool* pool);
 
-#endif
\ No newline at end of file
+#endif
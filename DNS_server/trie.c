@@ -4,6 +4,8 @@
 #include "trie.h"
 #include <time.h>
 #include "cache.h"
+#include "logger.h"
+#include "dns_name.h"
 
 #define ROOT_LABEL "root"
 #define GET_NR_ZONES_FOR_ROOT_START "./Scripts/get_nr_zones_for_root_start.sh BINDzones/zones.conf"
@@ -23,6 +25,20 @@ void error(char* text)
     printf("Error:%s\n", text);
     exit(1);
 }
+// fills node->wire_label from a zone label; the scripts' output may leave a trailing '\n' on it.
+// labels that can't be a wire label get length 0, which no label of a query matches
+void setWireLabel(struct TrieNode* node, const char* name)
+{
+    size_t len = strcspn(name, " \n");
+    if (len > DNS_MAX_LABEL || strcmp(name, "@") == 0) {
+        len = 0;
+    }
+    node->wire_label[0] = (uint8_t)len;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        node->wire_label[i + 1] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+}
 struct TrieNode* createTrieROOT() {
     struct TrieNode* root = (struct TrieNode*)malloc(sizeof(struct TrieNode));
     if (root == NULL) {
@@ -35,6 +51,10 @@ struct TrieNode* createTrieROOT() {
         error("Memory allocation failed for root->label component!");
     }
     strcpy(root->label, ROOT_LABEL);
+    root->wire_label[0] = 0;
+    root->names = NULL;
+    root->index = NULL;
+    root->zone_names = NULL;
 
     for (int i = 0; i < NR_MAX_CHILDREN; i++) {
         root->childrens[i] = NULL;
@@ -106,7 +126,7 @@ char** getArrayOfDomainNames()
         error("Error in retriving the array of domains from using popen() with GET_ARRAY_OF_DOMAINS");
     }
 
-    printf("%s-%d\n",buffer,nr_zones);
+    LOG_DEBUG("%s-%d\n",buffer,nr_zones);
 
     char** domains = (char**)malloc(nr_zones * sizeof(char*));
     char delim[] = " \n";
@@ -121,10 +141,10 @@ char** getArrayOfDomainNames()
         token = strtok(NULL, delim); // Get the next token
         i++;
     }
-    printf("The domain names are:\n");
+    LOG_DEBUG("The domain names are:\n");
     for(int i=0;i<nr_zones;i++)
     {
-        printf("-->%s<--\n", domains[i]);
+        LOG_DEBUG("-->%s<--\n", domains[i]);
     }
     return domains;
 }
@@ -178,19 +198,21 @@ char** extractWordsFromDomain(const char* domain) {
         error("Memory allocation failed for domain_copy");
     }
 
-    char* token = strtok(domain_copy, ".");
+    // strtok_r: zones are loaded by several threads at once (see mainDNS.c)
+    char* save = NULL;
+    char* token = strtok_r(domain_copy, ".", &save);
     while (token) {
         words[i] = strdup(token);
         if (!words[i]) {
-            free(words);
-            free(domain_copy);
-            error("Memory allocation failed for word");
             for (int j = 0; j < i; j++) {
                 free(words[j]);
             }
+            free(words);
+            free(domain_copy);
+            error("Memory allocation failed for word");
         }
         i++;
-        token = strtok(NULL, ".");
+        token = strtok_r(NULL, ".", &save);
     }
     words[i] = NULL;
     free(domain_copy);
@@ -215,6 +237,7 @@ struct TrieNode* createNormalNode(char* name)
 
     node->label = (char*)malloc(strlen(name) * sizeof(char*));
     strcpy(node->label, name);
+    setWireLabel(node, name);
 
     node->nr_records = 0;
     node->ns = NULL;
@@ -283,12 +306,41 @@ char* getNSDomain(char* path_to_zone, char* type)
 
     return result;
 }
+char* getSOADomain(char* path_to_zone, char* type)
+{
+    char buffer[300];
+    FILE* fp;
+    char* str = (char*)malloc((strlen(path_to_zone) + 2 + strlen(GET_METADATA_FROM_SOA) + 2 + strlen(type) + 1) * sizeof(char));
+    strcpy(str, GET_METADATA_FROM_SOA);
+    strcat(str, path_to_zone);
+    strcat(str, type);
+
+    fp = popen(str, "r");
+    free(str);
+    if (fp == NULL) {
+        error("Error creating a pipe with popen() for GET_METADATA_FROM_SOA!");
+    }
+
+    if(fgets(buffer, sizeof(buffer), fp) == NULL)
+    {
+        error("Error getting the soa domains with fgets()!");
+    }
+    if(pclose(fp) == -1)
+    {
+        error("Error closing the pipe for popen() with GET_METADATA_FROM_SOA");
+    }
+
+    buffer[strcspn(buffer, "\n")] = '\0';
+
+    return strdup(buffer);
+}
 struct TrieNode* createItselfNode(char* name, char* path_to_zone)
 {
     struct TrieNode* node = (struct TrieNode*)malloc(sizeof(struct TrieNode));
 
     node->label = (char*)malloc(strlen(name) * sizeof(char*));
     strcpy(node->label, name);
+    setWireLabel(node, name);
 
     node->nr_records = 0;
     node->nr_childrens = 0;
@@ -300,6 +352,9 @@ struct TrieNode* createItselfNode(char* name, char* path_to_zone)
     node->soa->retry_time = getMetadataNumber(path_to_zone, " retry");
     node->soa->expire_time= getMetadataNumber(path_to_zone, " expire");
     node->soa->minimum_ttl = getMetadataNumber(path_to_zone, " minimum_ttl");
+    node->soa->primary_ns = getSOADomain(path_to_zone, " mname");
+    node->soa->admin_mail = getSOADomain(path_to_zone, " rname");
+    node->soa->ttl = getDNSTtlValueFromZoneFile(path_to_zone, " 1");
 
     node->ns = (struct NSQuerys*)malloc(sizeof(struct NSQuerys));
     node->ns->domain1 = (char*)malloc(32 * sizeof(char));
@@ -334,13 +389,14 @@ char** getTerminalNames(char* path_to_zone)
     //trebuie sa returnez un array de string-uri :>
     char** names = (char**)malloc(NR_ARRAY * sizeof(char*));
     int index = 0;
-    char* token = strtok(buffer, " ");
+    char* save = NULL;
+    char* token = strtok_r(buffer, " ", &save);
     while(token != NULL)
     {
         //printf("%s\n", token);
         names[index] = (char*)malloc((strlen(token) + 1) * sizeof(char));
         strcpy(names[index++], token);
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
     }
     names[index] = NULL;
 
@@ -406,6 +462,7 @@ struct TrieNode* createSpecialNode(char* path_to_zone, int nr_line_in_zone, char
 
     node->label = (char*)malloc((strlen(name) + 1) * sizeof(char));
     strcpy(node->label, name);
+    setWireLabel(node, name);
     //printf("%s\n", name);
     node->nr_childrens = 0;
     node->nr_records = 0; //deocamdata
@@ -435,9 +492,12 @@ struct TrieNode* createTerminalNode(char* name, char* domain)
     terminalNode->nr_childrens = 0;
     terminalNode->nr_records = 0;
     terminalNode->records = NULL;
+    terminalNode->soa = NULL;
+    terminalNode->ns = NULL;
 
     terminalNode->label = (char*)malloc((strlen(name) + 1) * sizeof(char));
     strcpy(terminalNode->label, name);
+    setWireLabel(terminalNode, name);
 
     char buffer[128];
     FILE* fp;
@@ -512,23 +572,307 @@ struct TrieNode* createBranch(char* domain)
             vectorOfNodes[0]->childrens[vectorOfNodes[0]->nr_childrens++] = vectorOfNodes[i];
         }
     //}
-    return vectorOfNodes[0];
+    struct TrieNode* branch = vectorOfNodes[0];
+    for (int i = 0; i < nr_names; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(vectorOfNodes);
+    return branch;
 }
-struct CacheEntry* retriveValue(struct TrieNode* root, char* domain_name, struct DNSCache* cache)
+// a zone's own node: its first child is the "@" node holding the SOA and NS data
+static bool isZoneApex(const struct TrieNode* node)
+{
+    return node->nr_childrens > 0 && node->childrens[0]->soa != NULL;
+}
+// the child of node whose label is the wire label at wire, NULL if there is none.
+// one memcmp per child compares the length byte and the label together
+static struct TrieNode* matchChild(const struct TrieNode* node, const uint8_t* wire)
 {
-    char** words = extractWordsFromDomain(domain_name);
-    int nr_words = getCharArraySize(words) - 1;
-    // for(int i=0;i<nr_words + 1;i++)
-    // {
-    //     printf("-->%s<--\n", words[i]);
-    // }
+    for (int i = 0; i < node->nr_childrens; i++) {
+        struct TrieNode* child = node->childrens[i];
+        if (child->wire_label[0] == wire[0] && memcmp(child->wire_label + 1, wire + 1, wire[0]) == 0) {
+            return child;
+        }
+    }
+    return NULL;
+}
+// the walk behind the lookups; also reports the last zone apex passed (NULL if none) and its depth
+static struct TrieNode* walkWireName(struct TrieNode* root, const uint8_t* name, const uint8_t* labels, int nr_labels,
+                                     int* nr_matched, struct TrieNode** apex, int* apex_depth)
+{
+    struct TrieNode* node = root;
+    int label = nr_labels - 1;
+    *apex = NULL;
+    *apex_depth = 0;
+
+    while (label >= 0) {
+        struct TrieNode* next = matchChild(node, name + labels[label]);
+        if (next == NULL) {
+            break;
+        }
+        node = next;
+        label--;
+        if (isZoneApex(node)) {
+            *apex = node;
+            *apex_depth = nr_labels - 1 - label;
+        }
+    }
 
+    *nr_matched = nr_labels - 1 - label;
+    return node;
+}
+// what a visit of the zones collects; with no filter and no entries it only counts names and key bytes
+typedef struct ZoneNameSet{
+    struct BloomFilter* filter;
+    struct PerfectHashEntry* entries;
+    struct ZoneName* zone_names;
+    uint8_t* keys;
+    size_t nr_names;
+    size_t keys_len;
+}ZoneNameSet;
+// prefix the node's label to suffix (a wire name) and pass the result on to every name under it;
+// only apexes and the names below them are local, the labels above them (e.g. "com") are not
+static void visitZoneNames(struct TrieNode* node, const uint8_t* suffix, size_t suffix_len, int depth,
+                           struct TrieNode* apex, int apex_depth, struct ZoneNameSet* set)
+{
+    uint8_t name[DNS_NAME_MAX];
+    size_t label_len = node->wire_label[0];
+
+    if (label_len == 0 || label_len + 1 + suffix_len > DNS_NAME_MAX) {
+        return;
+    }
+    memcpy(name, node->wire_label, label_len + 1);
+    memcpy(name + label_len + 1, suffix, suffix_len);
+    size_t len = label_len + 1 + suffix_len;
+
+    depth++;
+    if (isZoneApex(node)) {
+        apex = node;
+        apex_depth = depth;
+    }
+    if (apex != NULL) {
+        if (set->filter) {
+            bloomAdd(set->filter, bloomHash(name, len));
+        }
+        if (set->entries) {
+            struct ZoneName* zone_name = &set->zone_names[set->nr_names];
+            zone_name->node = node;
+            zone_name->apex = apex;
+            zone_name->zone_labels = apex_depth;
+            memcpy(set->keys + set->keys_len, name, len);
+            set->entries[set->nr_names].key = set->keys + set->keys_len;
+            set->entries[set->nr_names].len = len;
+            set->entries[set->nr_names].value = zone_name;
+        }
+        set->nr_names++;
+        set->keys_len += len;
+    }
+    for (int i = 0; i < node->nr_childrens; i++) {
+        visitZoneNames(node->childrens[i], name, len, depth, apex, apex_depth, set);
+    }
+}
+static void visitAllZoneNames(struct TrieNode* root, struct ZoneNameSet* set)
+{
+    const uint8_t root_name[] = { 0 };
+    for (int i = 0; i < root->nr_childrens; i++) {
+        visitZoneNames(root->childrens[i], root_name, sizeof(root_name), 0, NULL, 0, set);
+    }
+}
+void buildNameIndex(struct TrieNode* root)
+{
+    // a first pass counts the names so everything gets its size right
+    struct ZoneNameSet count = { 0 };
+    visitAllZoneNames(root, &count);
+
+    struct ZoneNameSet set = { 0 };
+    set.filter = createBloomFilter(count.nr_names);
+    set.entries = (struct PerfectHashEntry*)malloc((count.nr_names + 1) * sizeof(struct PerfectHashEntry));
+    set.zone_names = (struct ZoneName*)malloc((count.nr_names + 1) * sizeof(struct ZoneName));
+    set.keys = (uint8_t*)malloc(count.keys_len + 1);
+    if (set.entries == NULL || set.zone_names == NULL || set.keys == NULL) {
+        free(set.entries);
+        free(set.zone_names);
+        set.entries = NULL;
+        set.zone_names = NULL;
+    }
+    visitAllZoneNames(root, &set);
+
+    // the index keeps its own copy of the keys, the values stay in zone_names
+    struct PerfectHash* index = NULL;
+    if (set.entries != NULL) {
+        index = createPerfectHash(set.entries, set.nr_names);
+    }
+    if (index == NULL) {
+        free(set.zone_names);
+        set.zone_names = NULL;
+    }
+    free(set.entries);
+    free(set.keys);
+
+    // NULL (no filter or no index) only means lookups walk the trie
+    destroyBloomFilter(root->names);
+    root->names = set.filter;
+    destroyPerfectHash(root->index);
+    free(root->zone_names);
+    root->index = index;
+    root->zone_names = set.zone_names;
+}
+// the exact name, if it is one of our zones' names; NULL if it isn't or there is no index
+static const struct ZoneName* lookupIndexedName(const struct TrieNode* root, const uint8_t* name, size_t len)
+{
+    if (root->index == NULL) {
+        return NULL;
+    }
+    return (const struct ZoneName*)perfectHashLookup(root->index, name, len);
+}
+// whether any suffix of the name, i.e. a zone it could be in, may be one of ours
+static bool mayBeInOurZones(const struct TrieNode* root, const uint8_t* name, const uint8_t* labels, int nr_labels, size_t len)
+{
+    if (root->names == NULL) {
+        return true;
+    }
+    for (int label = nr_labels - 1; label >= 0; label--) {
+        if (bloomMayContain(root->names, bloomHash(name + labels[label], len - labels[label]))) {
+            return true;
+        }
+    }
+    return false;
+}
+struct TrieNode* lookupWireName(struct TrieNode* root, const uint8_t* name, const uint8_t* labels, int nr_labels, int* nr_matched)
+{
+    struct TrieNode* apex;
+    int apex_depth;
+    return walkWireName(root, name, labels, nr_labels, nr_matched, &apex, &apex_depth);
+}
+struct TrieNode* lookupQuestion(struct TrieNode* root, const struct dns_msg_view* query, int* nr_matched)
+{
+    return lookupWireName(root, query->qname_lower, query->qname_labels, query->qname.nr_labels, nr_matched);
+}
+struct TrieNode* lookupQuestionZone(struct TrieNode* root, const struct dns_msg_view* query,
+                                    struct TrieNode** node, int* nr_matched, int* zone_labels)
+{
+    struct TrieNode* apex;
+    const struct ZoneName* zone_name = lookupIndexedName(root, query->qname_lower, query->qname.name_len);
+    if (zone_name != NULL) {
+        *node = zone_name->node;
+        *nr_matched = query->qname.nr_labels;
+        *zone_labels = zone_name->zone_labels;
+        return zone_name->apex;
+    }
+    if (!mayBeInOurZones(root, query->qname_lower, query->qname_labels, query->qname.nr_labels, query->qname.name_len)) {
+        *node = root;
+        *nr_matched = 0;
+        *zone_labels = 0;
+        return NULL;
+    }
+    *node = walkWireName(root, query->qname_lower, query->qname_labels, query->qname.nr_labels,
+                         nr_matched, &apex, zone_labels);
+    return apex;
+}
+// one walk of lookupQuestionZoneBatch() still in flight
+typedef struct ZoneWalk{
+    const struct dns_msg_view* query;
+    struct ZoneLookup* found;
+    int label; //next label to match, counted from the left
+}ZoneWalk;
+// walkWireName() one level at a time; returns false once the walk can't go deeper
+static bool stepZoneWalk(struct ZoneWalk* walk)
+{
+    const struct dns_msg_view* query = walk->query;
+    struct ZoneLookup* found = walk->found;
+    struct TrieNode* next = matchChild(found->node, query->qname_lower + query->qname_labels[walk->label]);
+    if (next == NULL) {
+        return false;
+    }
+    found->node = next;
+    found->nr_matched = query->qname.nr_labels - walk->label;
+    walk->label--;
+    if (isZoneApex(next)) {
+        found->apex = next;
+        found->zone_labels = found->nr_matched;
+    }
+    return walk->label >= 0;
+}
+// what the next step of a walk reads: the node's child list, then each child's label
+static void prefetchNode(const struct TrieNode* node)
+{
+    __builtin_prefetch(&node->nr_childrens);
+    __builtin_prefetch(&node->childrens[0]);
+}
+static void prefetchChildren(const struct TrieNode* node)
+{
+    for (int i = 0; i < node->nr_childrens; i++) {
+        __builtin_prefetch(node->childrens[i]->wire_label);
+    }
+}
+void lookupQuestionZoneBatch(struct TrieNode* root, const struct dns_msg_view* queries, int nr_queries,
+                             struct ZoneLookup* found)
+{
+    for (int first = 0; first < nr_queries; first += TRIE_LOOKUP_GROUP) {
+        int group = nr_queries - first < TRIE_LOOKUP_GROUP ? nr_queries - first : TRIE_LOOKUP_GROUP;
+        const uint8_t* names[TRIE_LOOKUP_GROUP];
+        size_t lens[TRIE_LOOKUP_GROUP];
+        void* hits[TRIE_LOOKUP_GROUP];
+        struct ZoneWalk walks[TRIE_LOOKUP_GROUP];
+        int nr_walks = 0;
+
+        // exact names first, the whole group through the index at once
+        for (int i = 0; i < group; i++) {
+            names[i] = queries[first + i].qname_lower;
+            lens[i] = queries[first + i].qname.name_len;
+            hits[i] = NULL;
+        }
+        if (root->index != NULL) {
+            perfectHashLookupBatch(root->index, names, lens, group, hits);
+        }
+        for (int i = 0; i < group; i++) {
+            const struct dns_msg_view* query = &queries[first + i];
+            struct ZoneLookup* result = &found[first + i];
+            const struct ZoneName* zone_name = (const struct ZoneName*)hits[i];
+            if (zone_name != NULL) {
+                result->apex = zone_name->apex;
+                result->node = zone_name->node;
+                result->nr_matched = query->qname.nr_labels;
+                result->zone_labels = zone_name->zone_labels;
+                continue;
+            }
+            result->apex = NULL;
+            result->node = root;
+            result->nr_matched = 0;
+            result->zone_labels = 0;
+            if (query->qname.nr_labels > 0 &&
+                mayBeInOurZones(root, query->qname_lower, query->qname_labels, query->qname.nr_labels, query->qname.name_len)) {
+                walks[nr_walks].query = query;
+                walks[nr_walks].found = result;
+                walks[nr_walks].label = query->qname.nr_labels - 1;
+                nr_walks++;
+            }
+        }
+
+        // the rest (closest enclosers) walk down together, a level per round
+        while (nr_walks > 0) {
+            for (int w = 0; w < nr_walks; w++) {
+                prefetchChildren(walks[w].found->node);
+            }
+            int active = 0;
+            for (int w = 0; w < nr_walks; w++) {
+                if (stepZoneWalk(&walks[w])) {
+                    prefetchNode(walks[w].found->node);
+                    walks[active++] = walks[w];
+                }
+            }
+            nr_walks = active;
+        }
+    }
+}
+struct CacheEntry* retriveValue(struct TrieNode* root, char* domain_name, struct DNSCache* cache)
+{
     char* searchDNSCache = lookupDNSCache(cache, domain_name);
     if(searchDNSCache != NULL)
     {
-        printf("Gasit in DNSCache!\n");
-        struct CacheEntry* cache_entry = (struct CacheEntry*)malloc(sizeof(struct CacheEntry*));
-        cache_entry = createCacheEntry();
+        LOG_DEBUG("Gasit in DNSCache!\n");
+        struct CacheEntry* cache_entry = createCacheEntry();
         cache_entry->domain_name = (char*)malloc((strlen(domain_name)  +1) * sizeof(char));
         strcpy(cache_entry->domain_name, domain_name);
         cache_entry->record_value = (char*)malloc((strlen(searchDNSCache) + 1) * sizeof(char));
@@ -538,55 +882,59 @@ struct CacheEntry* retriveValue(struct TrieNode* root, char* domain_name, struct
         return cache_entry;
     }
 
-    struct TrieNode* search_node = (struct TrieNode*)malloc(sizeof(struct TrieNode*));
-    search_node = root;
-    while(1)
+    // the dotted name is turned into the same canonical wire form the parser makes, then walked like a query
+    uint8_t name[DNS_NAME_MAX];
+    struct dns_name_info info;
+    if (dns_name_canon_dotted(domain_name, name, &info) == DNS_NAME_ELABEL) {
+        return NULL;
+    }
+    // only our zones' own names can be answered from the trie, and the index has every one of them
+    struct TrieNode* search_node;
+    if (root->index != NULL) {
+        const struct ZoneName* zone_name = lookupIndexedName(root, name, info.len);
+        if (zone_name == NULL) {
+            return NULL;
+        }
+        search_node = zone_name->node;
+    } else {
+        if (root->names != NULL && !bloomMayContain(root->names, bloomHash(name, info.len))) {
+            return NULL;
+        }
+        int nr_matched;
+        search_node = lookupWireName(root, name, info.labels, info.nr_labels, &nr_matched);
+        if (nr_matched != info.nr_labels || search_node == root) {
+            return NULL;
+        }
+    }
+
+    for(int j=0;j<search_node->nr_records;j++)
     {
-        for(int i=0;i<search_node->nr_childrens;i++)
+        if(search_node->records[j].value != NULL)
         {
-            //printf("%s are %d copii\n", search_node->label, search_node->nr_childrens);
-            //printf("%s == %s\n", search_node->childrens[i]->label, words[nr_words]);
-            //printf("%d\n", nr_words);
-            if(strcmp(search_node->childrens[i]->label, words[nr_words]) == 0){
-                nr_words--;
-                printf("%s == %s\n", search_node->childrens[i]->label, words[nr_words + 1]);
-                search_node = search_node->childrens[i];
-                i = -1; //reset
-                for(int j=0;j<search_node->nr_records;j++)
-                {
-                    //printf("%s\n", search_node->records[i].value);
-                    if(search_node->records[j].value != NULL && nr_words == -1)
-                    {
-                        //printf("%s\n", search_node->records[j].value);
-                        struct CacheEntry* cache_entry = (struct CacheEntry*)malloc(sizeof(struct CacheEntry*));
-                        cache_entry = createCacheEntry();
-                        cache_entry->domain_name = (char*)malloc((strlen(domain_name)  +1) * sizeof(char));
-                        strcpy(cache_entry->domain_name, domain_name);
-                        cache_entry->record_value = (char*)malloc((strlen(search_node->records[j].value) + 1) * sizeof(char));
-                        strcpy(cache_entry->record_value, search_node->records[j].value);
-                        cache_entry->timestamp = time(NULL);
-                        cache_entry->ttl = TTL_VALUE_CACHE;
-                        //printf("%s\n",cache_entry->record_value);
-                        return cache_entry;
-                    }
-                }
-                if(nr_words == -1 ){
-                    search_node = search_node->childrens[0];
-                    printf("Itself node found!\n");
-                    //printf("%d %s\n", search_node->nr_records, search_node->label);
-                    srand(time(0));
-                    int rand_nr = rand() % 2;
-                    //printf("%d\n", rand_nr);
-                    if(rand_nr == 0)
-                    {
-                        return retriveValue(root, search_node->ns->domain1, cache);
-                    }
-                    else{
-                        return retriveValue(root, search_node->ns->domain2, cache);
-                    }
-                }
-            }
+            struct CacheEntry* cache_entry = createCacheEntry();
+            cache_entry->domain_name = (char*)malloc((strlen(domain_name)  +1) * sizeof(char));
+            strcpy(cache_entry->domain_name, domain_name);
+            cache_entry->record_value = (char*)malloc((strlen(search_node->records[j].value) + 1) * sizeof(char));
+            strcpy(cache_entry->record_value, search_node->records[j].value);
+            cache_entry->timestamp = time(NULL);
+            cache_entry->ttl = TTL_VALUE_CACHE;
+            return cache_entry;
         }
-        return NULL;
     }
-}
\ No newline at end of file
+
+    // a zone apex: answer with the address of one of its name servers
+    if (search_node->nr_childrens > 0 && search_node->childrens[0]->ns != NULL) {
+        search_node = search_node->childrens[0];
+        LOG_DEBUG("Itself node found!\n");
+        srand(time(0));
+        int rand_nr = rand() % 2;
+        if(rand_nr == 0)
+        {
+            return retriveValue(root, search_node->ns->domain1, cache);
+        }
+        else{
+            return retriveValue(root, search_node->ns->domain2, cache);
+        }
+    }
+    return NULL;
+}
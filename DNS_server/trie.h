@@ -3,9 +3,14 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "cache.h"
+#include "dns_view.h"
+#include "bloom.h"
+#include "phash.h"
 
 #define NR_MAX_CHILDREN 32 
+#define TRIE_LOOKUP_GROUP 16 //walks lookupQuestionZoneBatch() advances in lockstep
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +27,9 @@ typedef struct SOAMetadata
     int retry_time;
     long long expire_time;
     int minimum_ttl;
+    int ttl; //the zone's $TTL, which its SOA and NS records carry
+    char* primary_ns; //mname, e.g. "ns1.example.com."
+    char* admin_mail; //rname, e.g. "admin.example.com."
 }SOAMetadata;
 typedef struct DNSRecord{
     char* type; //A, MX, SOA, NS
@@ -30,22 +38,62 @@ typedef struct DNSRecord{
 }DNSRecord;
 typedef struct TrieNode{
     char* label;
+    uint8_t wire_label[64]; //length byte + lowercased label, compared as is with wire names; length 0 for root and "@"
     struct TrieNode* childrens[NR_MAX_CHILDREN]; //array of children
     struct DNSRecord* records;
     int nr_records;
     struct SOAMetadata* soa;
     struct NSQuerys* ns;
     int  nr_childrens;
+    struct BloomFilter* names; //root only: every zone apex and owner name, see buildNameIndex()
+    struct PerfectHash* index; //root only: the same names, exact match -> struct ZoneName
+    struct ZoneName* zone_names; //root only: the values of index
 }TrieNode;
+// where a name of one of our zones sits in the trie, as the walk would find it
+typedef struct ZoneName{
+    struct TrieNode* node;
+    struct TrieNode* apex; //the deepest zone apex on its path
+    int zone_labels; //labels in the apex's name
+}ZoneName;
+// what lookupQuestionZone() finds for one question
+typedef struct ZoneLookup{
+    struct TrieNode* apex; //NULL if the question is outside all our zones
+    struct TrieNode* node;
+    int nr_matched;
+    int zone_labels;
+}ZoneLookup;
 
 void error(char* text);
 struct TrieNode* createTrieROOT();
 char** getArrayOfDomainNames();
 struct TrieNode* createBranch(char* domains);
 char** extractWordsFromDomain(const char* domain);
+int getDNSTtlValueFromZoneFile(char* path_to_zone, char* nr_line_in_zone);
 int getCharArraySize(char** array);
 int getNrBranches();
 struct CacheEntry* retriveValue(struct TrieNode* root, char* domain_name, struct DNSCache* cache);
+// (re)builds root->names and root->index from the zones under root; call it after loading them and
+// after every reload. lookups that miss the filter skip the trie walk, exact names found in the
+// index skip it too, so only closest-encloser lookups (names under ours that don't exist) still walk
+void buildNameIndex(struct TrieNode* root);
+
+// deepest node on the path of a lowercased wire name (see dns_name.h), walked from its rightmost label.
+// labels holds the offset of each label's length byte, leftmost first; *nr_matched gets how many
+// labels matched, counted from the right
+struct TrieNode* lookupWireName(struct TrieNode* root, const uint8_t* name, const uint8_t* labels, int nr_labels, int* nr_matched);
+// same for the question of a parsed message, straight from the parser's canonical qname
+struct TrieNode* lookupQuestion(struct TrieNode* root, const struct dns_msg_view* query, int* nr_matched);
+// apex of the zone (the node whose first child is "@") the question of a parsed message falls in,
+// NULL if it is outside all our zones. *node and *nr_matched are set like lookupWireName() does and
+// *zone_labels to the number of labels in the zone's name
+struct TrieNode* lookupQuestionZone(struct TrieNode* root, const struct dns_msg_view* query,
+                                    struct TrieNode** node, int* nr_matched, int* zone_labels);
+// lookupQuestionZone() for nr_queries questions at once, found[i] for queries[i]. the index lookups
+// of a group go through perfectHashLookupBatch() and the walks left over advance one level at a
+// time together, each prefetching its next node's children before any of them is compared, so a
+// batch pays for about one cache miss per level instead of one per query and level
+void lookupQuestionZoneBatch(struct TrieNode* root, const struct dns_msg_view* queries, int nr_queries,
+                             struct ZoneLookup* found);
 
 #ifdef __cplusplus
 }